@@ -5,21 +5,56 @@
     Tested With:    https://github.com/Timendus/chip8-test-suite?tab=readme-ov-file#chip-8-test-suite
 */
 
+#if !defined(_WIN32)
+    #define _POSIX_C_SOURCE 200809L     // clock_gettime() for the headless timer
+#endif
+
 #include <raylib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>                       // sqrt() for the --bench spread
+#include <time.h>
+#include <pthread.h>                    // the --batch workers and the window's CPU thread
+#include <stdatomic.h>
+
+#if !defined(_WIN32)
+    #include <unistd.h>                 // sysconf() to count the cores
+    #include <fcntl.h>                  // and open()/mmap() for the ROM packs
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>             // and the UDP framebuffer stream
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <netdb.h>
+#endif
 
 //----------------------------------------------------------------------------------
 // Defines / Config
 //----------------------------------------------------------------------------------
 #define C8_FILENAME             "rom.ch8"
-#define C8_DEBUG_MODE           true
+
+// -DC8_DEBUG_MODE=true builds in the profiler: every instruction is counted and
+// timed, per opcode and per address, and written to C8_PROFILE_FILENAME at exit
+// (the window also shows the top few live). Left off, none of it is compiled.
+#ifndef C8_DEBUG_MODE
+    #define C8_DEBUG_MODE       false
+#endif
+#define C8_PROFILE_FILENAME     "profile.csv"
+#define C8_PROFILE_HOT_PCS      32
+#define C8_PROFILE_OVERLAY_OPS  6
 #define C8_WIDTH                64
 #define C8_HEIGHT               32
+#define C8_HIRES_WIDTH          128
+#define C8_HIRES_HEIGHT         64
 #define C8_MEMORY               4096
 #define C8_START                512
+#define C8_MAX_ROM_SIZE         (C8_MEMORY - C8_START)
+#define C8_PAGE_SIZE            256
+#define C8_PAGE_COUNT           (C8_MEMORY / C8_PAGE_SIZE)
+#define C8_ALL_PAGES            ((1u << C8_PAGE_COUNT) - 1)
 #define C8_STACK_SIZE           16
 #define C8_V_REGISTER_COUNT     16
 #define C8_PIXEL_WIDTH          10
@@ -28,6 +63,169 @@
 #define C8_V0                   0
 #define C8_CLOCK_SPEED          500
 #define C8_TIMER_SPEED          60
+#define C8_MAX_CATCHUP_CYCLES   (C8_CLOCK_SPEED / 4)
+#define C8_MAX_CATCHUP_TICKS    (C8_TIMER_SPEED / 4)
+#define C8_METRICS_INTERVAL     1.0     // seconds between HUD updates and --metrics lines
+#define C8_HEADLESS_FRAMES      600
+#define C8_BENCH_RUNS           5
+#define C8_BENCH_SEED           0xC8
+#define C8_BENCH_OPS            1000000
+#define C8_BENCH_FRAMES         64
+#define C8_BENCH_RENDERS        600
+#define C8_BENCH_TOLERANCE      0.10
+#define C8_GOLDEN_FILENAME      "golden.txt"
+#define C8_TEST_FRAMES          600
+#define C8_GOLDEN_LINE          512     // longest line in a golden file, name and all
+#define C8_DEFAULT_SEED         0xC8C8C8C8
+#define C8_BATCH_CHUNK          10000
+#define C8_BATCH_MAX_THREADS    256
+
+// How many machines the lockstep engine runs side by side in one group, one
+// byte per machine in a vector register. 16 fills an SSE2/NEON register, build
+// with -DC8_LANES=32 -mavx2 for AVX2. No more than 32 (lanes are a bitmask).
+#ifndef C8_LANES
+    #define C8_LANES            16
+#endif
+#define C8_SNAPSHOT_MAGIC       "C8ST"
+#define C8_SNAPSHOT_VERSION     4
+#define C8_BLOCK_MAX_LENGTH     32
+#define C8_BLOCK_POOL_SIZE      (C8_MEMORY / 2)
+
+// Which interpreter core run_cycles() uses, pick one at build time with e.g.
+// -DC8_DISPATCH=C8_DISPATCH_THREADED (--bench-dispatch compares them all).
+#define C8_DISPATCH_TABLE       0       // function pointer tables
+#define C8_DISPATCH_SWITCH      1       // one big switch-statement
+#define C8_DISPATCH_THREADED    2       // computed goto (GCC/Clang only)
+#define C8_DISPATCH_BLOCKS      3       // basic block recompiler
+
+#ifndef C8_DISPATCH
+    #define C8_DISPATCH         C8_DISPATCH_TABLE
+#endif
+
+#if (C8_DISPATCH == C8_DISPATCH_THREADED) && !defined(__GNUC__)
+    #undef C8_DISPATCH
+    #define C8_DISPATCH         C8_DISPATCH_SWITCH
+#endif
+
+// The platforms don't agree on what a handful of instructions do. Each --quirks
+// profile says, for its platform, whether 8xy1/8xy2/8xy3 reset VF, whether
+// 8xy6/8xyE shift Vy into Vx (rather than Vx in place), whether Fx55/Fx65 move
+// I on past the registers, whether Bnnn jumps to nnn + Vx (Bxnn) rather than
+// V0, and whether sprites are clipped at the edges of the screen rather than
+// wrapped. The last column is whether the SUPER-CHIP instructions are there at
+// all (the 128x64 mode, scrolling, 16x16 sprites, the big font and the flag
+// registers), without it 00Cn/00FB-00FF/Fx30/Fx75/Fx85 are ignored like any
+// other unknown opcode. cowgod is what raychip-8 has always done, by Cowgod's
+// reference.
+//                          reset VF    shift Vy    move I  jump Vx clip    super-chip
+#define C8_QUIRKS_LIST(X) \
+    X(COWGOD,   "cowgod",   false,      false,      false,  false,  false,  false)  \
+    X(CHIP8,    "chip8",    true,       true,       true,   false,  true,   false)  \
+    X(SCHIP,    "schip",    false,      false,      false,  true,   true,   true)   \
+    X(XOCHIP,   "xochip",   false,      true,       true,   false,  false,  true)
+
+#define C8_DEFAULT_KEYMAP       "X123QWEASDZC4RFV"  // the host key for each of 0-F
+#define C8_HOST_KEYS            512                 // raylib's key codes are all below this
+#define C8_KEYPAD_X             10
+#define C8_KEYPAD_Y             10
+#define C8_KEYPAD_SIZE          95
+#define C8_HUD_X                10      // under the keypad
+#define C8_HUD_Y                115
+#define C8_HUD_WIDTH            105     // up to the frame round the screen
+#define C8_HUD_HEIGHT           72      // six lines
+
+// The raw machine state is laid out as: RAM, V0-VF, I, DT, ST, PC, SP, the stack,
+// the display rows, the keypad, the random number generator, and then
+// SUPER-CHIP's mode, 128x64 display rows and flag registers (version 1
+// snapshots stop at the keypad, versions 2 and 3 at the generator). Multi-byte
+// values are stored little-endian apart from the display rows which are
+// big-endian (so bytes read left to right).
+#define C8_STATE_RAM            0
+#define C8_STATE_V              (C8_STATE_RAM + C8_MEMORY)
+#define C8_STATE_I              (C8_STATE_V + C8_V_REGISTER_COUNT)
+#define C8_STATE_DT             (C8_STATE_I + 2)
+#define C8_STATE_ST             (C8_STATE_DT + 1)
+#define C8_STATE_PC             (C8_STATE_ST + 1)
+#define C8_STATE_SP             (C8_STATE_PC + 2)
+#define C8_STATE_STACK          (C8_STATE_SP + 1)
+#define C8_STATE_BUFFER         (C8_STATE_STACK + (C8_STACK_SIZE * 2))
+#define C8_STATE_KEYBOARD       (C8_STATE_BUFFER + (C8_HEIGHT * 8))
+#define C8_STATE_RANDOM         (C8_STATE_KEYBOARD + 2)
+#define C8_STATE_HIRES          (C8_STATE_RANDOM + 4)
+#define C8_STATE_HIRES_BUFFER   (C8_STATE_HIRES + 1)
+#define C8_STATE_FLAGS          (C8_STATE_HIRES_BUFFER + (C8_HIRES_HEIGHT * 16))
+#define C8_STATE_SIZE           (C8_STATE_FLAGS + C8_V_REGISTER_COUNT)
+
+// A snapshot is a small header followed by the raw state XORed against the state
+// of the machine straight after the ROM was loaded, run-length encoded. Most of
+// RAM is the ROM itself and never changes, so most of that XOR is zeros, and
+// since version 3 the RAM pages that are still as they were at boot are left
+// out altogether. The worst case for the encoding is one extra byte for every 128.
+#define C8_SNAPSHOT_HEADER_SIZE 16
+#define C8_SNAPSHOT_MAX_SIZE    (C8_SNAPSHOT_HEADER_SIZE + C8_STATE_SIZE + (C8_STATE_SIZE / 128) + 1)
+
+// Rewind keeps one entry per 60Hz frame for up to 30 seconds, in a fixed size
+// arena. Every C8_REWIND_KEYFRAME_INTERVAL frames is a keyframe.
+#define C8_REWIND_SECONDS               30
+#define C8_REWIND_FRAMES                (C8_REWIND_SECONDS * C8_TIMER_SPEED)
+#define C8_REWIND_KEYFRAME_INTERVAL     60
+#define C8_REWIND_ARENA_SIZE            (512 * 1024)
+#define C8_REWIND_KEY                   KEY_BACKSPACE
+
+// An input log is a header (magic, version, seed, boot hash and how many cycles
+// the session ran for) followed by fixed size events: the cycle, what happened
+// and the keypad as of then.
+#define C8_INPUT_MAGIC          "C8IN"
+#define C8_INPUT_VERSION        1
+#define C8_INPUT_HEADER_SIZE    32
+#define C8_INPUT_EVENT_SIZE     11
+#define C8_INPUT_KEYS           1       // the keypad changed
+#define C8_INPUT_TICK           2       // the timers ticked
+
+// A ROM pack is a header (magic, version, how many ROMs) and an index of fixed
+// size entries (name, offset, size and FNV-1a hash of each ROM), followed by
+// the ROMs themselves. ROMs with the same contents share their data.
+#define C8_PACK_MAGIC           "C8PK"
+#define C8_PACK_VERSION         1
+#define C8_PACK_EXTENSION       ".c8pk"
+#define C8_PACK_HEADER_SIZE     16
+#define C8_PACK_ENTRY_SIZE      64
+#define C8_PACK_NAME_SIZE       48
+
+// A streamed frame is one UDP packet: a header (magic, flags, session, sequence
+// number and which rows are in it) then those rows, XORed against the last
+// frame sent (or not, for a keyframe) and run-length encoded.
+#define C8_STREAM_MAGIC         "C8FB"
+#define C8_STREAM_HEADER_SIZE   16
+#define C8_STREAM_MAX_PACKET    (C8_STREAM_HEADER_SIZE + (C8_HEIGHT * 8) + ((C8_HEIGHT * 8) / 128) + 1)
+#define C8_STREAM_KEYFRAME      1
+#define C8_STREAM_FPS           60
+#define C8_STREAM_KEYFRAME_SECONDS 1.0
+#define C8_VIEW_GRID            8
+#define C8_VIEW_SESSIONS        (C8_VIEW_GRID * C8_VIEW_GRID)
+
+// --capture records the display at every 60Hz tick into an animated GIF, black
+// and green like the window, scaled up by --capture-scale. Frames queue up for
+// the encoder thread, about a minute's worth, and past that they're dropped.
+#define C8_CAPTURE_QUEUE        4096    // a power of two
+#define C8_CAPTURE_SCALE        4
+#define C8_CAPTURE_MAX_SCALE    16
+#define C8_CAPTURE_MIN_DELAY    2       // centiseconds, browsers slow anything shorter right down
+#define C8_GIF_CODE_SIZE        2       // the smallest GIF allows, for two colours
+#define C8_GIF_MAX_CODES        4096
+
+// The beeper's square wave, 16-bit mono. A smaller buffer starts and stops a
+// beep closer to when ST says, at the cost of more audio callbacks.
+#define C8_AUDIO_SAMPLE_RATE    44100
+#define C8_AUDIO_BUFFER_FRAMES  512     // about 12ms, how late a beep can start or stop
+#define C8_BEEPER_TONE          440     // Hz, with the default pattern
+#define C8_BEEPER_AMPLITUDE     6000    // out of 32767
+
+// The window's CPU and render threads share three frames. The fresh bit on the
+// middle one's index means the render thread hasn't seen it yet.
+#define C8_FRAME_FRESH          4
+#define C8_REQUEST_SAVE         1       // F5
+#define C8_REQUEST_LOAD         2       // F9
 
 #define C8_FONT_0_ADDR          0x000
 #define C8_FONT_1_ADDR          0x005
@@ -45,6 +243,8 @@
 #define C8_FONT_D_ADDR          0x041
 #define C8_FONT_E_ADDR          0x046
 #define C8_FONT_F_ADDR          0x04B
+#define C8_BIG_FONT_ADDR        0x050   // straight after the small one, 10 bytes a digit
+#define C8_BIG_FONT_SIZE        10
 
 //----------------------------------------------------------------------------------
 // Typedefs
@@ -61,543 +261,6757 @@ typedef struct C8_Instruction
     unsigned char skip;
 } C8_Instruction;
 
+typedef struct C8_Machine C8_Machine;
+
+typedef void (*C8_Handler)(C8_Machine *machine, C8_Instruction *instruction);
+
+// One of the interpreter cores, runs count cycles on the machine.
+typedef void (*C8_Engine)(C8_Machine *machine, int count);
+
+// Every instruction in the set, in one place, so that the switch and computed
+// goto cores can be generated from it rather than kept in sync by hand. The
+// third block are the other half of the instructions that C8_QUIRKS_LIST
+// covers, and the last are SUPER-CHIP's.
+#define C8_INSTRUCTION_LIST(X) \
+    X(SYS_ADDR)         X(CLS)              X(RET)              X(JP_ADDR)          \
+    X(CALL_ADDR)        X(SE_VX_BYTE)       X(SNE_VX_BYTE)      X(SE_VX_VY)         \
+    X(LD_VX_BYTE)       X(ADD_VX_BYTE)      X(LD_VX_VY)         X(OR_VX_VY)         \
+    X(AND_VX_VY)        X(XOR_VX_VY)        X(ADD_VX_VY)        X(SUB_VX_VY)        \
+    X(SHR_VX_VY)        X(SUBN_VX_VY)       X(SHL_VX_VY)        X(SNE_VX_VY)        \
+    X(LD_I_ADDR)        X(JP_V0_ADDR)       X(RND_VX_BYTE)      X(DRW_VX_VY_NIBBLE) \
+    X(SKP_VX)           X(SKNP_VX)          X(LD_VX_DT)         X(LD_VX_K)          \
+    X(LD_DT_VX)         X(LD_ST_VX)         X(ADD_I_VX)         X(LD_F_VX)          \
+    X(LD_B_VX)          X(LD_I_VX)          X(LD_VX_I)          \
+    X(OR_VX_VY_RESET_VF)        X(AND_VX_VY_RESET_VF)       X(XOR_VX_VY_RESET_VF)       \
+    X(SHR_VX_VY_SHIFT_VY)       X(SHL_VX_VY_SHIFT_VY)       X(JP_VX_ADDR)               \
+    X(LD_I_VX_MOVE_I)           X(LD_VX_I_MOVE_I)           X(DRW_VX_VY_NIBBLE_CLIP)    \
+    X(SCD_NIBBLE)       X(SCR)              X(SCL)              X(EXIT)             \
+    X(LOW)              X(HIGH)             X(LD_HF_VX)         X(LD_R_VX)          \
+    X(LD_VX_R)
+
+#define C8_OP_ENUM(name)        C8_OP_##name,
+
+typedef enum C8_Op
+{
+    C8_INSTRUCTION_LIST(C8_OP_ENUM)
+    C8_OP_COUNT
+} C8_Op;
+
+#define C8_QUIRKS_ENUM(id, name, resetVF, shiftVy, moveI, jumpVx, clip, superChip)    C8_QUIRKS_##id,
+
+typedef enum C8_Quirks
+{
+    C8_QUIRKS_LIST(C8_QUIRKS_ENUM)
+    C8_QUIRKS_COUNT
+} C8_Quirks;
+
+typedef struct C8_QuirkProfile
+{
+    const char *name;
+    bool resetVF;
+    bool shiftVy;
+    bool moveI;
+    bool jumpVx;
+    bool clip;
+    bool superChip;
+} C8_QuirkProfile;
+
+// The dispatch tables for one --quirks profile, the main one (by the first
+// nibble) and a subtable for each group of instructions that share one.
+typedef struct C8_InstructionSet
+{
+    C8_Handler main[16];
+    C8_Handler sub0x0[256];
+    C8_Handler sub0x8[16];
+    C8_Handler sub0xE[256];
+    C8_Handler sub0xF[256];
+} C8_InstructionSet;
+
+#if C8_DEBUG_MODE
+// How many times each instruction ran and how long it took in total (in
+// read_profile_clock() ticks), how many times the instruction at each address
+// ran, and how many cycles were skipped as idle rather than run.
+typedef struct C8_Profile
+{
+    unsigned long long OpCount[C8_OP_COUNT];
+    unsigned long long OpTicks[C8_OP_COUNT];
+    unsigned long long PCCount[C8_MEMORY];
+    unsigned long long IdleCycles;
+} C8_Profile;
+#endif
+
+// An instruction that has already been through parse_instruction(), along with
+// the final handler it resolves to (i.e. the subtable entry, not the
+// execute_0x?_instruction() that looks it up).
+// (op sits in the padding after the instruction, so one of these is 24 bytes.)
+typedef struct C8_DecodedInstruction
+{
+    C8_Instruction instruction;
+    unsigned char op;
+    C8_Handler handler;
+} C8_DecodedInstruction;
+
+// A basic block is a run of straight-line instructions that ends with the first
+// one that can change the flow of the program (jump, call, return, skip), wait
+// (Fx0A), draw, or write to memory. Once translated, a block is just an array
+// of ready-to-call closures (handler + already decoded operands) that can be run
+// start to finish without fetching or decoding anything.
+typedef struct C8_Block
+{
+    C8_DecodedInstruction *code;
+    unsigned short length;
+    unsigned short generation;
+} C8_Block;
+
+// Everything that makes up one Chip-8, so that as many of them as we like can
+// run side by side in one process - every instruction is handed the machine it
+// is running on. The registers that nearly every instruction touches come first
+// so that they (and the stack) all fit in the first 64 bytes, one cache line,
+// with the display, RAM and the (big) caches after them.
+struct C8_Machine
+{
+    // Chip-8 has 16 general purpose 8-bit registers, usually referred to as Vx, where x 
+    // is a hexadecimal digit (0 through F). The VF register should not be used by any 
+    // program, as it is used as a flag by some instructions. 
+    unsigned char V[C8_V_REGISTER_COUNT];
+
+    // The program counter (PC) should be 16-bit, and is used to store the currently 
+    // executing address.
+    unsigned short PC;
+
+    // There is also a 16-bit register called I. This register is generally used to store 
+    // memory addresses, so only the lowest (rightmost) 12 bits are usually used.
+    unsigned short I;
+
+    // The stack pointer (SP) can be 8-bit, it is used to point to the topmost level 
+    // of the stack.
+    unsigned char SP;
+
+    // Chip-8 also has two special purpose 8-bit registers, for the delay and sound timers. 
+    // When these registers are non-zero, they are automatically decremented at a rate of 
+    // 60Hz. See the section 2.5, Timers & Sound, for more information on these.
+    unsigned char DT;
+    unsigned char ST;
+
+    // The stack is an array of 16 16-bit values, used to store the address that the 
+    // interpreter shoud return to when finished with a subroutine. Chip-8 allows for 
+    // up to 16 levels of nested subroutines.
+    unsigned short STACK[C8_STACK_SIZE];
+
+    // Which rows of the buffer have been drawn to (one bit per row, or per pair
+    // of rows in the 128x64 mode, which is also one row of a --stream) since
+    // they were last looked at, and whether anything on the display has changed
+    // at all. The window's CPU thread sends the rows along with each frame and
+    // clears them, headless the stream does. When nothing has changed there's
+    // no need to render anything.
+    uint32_t DirtyRows;
+    bool DisplayChanged;
+
+    // Whether SUPER-CHIP's 128x64 mode is on (00FF) - HiresBuffer is the
+    // display while it is, Buffer the rest of the time.
+    bool HighRes;
+
+    // The computers which originally used the Chip-8 Language had a 16-key hexadecimal keypad.
+    // One bit per key (key 0 in bit 0), as it is in the state and the input logs.
+    // KeyPresses are the keys that have gone down since Fx0A started waiting,
+    // which is what it's waiting for.
+    uint16_t Keys;
+    uint16_t KeyPresses;
+    bool WaitingForKey;
+
+    // Cxkk's random numbers (xorshift32, never zero). Each machine has its own
+    // so that machines on different threads don't share one generator, and so
+    // that the same seed always gives the same run.
+    uint32_t Random;
+
+    // SUPER-CHIP's "RPL user flags" (Fx75/Fx85), somewhere for a game to keep
+    // a few registers (the HP-48's own calculator flags, originally).
+    unsigned char Flags[C8_V_REGISTER_COUNT];
+
+    // How many cycles the machine has run since it was reset. Not part of the
+    // state, it's the clock that input logs are timed against.
+    long long Cycles;
+
+    // The --quirks profile the machine was reset with, and the tables built for
+    // it (see instruction_sets). Not part of the state either.
+    const C8_QuirkProfile *Quirks;
+    const C8_InstructionSet *Instructions;
+
+#if C8_DEBUG_MODE
+    // Only with the profiler built in, see C8_DEBUG_MODE.
+    C8_Profile Profile;
+#endif
+
+    // The original implementation of the Chip-8 language used a 64x32-pixel monochrome
+    // display with this format:
+    //                           +--------------------+
+    //                           |(0,0)        (63, 0)|
+    //                           |                    |
+    //                           |                    |
+    //                           |                    |
+    //                           |(0,31)       (64,31)|
+    //                           +--------------------+
+    // Chip-8 draws graphics on screen through the use of sprites. A sprite is a group
+    // of bytes which are a binary representation of the desired picture. Chip-8 sprites
+    // may be up to 15 bytes, for a possible sprite size of 8x15.
+    // The display is 1-bit and exactly 64 pixels wide, so each row is packed into one
+    // 64-bit word with x = 0 in the most-significant bit (the same way round as the
+    // bits in a sprite byte). The whole screen is 256 bytes.
+    uint64_t Buffer[C8_HEIGHT];
+
+    // SUPER-CHIP's 128x64 mode, each row is two of the same words side by side
+    // ([0] is x = 0-63, [1] is x = 64-127), so 128 bits with x = 0 in the top
+    // bit of the first. A 16 byte row is one SSE/NEON register, and the
+    // scrolls are written as plain shifts over the pair so that the compiler
+    // can do them that way.
+    uint64_t HiresBuffer[C8_HIRES_HEIGHT][2];
+
+    // The Chip-8 language is capable of accessing up to 4KB (4,096 bytes) of RAM, from 
+    // location 0x000 (0) to 0xFFF (4095). The first 512 bytes, from 0x000 to 0x1FF, are 
+    // where the original interpreter was located, and should not be used by programs.
+    // Most Chip-8 programs start at location 0x200 (512)
+    // RAM is split into C8_PAGE_SIZE pages. Until a page is written to it is read
+    // straight out of Image, the RAM just after boot, which every machine running
+    // the same ROM shares. The first write copies the page into the machine's own
+    // RAM (at the same offset) and sets its bit in PrivatePages. So always go
+    // through read_ram()/write_ram() rather than at RAM directly.
+    const unsigned char *Image;
+    uint32_t PrivatePages;
+    unsigned char RAM[C8_MEMORY];
+
+    // Decoding the same bytes over and over for every cycle is wasted work as most
+    // programs are tight loops. So keep one decoded instruction per (even) address
+    // in RAM - a NULL handler means that slot still needs decoding. Anything that 
+    // writes to RAM has to invalidate the slots it touches (self-modifying code).
+    C8_DecodedInstruction DecodeCache[C8_MEMORY / 2];
+
+    // Translated blocks, keyed by their start address (again, even addresses only).
+    // The closures themselves live in one pool that's handed out front to back and
+    // thrown away all at once, along with every block, whenever a program writes to
+    // an address that any block was translated from (or when the pool runs out).
+    // Throwing everything away is just bumping the generation - blocks and coverage
+    // from an older generation don't count - as some programs do it every frame.
+    C8_Block BlockCache[C8_MEMORY / 2];
+    C8_DecodedInstruction BlockPool[C8_BLOCK_POOL_SIZE];
+    int BlockPoolUsed;
+    unsigned short BlockCoverage[C8_MEMORY];
+    unsigned short BlockGeneration;
+
+    // The raw state of the machine just after the ROM was loaded, what snapshots are
+    // compared against, and the hash of it so a snapshot can't be loaded on top of
+    // a different ROM.
+    unsigned char BootState[C8_STATE_SIZE];
+    unsigned long long BootHash;
+};
+
+// One frame of rewind history in the arena. A keyframe is the whole state
+// (XORed against the boot state, like a snapshot), anything else is the state
+// XORed against the frame before it. Both are run-length encoded.
+typedef struct C8_RewindEntry
+{
+    int offset;
+    unsigned short size;
+    bool keyframe;
+} C8_RewindEntry;
+
+// One machine in a --batch run and how far it has got.
+typedef struct C8_BatchJob
+{
+    const char *filename;
+    int instance;
+    unsigned int seed;
+    C8_Machine *machine;
+    long long executed;
+    long long frames;
+    double wallTime;
+} C8_BatchJob;
+
+// Every worker has its own queue of jobs (indices into the batch). A worker
+// takes from the back of its own queue and puts a job back there after each
+// chunk, so it keeps running the same machine while the machine is still warm
+// in its cache. When its queue runs dry it steals from the front of someone
+// else's, which is the job that queue's owner would have got to last.
+typedef struct C8_WorkQueue
+{
+    pthread_mutex_t lock;
+    int *jobs;
+    int capacity;
+    int head;
+    int count;
+} C8_WorkQueue;
+
+typedef struct C8_Batch
+{
+    C8_BatchJob *jobs;
+    int jobCount;
+    C8_WorkQueue *queues;
+    int workerCount;
+    long long totalCycles;
+    long long chunk;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // a job went back in a queue, or the last one finished
+    atomic_uint requeued;           // how many times a job has gone back, bumped under lock
+    int remaining;
+    struct C8_Metrics *metrics;     // NULL without --metrics
+} C8_Batch;
+
+// The lockstep engine keeps the registers of a group of machines running the
+// same ROM side by side (structure-of-arrays, V[x][lane]) so that when several
+// of them are at the same instruction, which is most of the time, it can be done
+// for all of them at once with vector operations. The rest of each machine (RAM,
+// stack, display...) stays in its own C8_Machine.
+#if defined(__GNUC__)
+typedef unsigned char C8_LaneBytes __attribute__((vector_size(C8_LANES)));
+typedef signed char C8_LaneFlags __attribute__((vector_size(C8_LANES)));
+typedef unsigned short C8_LaneShorts __attribute__((vector_size(C8_LANES * 2)));
+typedef int C8_LaneInts __attribute__((vector_size(C8_LANES * 4)));
+
+typedef struct C8_LaneGroup
+{
+    C8_LaneBytes V[C8_V_REGISTER_COUNT];
+    C8_LaneShorts PC;
+    C8_LaneShorts I;
+    C8_LaneBytes DT;
+    C8_LaneBytes ST;
+    C8_Machine *machines[C8_LANES];
+    uint32_t active;
+    uint32_t written;
+} C8_LaneGroup;
+#endif
+
+// Everything that happened to a machine from the outside during a session in
+// the window, in order: the keypad changing and the timers ticking, each at the
+// cycle it happened on. Together with the seed that's all it takes to run the
+// same session again, bit for bit, headless.
+typedef struct C8_InputEvent
+{
+    long long cycle;
+    unsigned char kind;
+    unsigned short keys;
+} C8_InputEvent;
+
+typedef struct C8_InputLog
+{
+    uint32_t seed;
+    unsigned long long bootHash;
+    long long cycles;
+    C8_InputEvent *events;
+    int count;
+    int capacity;
+    unsigned short keys;
+} C8_InputLog;
+
+// How well the host kept up over the last C8_METRICS_INTERVAL, for the HUD and
+// --metrics. Anything that isn't measured in a mode is negative, and comes out
+// as null in the JSON.
+typedef struct C8_Stats
+{
+    long long cycles;           // run so far, every machine added together
+    double ips;
+    double targetIps;           // C8_CLOCK_SPEED for every machine
+    double frameTime;           // ms between frames drawn
+    double timerJitter;         // ms, the latest a 60Hz tick has come
+    long long droppedCycles;    // thrown away by the catch-up limit, so far
+    double dispatchTime;        // ms per second running instructions
+    double drawTime;            // ms per second in render_buffer()
+} C8_Stats;
+
+// What the render thread needs from the machine to draw a frame, copied out by
+// the CPU thread.
+typedef struct C8_Frame
+{
+    uint64_t Buffer[C8_HEIGHT];
+    uint64_t HiresBuffer[C8_HIRES_HEIGHT][2];
+    bool HighRes;
+    uint32_t DirtyRows;         // the machine's, since the last frame the render thread took
+    C8_Stats Stats;
+#if C8_DEBUG_MODE
+    unsigned long long OpCount[C8_OP_COUNT];
+    unsigned long long OpTicks[C8_OP_COUNT];
+#endif
+} C8_Frame;
+
+// A triple buffer: the CPU thread always has a frame of its own to fill in
+// (back), the render thread one to draw from (front), and the spare (middle)
+// is swapped with one or the other. Only the swap needs to be atomic, neither
+// thread ever waits for the other.
+typedef struct C8_FrameExchange
+{
+    C8_Frame frames[3];
+    int back;
+    int front;
+    atomic_uint middle;
+} C8_FrameExchange;
+
+// What the viewer of one streamed session was last sent.
+typedef struct C8_StreamSession
+{
+    uint64_t sent[C8_HEIGHT];
+    uint32_t dirty;             // rows drawn to since then
+    uint32_t sequence;
+    double lastSent;
+    double lastKeyframe;
+} C8_StreamSession;
+
+typedef struct C8_Stream
+{
+    int socket;
+#if !defined(_WIN32)
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+#endif
+    C8_StreamSession *sessions;
+    int sessionCount;
+} C8_Stream;
+
+// And what the viewer has made of it.
+typedef struct C8_ViewSession
+{
+    uint64_t Buffer[C8_HEIGHT];
+    uint32_t sequence;
+    bool synced;
+    bool active;
+} C8_ViewSession;
+
+// One tick's display, waiting for the encoder. The tick is when it was taken,
+// so frames that were dropped still take up their time in the GIF. It's always
+// 128x64, the 64x32 mode has every pixel doubled up on the way in so that the
+// encoder doesn't have to care which mode it was.
+typedef struct C8_CaptureFrame
+{
+    uint64_t Buffer[C8_HIRES_HEIGHT][2];
+    long long tick;
+} C8_CaptureFrame;
+
+// A ring of frames between the thread running the machine and the encoder, one
+// writer and one reader. head is only ever moved by the former and tail by the
+// latter, so neither waits on the other. Everything after last belongs to the
+// encoder.
+typedef struct C8_Capture
+{
+    C8_CaptureFrame *frames;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool done;
+    long long ticks;
+    long long dropped;
+    uint64_t last[C8_HIRES_HEIGHT][2];      // the last frame queued
+    pthread_t thread;
+    FILE *file;
+    int scale;
+    uint64_t shown[C8_HIRES_HEIGHT][2];     // what the GIF shows so far
+    uint64_t pending[C8_HIRES_HEIGHT][2];   // the frame after that, still running on
+    bool started;
+    bool havePending;
+    long long writtenTime;              // centiseconds of GIF so far
+    unsigned short codes[C8_GIF_MAX_CODES][2];
+    unsigned char block[255];
+    int blockSize;
+    uint32_t bits;
+    int bitCount;
+} C8_Capture;
+
+// Where --metrics writes its JSON lines to, a file or (like --stream) a UDP
+// socket with a line in each packet. Headless and batch runs have a thread that
+// samples the counters, the runners only ever add to them.
+typedef struct C8_Metrics
+{
+    FILE *file;
+    C8_Stream stream;
+    bool udp;
+    const char *mode;
+    int machineCount;
+    double startTime;
+    atomic_llong cycles;
+    atomic_llong busyNanos;     // added up over the workers
+    bool timed;                 // whether the runners add to busyNanos (batch does)
+    atomic_bool running;
+    pthread_t thread;
+} C8_Metrics;
+
+// Everything the two threads in the window share. The keypad, the rewind key
+// and F5/F9 go one way, frames go the other.
+typedef struct C8_Emulator
+{
+    C8_Machine *machine;
+    C8_Stream *stream;
+    C8_Capture *capture;
+    C8_FrameExchange exchange;
+    const char *statePath;
+    C8_InputLog *inputLog;
+    atomic_uint keys;
+    atomic_uint presses;        // keys that went down since the CPU thread last looked
+    atomic_int requests;
+    atomic_bool rewinding;
+    atomic_bool running;
+} C8_Emulator;
+
+// A machine that's being reset on its own thread while the window opens.
+typedef struct C8_Boot
+{
+    C8_Machine *machine;
+    const char *filename;
+    C8_Quirks quirks;
+} C8_Boot;
+
+// The RAM of a freshly booted machine (font and ROM), shared read-only by every
+// machine that booted from the same ROM. They're kept until the process exits.
+typedef struct C8_BootImage
+{
+    unsigned char RAM[C8_MEMORY];
+    unsigned long long hash;
+    struct C8_BootImage *next;
+} C8_BootImage;
+
+// An open ROM pack. The whole file is mapped in read-only (or, where there's
+// no mmap(), read in in one go) and the ROMs are used straight out of it.
+typedef struct C8_Pack
+{
+    const unsigned char *data;
+    int size;
+    int count;
+    bool mapped;
+} C8_Pack;
+
+// One line of the --test golden file: what the display of a ROM should hash
+// to after a given number of cycles.
+typedef struct C8_GoldenEntry
+{
+    char name[C8_GOLDEN_LINE];
+    long long cycles;
+    unsigned long long hash;
+} C8_GoldenEntry;
+
+typedef struct C8_Worker
+{
+    C8_Batch *batch;
+    int index;
+} C8_Worker;
+
+typedef struct C8_Options
+{
+    const char *filename;
+    C8_Quirks quirks;
+    bool headless;
+    long long cycles;
+    long long frames;
+    bool benchDispatch;
+    bool bench;
+    const char *baseline;
+    const char *saveBaseline;
+    bool test;
+    const char *golden;
+    bool updateGolden;
+    const char **filenames;
+    int filenameCount;
+    const char *packCreate;
+    const char *stream;
+    const char *view;
+    const char *capture;
+    int captureScale;
+    const char *loadState;
+    const char *saveState;
+    bool resume;
+    int instances;
+    bool batch;
+    bool lockstep;
+    int threads;
+    long long chunk;
+    unsigned int seed;
+    const char *recordInput;
+    const char *replayInput;
+    const char *keymap;
+    const char *metrics;
+} C8_Options;
+
 //----------------------------------------------------------------------------------
 // Local Variables Definition (local to this module)
 //----------------------------------------------------------------------------------
 
-// The Chip-8 language is capable of accessing up to 4KB (4,096 bytes) of RAM, from 
-// location 0x000 (0) to 0xFFF (4095). The first 512 bytes, from 0x000 to 0x1FF, are 
-// where the original interpreter was located, and should not be used by programs.
-// Most Chip-8 programs start at location 0x200 (512)
-unsigned char C8_RAM[C8_MEMORY]           = {0};
-
-// Chip-8 has 16 general purpose 8-bit registers, usually referred to as Vx, where x 
-// is a hexadecimal digit (0 through F). The VF register should not be used by any 
-// program, as it is used as a flag by some instructions. 
-unsigned char C8_V[C8_V_REGISTER_COUNT]   = {0};
-
-// There is also a 16-bit register called I. This register is generally used to store 
-// memory addresses, so only the lowest (rightmost) 12 bits are usually used.
-unsigned short C8_I                       = 0;
-
-// Chip-8 also has two special purpose 8-bit registers, for the delay and sound timers. 
-// When these registers are non-zero, they are automatically decremented at a rate of 
-// 60Hz. See the section 2.5, Timers & Sound, for more information on these.
-unsigned char C8_ST                       = 0;
-unsigned char C8_DT                       = 0;
-
-// The program counter (PC) should be 16-bit, and is used to store the currently 
-// executing address.
-unsigned short C8_PC                      = C8_START;
-
-// The stack pointer (SP) can be 8-bit, it is used to point to the topmost level 
-// of the stack.
-unsigned char C8_SP                       = 0;
-
-// The stack is an array of 16 16-bit values, used to store the address that the 
-// interpreter shoud return to when finished with a subroutine. Chip-8 allows for 
-// up to 16 levels of nested subroutines.
-unsigned short C8_STACK[C8_STACK_SIZE]    = {0};
-
-// The original implementation of the Chip-8 language used a 64x32-pixel monochrome
-// display with this format:
-//                           +--------------------+
-//                           |(0,0)        (63, 0)|
-//                           |                    |
-//                           |                    |
-//                           |                    |
-//                           |(0,31)       (64,31)|
-//                           +--------------------+
-// Chip-8 draws graphics on screen through the use of sprites. A sprite is a group
-// of bytes which are a binary representation of the desired picture. Chip-8 sprites
-// may be up to 15 bytes, for a possible sprite size of 8x15.
-bool C8_Buffer[C8_HEIGHT][C8_WIDTH]       = {false};
-
-// The computers which originally used the Chip-8 Language had a 16-key hexadecimal keypad.
-bool C8_Keyboard[0xF]                     = {0};
+// Rewind history. The entries are a ring (oldest at C8_RewindHead) and so is the
+// arena they point into - new frames are written at C8_RewindArenaTail and push
+// the oldest ones out when they'd overlap. The oldest entry is always a keyframe,
+// so C8_RewindState (the state as of the newest entry) can always be rebuilt.
+unsigned char C8_RewindArena[C8_REWIND_ARENA_SIZE]  = {0};
+C8_RewindEntry C8_RewindEntries[C8_REWIND_FRAMES]   = {0};
+int C8_RewindHead                                   = 0;
+int C8_RewindCount                                  = 0;
+int C8_RewindArenaTail                              = 0;
+int C8_RewindSinceKeyframe                          = 0;
+unsigned char C8_RewindState[C8_STATE_SIZE]         = {0};
+
+// The display is drawn by expanding the buffer into one byte per pixel (0 or 255)
+// and uploading that to a small greyscale texture once per frame, which is then
+// drawn scaled up (nearest neighbour) and tinted green. One textured quad per 
+// frame instead of 2048 rectangles.
+unsigned char C8_ScreenPixels[C8_HEIGHT * C8_WIDTH] = {0};
+Texture2D C8_ScreenTexture                = {0};
+
+// What the screen texture is showing, to compare each new frame against.
+uint64_t C8_ScreenRows[C8_HEIGHT]         = {0};
+
+// And the same again for SUPER-CHIP's 128x64 mode, which gets a texture of its
+// own, plus which of the two is on screen.
+unsigned char C8_HiresPixels[C8_HIRES_HEIGHT * C8_HIRES_WIDTH] = {0};
+Texture2D C8_HiresTexture                 = {0};
+uint64_t C8_HiresRows[C8_HIRES_HEIGHT][2] = {0};
+bool C8_ScreenHighRes                     = false;
+
+// Every boot image so far. Machines can be reset from more than one thread (the
+// --batch workers don't, but the window's CPU thread could), hence the lock.
+C8_BootImage *C8_BootImages               = NULL;
+pthread_mutex_t C8_BootImagesLock         = PTHREAD_MUTEX_INITIALIZER;
+
+#if C8_DEBUG_MODE
+// The newest frame the render thread has taken, for the profiler overlay.
+C8_Frame *C8_ShownFrame                   = NULL;
+#endif
+
+// The beeper is a square wave made up on the audio thread, in raylib's stream
+// callback, for as long as C8_BeeperOn is set. The CPU thread sets it from the
+// sound timer, and nothing else has to talk to the audio device once it has
+// started. What it plays is a 128 bit pattern (the top bit of the first word
+// first), C8_BeeperRate bits a second, round and round - the waveform XO-CHIP
+// lets a program load for itself, which would only have to store the two new
+// words here. Until then it's eight on, eight off.
+AudioStream C8_BeeperStream               = {0};
+bool C8_BeeperStarted                     = false;
+atomic_bool C8_BeeperOn                   = false;
+atomic_uint_least64_t C8_BeeperPattern[2] = { 0xFF00FF00FF00FF00ULL, 0xFF00FF00FF00FF00ULL };
+atomic_uint C8_BeeperRate                 = C8_BEEPER_TONE * 16;
+double C8_BeeperPosition                  = 0.0;    // audio thread only
+
+// The keypad only looks different when a key goes up or down, so it is drawn
+// into its own texture when that happens and just copied into every frame.
+RenderTexture2D C8_KeypadTexture          = {0};
+bool C8_KeypadChanged                     = true;
+unsigned short C8_KeypadKeys              = 0;
+
+// The host key for each Chip-8 key, and the other way round (-1 for a key that
+// isn't on the keypad), from --keymap. And what the keypad says on each key.
+int C8_KeyMap[16]                         = {0};
+signed char C8_KeyLookup[C8_HOST_KEYS]    = {0};
+char C8_KeyLabels[16][2]                  = {{0}};
+
+// What the HUD under the keypad shows. The render thread fills it in once every
+// C8_METRICS_INTERVAL, and only then is it drawn into its texture again, like
+// the keypad.
+C8_Stats C8_HudStats                      = {0};
+RenderTexture2D C8_HudTexture             = {0};
+bool C8_HudChanged                        = true;
+
+// The headless runners' counters for --metrics, NULL without it.
+C8_Metrics *C8_ActiveMetrics              = NULL;
 
 //----------------------------------------------------------------------------------
 // Chip-8 Instruction Set Declaration
 //----------------------------------------------------------------------------------
-void C8_SYS_ADDR                (C8_Instruction *instruction);
-void C8_CLS                     (C8_Instruction *instruction);
-void C8_RET                     (C8_Instruction *instruction);
-void C8_JP_ADDR                 (C8_Instruction *instruction);
-void C8_CALL_ADDR               (C8_Instruction *instruction);
-void C8_SE_VX_BYTE              (C8_Instruction *instruction);
-void C8_SNE_VX_BYTE             (C8_Instruction *instruction);
-void C8_SE_VX_VY                (C8_Instruction *instruction);
-void C8_LD_VX_BYTE              (C8_Instruction *instruction);
-void C8_ADD_VX_BYTE             (C8_Instruction *instruction);
-void C8_LD_VX_VY                (C8_Instruction *instruction);
-void C8_OR_VX_VY                (C8_Instruction *instruction);
-void C8_AND_VX_VY               (C8_Instruction *instruction);
-void C8_XOR_VX_VY               (C8_Instruction *instruction);
-void C8_ADD_VX_VY               (C8_Instruction *instruction);
-void C8_SUB_VX_VY               (C8_Instruction *instruction);
-void C8_SHR_VX_VY               (C8_Instruction *instruction);
-void C8_SUBN_VX_VY              (C8_Instruction *instruction);
-void C8_SHL_VX_VY               (C8_Instruction *instruction);
-void C8_SNE_VX_VY               (C8_Instruction *instruction);
-void C8_LD_I_ADDR               (C8_Instruction *instruction);
-void C8_JP_V0_ADDR              (C8_Instruction *instruction);
-void C8_RND_VX_BYTE             (C8_Instruction *instruction);
-void C8_DRW_VX_VY_NIBBLE        (C8_Instruction *instruction);
-void C8_SKP_VX                  (C8_Instruction *instruction);
-void C8_SKNP_VX                 (C8_Instruction *instruction);
-void C8_LD_VX_DT                (C8_Instruction *instruction);
-void C8_LD_VX_K                 (C8_Instruction *instruction);
-void C8_LD_DT_VX                (C8_Instruction *instruction);
-void C8_LD_ST_VX                (C8_Instruction *instruction);
-void C8_ADD_I_VX                (C8_Instruction *instruction);
-void C8_LD_F_VX                 (C8_Instruction *instruction);
-void C8_LD_B_VX                 (C8_Instruction *instruction);
-void C8_LD_I_VX                 (C8_Instruction *instruction);
-void C8_LD_VX_I                 (C8_Instruction *instruction);
+void C8_SYS_ADDR                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_CLS                     (C8_Machine *machine, C8_Instruction *instruction);
+void C8_RET                     (C8_Machine *machine, C8_Instruction *instruction);
+void C8_JP_ADDR                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_CALL_ADDR               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SE_VX_BYTE              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SNE_VX_BYTE             (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SE_VX_VY                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_BYTE              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_ADD_VX_BYTE             (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_VY                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_OR_VX_VY                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_AND_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_XOR_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_ADD_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SUB_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SHR_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SUBN_VX_VY              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SHL_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SNE_VX_VY               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_I_ADDR               (C8_Machine *machine, C8_Instruction *instruction);
+void C8_JP_V0_ADDR              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_RND_VX_BYTE             (C8_Machine *machine, C8_Instruction *instruction);
+void C8_DRW_VX_VY_NIBBLE        (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SKP_VX                  (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SKNP_VX                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_DT                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_K                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_DT_VX                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_ST_VX                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_ADD_I_VX                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_F_VX                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_B_VX                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_I_VX                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_I                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_OR_VX_VY_RESET_VF       (C8_Machine *machine, C8_Instruction *instruction);
+void C8_AND_VX_VY_RESET_VF      (C8_Machine *machine, C8_Instruction *instruction);
+void C8_XOR_VX_VY_RESET_VF      (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SHR_VX_VY_SHIFT_VY      (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SHL_VX_VY_SHIFT_VY      (C8_Machine *machine, C8_Instruction *instruction);
+void C8_JP_VX_ADDR              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_I_VX_MOVE_I          (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_I_MOVE_I          (C8_Machine *machine, C8_Instruction *instruction);
+void C8_DRW_VX_VY_NIBBLE_CLIP   (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SCD_NIBBLE              (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SCR                     (C8_Machine *machine, C8_Instruction *instruction);
+void C8_SCL                     (C8_Machine *machine, C8_Instruction *instruction);
+void C8_EXIT                    (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LOW                     (C8_Machine *machine, C8_Instruction *instruction);
+void C8_HIGH                    (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_HF_VX                (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_R_VX                 (C8_Machine *machine, C8_Instruction *instruction);
+void C8_LD_VX_R                 (C8_Machine *machine, C8_Instruction *instruction);
+
+#define C8_OP_HANDLER(name)     C8_##name,
+
+// The handler for each C8_Op, in the same order as the enum.
+C8_Handler instruction_handlers[C8_OP_COUNT] = { C8_INSTRUCTION_LIST(C8_OP_HANDLER) };
+
+#define C8_OP_NAME(name)        #name,
+
+// And the name of each, for the profiler report.
+const char *instruction_names[C8_OP_COUNT] = { C8_INSTRUCTION_LIST(C8_OP_NAME) };
+
+#define C8_QUIRKS_PROFILE(id, name, resetVF, shiftVy, moveI, jumpVx, clip, superChip) { name, resetVF, shiftVy, moveI, jumpVx, clip, superChip },
+
+// Every --quirks profile, in the same order as C8_Quirks.
+const C8_QuirkProfile quirk_profiles[C8_QUIRKS_COUNT] = { C8_QUIRKS_LIST(C8_QUIRKS_PROFILE) };
+
+// The interpreter area (0x000 to 0x1FF) of a freshly booted machine, worked out
+// by the compiler instead of byte by byte at every reset.
+//
+// Programs may also refer to a group of sprites representing the hexadecimal
+// digits 0 through F. These sprites are 5 bytes long, or 8x5 pixels. The data
+// should be stored in the interpreter area of Chip-8 memory (0x000 to 0x1FF).
+//
+// SUPER-CHIP adds a big (8x10) set of the same digits for the 128x64 mode,
+// which Fx30 points I at. These are the ones Octo uses. They come straight
+// after the small ones, so the other profiles just copy less of this.
+const unsigned char C8_InterpreterArea[C8_START] =
+{
+    [C8_FONT_0_ADDR] = 0xF0, 0x90, 0x90, 0x90, 0xF0,
+    [C8_FONT_1_ADDR] = 0x20, 0x60, 0x20, 0x20, 0x70,
+    [C8_FONT_2_ADDR] = 0xF0, 0x10, 0xF0, 0x80, 0xF0,
+    [C8_FONT_3_ADDR] = 0xF0, 0x10, 0xF0, 0x10, 0xF0,
+    [C8_FONT_4_ADDR] = 0x90, 0x90, 0xF0, 0x10, 0x10,
+    [C8_FONT_5_ADDR] = 0xF0, 0x80, 0xF0, 0x10, 0xF0,
+    [C8_FONT_6_ADDR] = 0xF0, 0x80, 0xF0, 0x90, 0xF0,
+    [C8_FONT_7_ADDR] = 0xF0, 0x10, 0x20, 0x40, 0x40,
+    [C8_FONT_8_ADDR] = 0xF0, 0x90, 0xF0, 0x90, 0xF0,
+    [C8_FONT_9_ADDR] = 0xF0, 0x90, 0xF0, 0x10, 0xF0,
+    [C8_FONT_A_ADDR] = 0xF0, 0x90, 0xF0, 0x90, 0x90,
+    [C8_FONT_B_ADDR] = 0xE0, 0x90, 0xE0, 0x90, 0xE0,
+    [C8_FONT_C_ADDR] = 0xF0, 0x80, 0x80, 0x80, 0xF0,
+    [C8_FONT_D_ADDR] = 0xE0, 0x90, 0x90, 0x90, 0xE0,
+    [C8_FONT_E_ADDR] = 0xF0, 0x80, 0xF0, 0x80, 0xF0,
+    [C8_FONT_F_ADDR] = 0xF0, 0x80, 0xF0, 0x80, 0x80,
+    [C8_BIG_FONT_ADDR] =
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF,     // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF,     // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,     // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,     // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03,     // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,     // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,     // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18,     // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,     // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,     // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,     // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,     // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,     // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,     // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,     // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0,     // F
+};
 
 // Oh, this is interesting!
 // Function pointers in Arrays!?
 // Apparently, this is more performant than using a switch-statement.
+// (Don't take my word for it, --bench-dispatch races this against a switch
+// and a computed goto version, see C8_DISPATCH.)
 // Put the instructions into Function Pointer Table(s)
-void (*instruction_table[16])(C8_Instruction *instruction)              = {0};
-void (*instruction_0x0_subtable[256])(C8_Instruction *instruction)      = {0};
-void (*instruction_0x8_subtable[16])(C8_Instruction *instruction)       = {0};
-void (*instruction_0xE_subtable[256])(C8_Instruction *instruction)      = {0};
-void (*instruction_0xF_subtable[256])(C8_Instruction *instruction)      = {0};
-
-void execute_0x0_instruction(C8_Instruction *instruction)
+//
+// There's a whole set of tables for every --quirks profile, worked out by the
+// compiler from C8_QUIRKS_LIST. Each instruction that a profile has a quirk for
+// gets the handler that was built with it, so there's nothing left to check
+// while running, and a machine just points at the set for its own profile.
+// SUPER-CHIP's are all or nothing, without it they're holes like any other
+// unknown opcode. C8_IF() picks one of two handlers by a true/false column.
+void execute_0x0_instruction    (C8_Machine *machine, C8_Instruction *instruction);
+void execute_0x8_instruction    (C8_Machine *machine, C8_Instruction *instruction);
+void execute_0xE_instruction    (C8_Machine *machine, C8_Instruction *instruction);
+void execute_0xF_instruction    (C8_Machine *machine, C8_Instruction *instruction);
+
+#define C8_IF(flag, yes, no)    C8_IF_##flag(yes, no)
+#define C8_IF_1(yes, no)        yes
+#define C8_IF_0(yes, no)        no
+#define C8_IF_true(yes, no)     yes
+#define C8_IF_false(yes, no)    no
+
+#define C8_INSTRUCTION_SET(id, name, resetVF, shiftVy, moveI, jumpVx, clip, superChip)         \
+    [C8_QUIRKS_##id] =                                                                          \
+    {                                                                                           \
+        .main =                                                                                 \
+        {                                                                                       \
+            [0x0] = execute_0x0_instruction,                                                    \
+            [0x1] = C8_JP_ADDR,                                                                 \
+            [0x2] = C8_CALL_ADDR,                                                               \
+            [0x3] = C8_SE_VX_BYTE,                                                              \
+            [0x4] = C8_SNE_VX_BYTE,                                                             \
+            [0x5] = C8_SE_VX_VY,                                                                \
+            [0x6] = C8_LD_VX_BYTE,                                                              \
+            [0x7] = C8_ADD_VX_BYTE,                                                             \
+            [0x8] = execute_0x8_instruction,                                                    \
+            [0x9] = C8_SNE_VX_VY,                                                               \
+            [0xA] = C8_LD_I_ADDR,                                                               \
+            [0xB] = C8_IF(jumpVx, C8_JP_VX_ADDR, C8_JP_V0_ADDR),                                \
+            [0xC] = C8_RND_VX_BYTE,                                                             \
+            [0xD] = C8_IF(clip, C8_DRW_VX_VY_NIBBLE_CLIP, C8_DRW_VX_VY_NIBBLE),                 \
+            [0xE] = execute_0xE_instruction,                                                    \
+            [0xF] = execute_0xF_instruction,                                                    \
+        },                                                                                      \
+        .sub0x0 =                                                                               \
+        {                                                                                       \
+            [0xC0] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC1] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC2] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC3] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC4] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC5] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC6] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC7] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC8] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xC9] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCA] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCB] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCC] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCD] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCE] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xCF] = C8_IF(superChip, C8_SCD_NIBBLE, NULL),                                     \
+            [0xE0] = C8_CLS,                                                                    \
+            [0xEE] = C8_RET,                                                                    \
+            [0xFB] = C8_IF(superChip, C8_SCR, NULL),                                            \
+            [0xFC] = C8_IF(superChip, C8_SCL, NULL),                                            \
+            [0xFD] = C8_IF(superChip, C8_EXIT, NULL),                                           \
+            [0xFE] = C8_IF(superChip, C8_LOW, NULL),                                            \
+            [0xFF] = C8_IF(superChip, C8_HIGH, NULL),                                           \
+        },                                                                                      \
+        .sub0x8 =                                                                               \
+        {                                                                                       \
+            [0x0] = C8_LD_VX_VY,                                                                \
+            [0x1] = C8_IF(resetVF, C8_OR_VX_VY_RESET_VF, C8_OR_VX_VY),                          \
+            [0x2] = C8_IF(resetVF, C8_AND_VX_VY_RESET_VF, C8_AND_VX_VY),                        \
+            [0x3] = C8_IF(resetVF, C8_XOR_VX_VY_RESET_VF, C8_XOR_VX_VY),                        \
+            [0x4] = C8_ADD_VX_VY,                                                               \
+            [0x5] = C8_SUB_VX_VY,                                                               \
+            [0x6] = C8_IF(shiftVy, C8_SHR_VX_VY_SHIFT_VY, C8_SHR_VX_VY),                        \
+            [0x7] = C8_SUBN_VX_VY,                                                              \
+            [0xE] = C8_IF(shiftVy, C8_SHL_VX_VY_SHIFT_VY, C8_SHL_VX_VY),                        \
+        },                                                                                      \
+        .sub0xE =                                                                               \
+        {                                                                                       \
+            [0x9E] = C8_SKP_VX,                                                                 \
+            [0xA1] = C8_SKNP_VX,                                                                \
+        },                                                                                      \
+        .sub0xF =                                                                               \
+        {                                                                                       \
+            [0x07] = C8_LD_VX_DT,                                                               \
+            [0x0A] = C8_LD_VX_K,                                                                \
+            [0x15] = C8_LD_DT_VX,                                                               \
+            [0x18] = C8_LD_ST_VX,                                                               \
+            [0x1E] = C8_ADD_I_VX,                                                               \
+            [0x29] = C8_LD_F_VX,                                                                \
+            [0x30] = C8_IF(superChip, C8_LD_HF_VX, NULL),                                       \
+            [0x33] = C8_LD_B_VX,                                                                \
+            [0x55] = C8_IF(moveI, C8_LD_I_VX_MOVE_I, C8_LD_I_VX),                               \
+            [0x65] = C8_IF(moveI, C8_LD_VX_I_MOVE_I, C8_LD_VX_I),                               \
+            [0x75] = C8_IF(superChip, C8_LD_R_VX, NULL),                                        \
+            [0x85] = C8_IF(superChip, C8_LD_VX_R, NULL),                                        \
+        },                                                                                      \
+    },
+
+// One per profile, in the same order as C8_Quirks.
+static const C8_InstructionSet instruction_sets[C8_QUIRKS_COUNT] = { C8_QUIRKS_LIST(C8_INSTRUCTION_SET) };
+
+void execute_0x0_instruction(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_0x0_subtable[instruction->kk](instruction);
+    machine->Instructions->sub0x0[instruction->kk](machine, instruction);
 }
 
-void execute_0x8_instruction(C8_Instruction *instruction)
+void execute_0x8_instruction(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_0x8_subtable[instruction->n](instruction);
+    machine->Instructions->sub0x8[instruction->n](machine, instruction);
 }
 
-void execute_0xE_instruction(C8_Instruction *instruction)
+void execute_0xE_instruction(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_0xE_subtable[instruction->kk](instruction);
+    machine->Instructions->sub0xE[instruction->kk](machine, instruction);
 }
 
-void execute_0xF_instruction(C8_Instruction *instruction)
+void execute_0xF_instruction(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_0xF_subtable[instruction->kk](instruction);
+    machine->Instructions->sub0xF[instruction->kk](machine, instruction);
 }
 
-void execute_instruction(C8_Instruction *instruction)
+void execute_instruction(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_table[instruction->msn](instruction);
+    machine->Instructions->main[instruction->msn](machine, instruction);
 }
 
-void initialize_instruction_set()
+// Follows the (sub)table chain down to the handler that actually implements
+// the instruction on this machine, so that the decode cache can call it
+// directly.
+C8_Handler resolve_handler(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction_0x0_subtable[0xE0] = C8_CLS;
-    instruction_0x0_subtable[0xEE] = C8_RET;
+    const C8_InstructionSet *set = machine->Instructions;
+    C8_Handler handler = set->main[instruction->msn];
 
-    instruction_0x8_subtable[0x0] = C8_LD_VX_VY;
-    instruction_0x8_subtable[0x1] = C8_OR_VX_VY;  
-    instruction_0x8_subtable[0x2] = C8_AND_VX_VY;        
-    instruction_0x8_subtable[0x3] = C8_XOR_VX_VY;  
-    instruction_0x8_subtable[0x4] = C8_ADD_VX_VY;  
-    instruction_0x8_subtable[0x5] = C8_SUB_VX_VY;  
-    instruction_0x8_subtable[0x6] = C8_SHR_VX_VY;  
-    instruction_0x8_subtable[0x7] = C8_SUBN_VX_VY;  
-    instruction_0x8_subtable[0xE] = C8_SHL_VX_VY;  
+    if (handler == execute_0x0_instruction)
+    {
+        handler = set->sub0x0[instruction->kk];
+    }
+    else if (handler == execute_0x8_instruction)
+    {
+        handler = set->sub0x8[instruction->n];
+    }
+    else if (handler == execute_0xE_instruction)
+    {
+        handler = set->sub0xE[instruction->kk];
+    }
+    else if (handler == execute_0xF_instruction)
+    {
+        handler = set->sub0xF[instruction->kk];
+    }
 
-    instruction_0xE_subtable[0x9E] = C8_SKP_VX;
-    instruction_0xE_subtable[0xA1] = C8_SKNP_VX;
+    // Unknown opcodes leave holes in the subtables, treat them like 0nnn and
+    // ignore them rather than calling a NULL pointer.
+    if (handler == NULL)
+    {
+        handler = C8_SYS_ADDR;
+    }
 
-    instruction_0xF_subtable[0x07] = C8_LD_VX_DT;    
-    instruction_0xF_subtable[0x0A] = C8_LD_VX_K;    
-    instruction_0xF_subtable[0x15] = C8_LD_DT_VX;    
-    instruction_0xF_subtable[0x18] = C8_LD_ST_VX;    
-    instruction_0xF_subtable[0x1E] = C8_ADD_I_VX;    
-    instruction_0xF_subtable[0x29] = C8_LD_F_VX;    
-    instruction_0xF_subtable[0x33] = C8_LD_B_VX;    
-    instruction_0xF_subtable[0x55] = C8_LD_I_VX;    
-    instruction_0xF_subtable[0x65] = C8_LD_VX_I;     
-    
-    instruction_table[0x0] = execute_0x0_instruction;
-    instruction_table[0x1] = C8_JP_ADDR;
-    instruction_table[0x2] = C8_CALL_ADDR;
-    instruction_table[0x3] = C8_SE_VX_BYTE;
-    instruction_table[0x4] = C8_SNE_VX_BYTE;
-    instruction_table[0x5] = C8_SE_VX_VY;
-    instruction_table[0x6] = C8_LD_VX_BYTE;
-    instruction_table[0x7] = C8_ADD_VX_BYTE;
-    instruction_table[0x8] = execute_0x8_instruction;
-    instruction_table[0x9] = C8_SNE_VX_VY;
-    instruction_table[0xA] = C8_LD_I_ADDR;
-    instruction_table[0xB] = C8_JP_V0_ADDR;
-    instruction_table[0xC] = C8_RND_VX_BYTE;
-    instruction_table[0xD] = C8_DRW_VX_VY_NIBBLE;
-    instruction_table[0xE] = execute_0xE_instruction;
-    instruction_table[0xF] = execute_0xF_instruction;
+    return handler;
 }
 
 //----------------------------------------------------------------------------------
 // Local Functions Declaration
 //----------------------------------------------------------------------------------
-void parse_instruction          (C8_Instruction *instruction);
-void interpret_instruction      (C8_Instruction *instruction);
-void increment_program_counter  (C8_Instruction *instruction);
-void load_hexfont_sprites       ();
-void load_rom                   ();
-void render_buffer              (int originX, int originY);
-void read_input                 ();
-void test_font                  ();
-void render_keypad              (int posX, int posY);
+void parse_instruction          (C8_Machine *machine, C8_Instruction *instruction);
+void interpret_instruction      (C8_Machine *machine, C8_Instruction *instruction);
+void increment_program_counter  (C8_Machine *machine, C8_Instruction *instruction);
+void run_cycles                 (C8_Machine *machine, int count);
+void run_cycles_table           (C8_Machine *machine, int count);
+void run_cycles_switch          (C8_Machine *machine, int count);
+void run_cycles_threaded        (C8_Machine *machine, int count);
+void run_cycles_blocks          (C8_Machine *machine, int count);
+#if C8_DEBUG_MODE
+void run_cycles_profiled        (C8_Machine *machine, int count);
+unsigned long long read_profile_clock();
+void merge_profile              (C8_Profile *into, C8_Profile *from);
+bool save_profile               (C8_Profile *profile, C8_Machine *machine, const char *filename);
+void draw_profile_overlay       (C8_Frame *frame, int originX, int originY);
+#endif
+unsigned short peek_opcode      (C8_Machine *machine, int addr);
+int find_idle_loop              (C8_Machine *machine, int *reg);
+int skip_idle_cycles            (C8_Machine *machine, int count);
+void flush_block_cache          (C8_Machine *machine);
+unsigned long long hash_machine_state(C8_Machine *machine);
+long long run_virtual_frames    (C8_Machine *machines, int machineCount, C8_Engine engine, long long totalCycles);
+long long run_observed_frames   (C8_Machine *machines, int machineCount, C8_Stream *stream, C8_Capture *capture, long long totalCycles);
+static inline long long virtual_tick(long long frames);
+long long frame_cycles_left     (long long executed, long long frames, long long totalCycles);
+void reset_machine              (C8_Machine *machine, const char *filename, C8_Quirks quirks);
+void reset_machine_image        (C8_Machine *machine, const unsigned char *data, int size, C8_Quirks quirks);
+void *boot_machine              (void *data);
+void seed_machine               (C8_Machine *machine, unsigned int seed);
+static inline void step_virtual_frames(C8_Machine *machine, C8_Engine engine, long long *executed, long long *frames, long long count);
+int run_batch                   (C8_Options *options);
+int get_core_count              ();
+long long run_lockstep          (C8_Machine *machines, int machineCount, long long totalCycles);
+unsigned long long hash_framebuffer(C8_Machine *machine);
+void invalidate_decode_cache    (C8_Machine *machine, int addr, int length);
+unsigned char read_ram          (C8_Machine *machine, int addr);
+void write_ram                  (C8_Machine *machine, int addr, unsigned char value);
+const unsigned char *ram_page   (C8_Machine *machine, int page);
+bool same_ram                   (C8_Machine *a, C8_Machine *b);
+void share_boot_image           (C8_Machine *machine);
+void load_hexfont_sprites       (C8_Machine *machine);
+void update_timers              (C8_Machine *machine);
+unsigned char *load_rom         (const char *filename, int *size);
+void copy_rom_image             (C8_Machine *machine, const unsigned char *data, int size);
+bool open_pack                  (C8_Pack *pack, const char *filename);
+void close_pack                 (C8_Pack *pack);
+const unsigned char *get_pack_rom(C8_Pack *pack, int index, const char **name, int *size);
+const char *get_pack_name       (C8_Pack *pack, int index);
+int create_pack                 (C8_Options *options);
+bool open_stream                (C8_Stream *stream, const char *target, int sessionCount);
+void close_stream               (C8_Stream *stream);
+uint32_t halve_pixels           (uint64_t pixels);
+void stream_frame               (C8_Stream *stream, int session, C8_Machine *machine, double now);
+int run_viewer                  (C8_Options *options);
+bool open_capture               (C8_Capture *capture, const char *filename, int scale);
+void close_capture              (C8_Capture *capture);
+bool open_metrics               (C8_Metrics *metrics, const char *target, const char *mode, int machineCount);
+void close_metrics              (C8_Metrics *metrics);
+void write_metrics              (C8_Metrics *metrics, const C8_Stats *stats);
+void start_metrics_thread       (C8_Metrics *metrics);
+void stop_metrics_thread        (C8_Metrics *metrics);
+void *run_metrics_reporter      (void *data);
+void draw_hud                   (const C8_Stats *stats);
+uint64_t double_pixels          (uint32_t pixels);
+void capture_frame              (C8_Capture *capture, C8_Machine *machine);
+void *run_capture_encoder       (void *data);
+void add_gif_frame              (C8_Capture *capture, const uint64_t (*buffer)[2], long long tick);
+void write_gif_frame            (C8_Capture *capture, int delay);
+void write_gif_code             (C8_Capture *capture, int code, int size);
+void flush_gif_block            (C8_Capture *capture);
+void initialize_renderer        ();
+void start_beeper               ();
+void stop_beeper                ();
+void generate_beeper_samples    (void *buffer, unsigned int frames);
+void render_buffer              (C8_Frame *frame, int originX, int originY);
+void set_key_map                (const char *keys);
+unsigned short read_input       (unsigned short *presses);
+void test_font                  (C8_Machine *machine);
+void draw_keypad                (unsigned short keys);
+void parse_options              (int argc, char *argv[], C8_Options *options);
+double get_host_time            ();
+void sleep_host                 (double seconds);
+void publish_frame              (C8_FrameExchange *exchange);
+C8_Frame *take_frame            (C8_FrameExchange *exchange);
+void *run_emulator              (void *data);
+int run_headless                (C8_Options *options);
+int run_dispatch_benchmark      (C8_Options *options);
+int run_micro_benchmarks        (C8_Options *options);
+bool load_baseline              (const char *filename, char names[][32], double *means, int capacity, int *count);
+int run_tests                   (C8_Options *options);
+bool load_golden_file           (const char *filename, C8_GoldenEntry **entries, int *count, int extra);
+bool save_golden_file           (const char *filename, C8_GoldenEntry *entries, int count, bool loaded);
+void capture_state              (C8_Machine *machine, unsigned char *raw);
+void apply_state                (C8_Machine *machine, const unsigned char *raw);
+int rle_encode                  (const unsigned char *data, int size, unsigned char *out, int capacity);
+int rle_decode                  (const unsigned char *data, int size, unsigned char *out, int capacity);
+int save_snapshot               (C8_Machine *machine, unsigned char *data, int capacity);
+bool load_snapshot              (C8_Machine *machine, const unsigned char *data, int size);
+bool save_snapshot_file         (C8_Machine *machine, const char *filename);
+bool load_snapshot_file         (C8_Machine *machine, const char *filename);
+void reset_rewind               (C8_Machine *machine);
+void record_rewind_frame        (C8_Machine *machine);
+bool rewind_frame               (C8_Machine *machine);
+unsigned short get_key_mask     (C8_Machine *machine);
+void set_key_mask               (C8_Machine *machine, unsigned short keys);
+void begin_input_log            (C8_InputLog *log, C8_Machine *machine, uint32_t seed);
+void add_input_event            (C8_InputLog *log, long long cycle, unsigned char kind, unsigned short keys);
+void record_input               (C8_InputLog *log, C8_Machine *machine);
+void record_timer_tick          (C8_InputLog *log, C8_Machine *machine);
+bool save_input_log             (C8_InputLog *log, const char *filename);
+bool load_input_log             (C8_InputLog *log, C8_Machine *machine, const char *filename);
+void free_input_log             (C8_InputLog *log);
+long long replay_input_log      (C8_InputLog *log, C8_Machine *machine);
 
 //----------------------------------------------------------------------------------
 // Main entry point
 //----------------------------------------------------------------------------------
-int main()
+int main(int argc, char *argv[])
 {
+    C8_Options options;
+    parse_options(argc, argv, &options);
+
+    if (options.benchDispatch)
+    {
+        return run_dispatch_benchmark(&options);
+    }
+
+    if (options.bench)
+    {
+        return run_micro_benchmarks(&options);
+    }
+
+    if (options.test)
+    {
+        return run_tests(&options);
+    }
+
+    if (options.packCreate != NULL)
+    {
+        return create_pack(&options);
+    }
+
+    if (options.view != NULL)
+    {
+        return run_viewer(&options);
+    }
+
+    if (options.batch)
+    {
+        return run_batch(&options);
+    }
+
+    if (options.headless)
+    {
+        return run_headless(&options);
+    }
+
     // raylib Initialization
     //--------------------------------------------------------------------------------------
     const int screenOriginX     = 125;
     const int screenOriginY     = 20;
-    const float cycleTime       = 1.0f / C8_CLOCK_SPEED;
-    const float frameTime       = 1.0f / 60; // 60 fps
-    const float timerTime       = 1.0f / C8_TIMER_SPEED;
+    const double frameTime      = 1.0 / 60; // 60 fps
+    const double startTime      = get_host_time();
+
+    // The window only ever shows the one machine. It's far too big for the
+    // stack, so it goes on the heap like the headless batch does.
+    C8_Machine *machine = calloc(1, sizeof(C8_Machine));
+
+    // The ROM is read and the machine reset while the window is being opened.
+    // On Android the ROM is an asset, and those can't be read until raylib has
+    // the window, so there it only overlaps with setting up the renderer.
+    C8_Boot boot = { machine, options.filename, options.quirks };
+    pthread_t bootThread;
+#if !defined(PLATFORM_ANDROID)
+    pthread_create(&bootThread, NULL, boot_machine, &boot);
+#endif
 
     InitWindow(785, 360, "raychip-8");  
-    InitAudioDevice();
-    
-    initialize_instruction_set();
-    load_hexfont_sprites();
-    load_rom();
-    
-    float lastCycleTime = 0.0f;
-    float lastFrameTime = 0.0f;
-    float lastTimerTime = 0.0f;
-    C8_Instruction current_instruction;
-    Wave wav = LoadWave("sound.wav");
-    Sound sound = LoadSoundFromWave(wav);
+#if defined(PLATFORM_ANDROID)
+    pthread_create(&bootThread, NULL, boot_machine, &boot);
+#endif
+    initialize_renderer();
+    set_key_map(options.keymap);
+    pthread_join(bootThread, NULL);
+
+    // A different run every time unless there's a --seed.
+    uint32_t seed = options.seed != 0 ? options.seed : (uint32_t)time(NULL);
+    seed_machine(machine, seed);
+
+    // Snapshots live next to the ROM unless told otherwise (F5 saves, F9 loads).
+    char statePath[512];
+    snprintf(statePath, sizeof(statePath), "%s.state", options.filename);
+    if (options.saveState != NULL)
+    {
+        snprintf(statePath, sizeof(statePath), "%s", options.saveState);
+    }
+
+    if (options.loadState != NULL)
+    {
+        load_snapshot_file(machine, options.loadState);
+    }
+    else if (options.resume && FileExists(statePath))
+    {
+        load_snapshot_file(machine, statePath);
+    }
+
+    reset_rewind(machine);
+
+    // Rewinding or loading a snapshot would make a mess of the input log, so
+    // neither is allowed while recording one.
+    C8_InputLog inputLog = { 0 };
+    bool recording = options.recordInput != NULL;
+    if (recording)
+    {
+        begin_input_log(&inputLog, machine, machine->Random);
+    }
+
+    // From here on the machine belongs to the CPU thread, this one only draws
+    // the frames it hands over and passes the keypad back.
+    C8_Stream stream = { 0 };
+    bool streaming = options.stream != NULL && open_stream(&stream, options.stream, 1);
+
+    C8_Capture capture = { 0 };
+    bool capturing = options.capture != NULL && open_capture(&capture, options.capture, options.captureScale);
+
+    // The window writes a line every time the HUD changes.
+    C8_Metrics metrics = { 0 };
+    bool reporting = options.metrics != NULL && open_metrics(&metrics, options.metrics, "window", 1);
+
+    C8_Emulator emulator = { 0 };
+    emulator.machine = machine;
+    emulator.stream = streaming ? &stream : NULL;
+    emulator.capture = capturing ? &capture : NULL;
+    emulator.statePath = statePath;
+    emulator.inputLog = recording ? &inputLog : NULL;
+    emulator.exchange.back = 0;
+    emulator.exchange.front = 1;
+    atomic_init(&emulator.exchange.middle, 2);
+    atomic_init(&emulator.keys, get_key_mask(machine));
+    atomic_init(&emulator.presses, 0);
+    atomic_init(&emulator.requests, 0);
+    atomic_init(&emulator.rewinding, false);
+    atomic_init(&emulator.running, true);
+
+    pthread_t cpuThread;
+    pthread_create(&cpuThread, NULL, run_emulator, &emulator);
+
+    // Plenty of ROMs never beep, so the audio device isn't opened until the
+    // first time the sound timer is set.
+    bool audioOpened = false;
+    bool firstFrame = true;
+
+    // The render thread's half of the HUD, the rest comes with the frames.
+    C8_Stats cpuStats = { 0, -1.0, C8_CLOCK_SPEED, -1.0, -1.0, 0, -1.0, -1.0 };
+    C8_HudStats = cpuStats;
+    double statsStart = GetTime();
+    double statsDraw = 0.0;
+    int statsFrames = 0;
 
     //--------------------------------------------------------------------------------------
     // Main Game Loop
     while (!WindowShouldClose())
     {
-        float time = GetTime();       
+        double time = GetTime();       
 
-        read_input();
+        // The presses go first, so that the CPU thread never sees a key down
+        // in keys without the press that came with it.
+        unsigned short presses;
+        unsigned short keys = read_input(&presses);
+        atomic_fetch_or_explicit(&emulator.presses, presses, memory_order_relaxed);
+        atomic_store_explicit(&emulator.keys, keys, memory_order_release);
+        atomic_store_explicit(&emulator.rewinding, IsKeyDown(C8_REWIND_KEY) && !recording, memory_order_relaxed);
 
-        render_keypad(10, 10);
-        
-        if (time - lastCycleTime >= cycleTime)
+        if (IsKeyPressed(KEY_F5))
+        {
+            atomic_fetch_or_explicit(&emulator.requests, C8_REQUEST_SAVE, memory_order_relaxed);
+        }
+
+        if (IsKeyPressed(KEY_F9) && !recording)
+        {
+            atomic_fetch_or_explicit(&emulator.requests, C8_REQUEST_LOAD, memory_order_relaxed);
+        }
+
+        // NULL when the CPU thread hasn't finished another frame since the
+        // last one, what's on screen is still up to date.
+        C8_Frame *frame = take_frame(&emulator.exchange);
+        if (frame != NULL)
         {
-            lastCycleTime = time;
+            cpuStats = frame->Stats;
+        }
 
-            parse_instruction(&current_instruction);
+        if (time - statsStart >= C8_METRICS_INTERVAL)
+        {
+            C8_HudStats = cpuStats;
+            C8_HudStats.frameTime = ((time - statsStart) * 1000.0) / (statsFrames > 0 ? statsFrames : 1);
+            C8_HudStats.drawTime = (statsDraw * 1000.0) / (time - statsStart);
+            C8_HudChanged = true;
 
-            execute_instruction(&current_instruction);
+            if (reporting)
+            {
+                write_metrics(&metrics, &C8_HudStats);
+            }
 
-            increment_program_counter(&current_instruction);
+            statsStart = time;
+            statsDraw = 0.0;
+            statsFrames = 0;
         }
 
-        if (time - lastFrameTime >= frameTime)
+        double drawStart = GetTime();
+        render_buffer(frame, screenOriginX, screenOriginY);
+        statsDraw += GetTime() - drawStart;
+        statsFrames++;
+
+        if (firstFrame && frame != NULL)
         {
-            lastFrameTime = time;
+            TraceLog(LOG_INFO, "TIMING: First frame %.1f ms after start", (get_host_time() - startTime) * 1000.0);
+            firstFrame = false;
+        }
 
-            render_buffer(screenOriginX, screenOriginY);
+        if (!audioOpened && atomic_load_explicit(&C8_BeeperOn, memory_order_relaxed))
+        {
+            InitAudioDevice();
+            start_beeper();
+            audioOpened = true;
         }
 
-        if (time - lastTimerTime >= timerTime)
+        // Drawing (vsync) and the CPU no longer hold each other up, but there's
+        // no point going round more than once a frame.
+        double remaining = frameTime - (GetTime() - time);
+        if (remaining > 0.0)
         {
-            lastTimerTime = time;
+            WaitTime(remaining);
+        }
+    }
+
+    atomic_store(&emulator.running, false);
+    pthread_join(cpuThread, NULL);
+    atomic_store(&C8_BeeperOn, false);
+
+    if (streaming)
+    {
+        close_stream(&stream);
+    }
+
+    if (capturing)
+    {
+        close_capture(&capture);
+    }
+
+    if (reporting)
+    {
+        close_metrics(&metrics);
+    }
+
+#if C8_DEBUG_MODE
+    save_profile(&machine->Profile, machine, C8_PROFILE_FILENAME);
+#endif
+
+    // De-Initialization
+    //--------------------------------------------------------------------------------------
+    if (options.resume)
+    {
+        save_snapshot_file(machine, statePath);
+    }
+
+    if (recording)
+    {
+        inputLog.cycles = machine->Cycles;
+        save_input_log(&inputLog, options.recordInput);
+        free_input_log(&inputLog);
+    }
+
+    free(machine);
+    UnloadTexture(C8_ScreenTexture);
+    UnloadTexture(C8_HiresTexture);
+    UnloadRenderTexture(C8_KeypadTexture);
+    UnloadRenderTexture(C8_HudTexture);
+    stop_beeper();
+    if (audioOpened)
+    {
+        CloseAudioDevice();
+    }
+    CloseWindow();                  // Close window and OpenGL context
+    //--------------------------------------------------------------------------------------
+
+    return 0;
+}
 
-            if (C8_DT > 0) 
+void parse_options(int argc, char *argv[], C8_Options *options)
+{
+    options->filename   = C8_FILENAME;
+    options->quirks     = C8_QUIRKS_COWGOD;
+    options->headless   = false;
+    options->cycles     = 0;
+    options->frames     = 0;
+    options->benchDispatch = false;
+    options->bench      = false;
+    options->baseline   = NULL;
+    options->saveBaseline = NULL;
+    options->test       = false;
+    options->golden     = C8_GOLDEN_FILENAME;
+    options->updateGolden = false;
+    options->filenames  = calloc(argc, sizeof(const char *));
+    options->filenameCount = 0;
+    options->packCreate = NULL;
+    options->stream     = NULL;
+    options->view       = NULL;
+    options->capture    = NULL;
+    options->captureScale = C8_CAPTURE_SCALE;
+    options->loadState  = NULL;
+    options->saveState  = NULL;
+    options->resume     = false;
+    options->instances  = 1;
+    options->batch      = false;
+    options->lockstep   = false;
+    options->threads    = 0;
+    options->chunk      = C8_BATCH_CHUNK;
+    options->seed       = 0;
+    options->recordInput = NULL;
+    options->replayInput = NULL;
+    options->keymap     = C8_DEFAULT_KEYMAP;
+    options->metrics    = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+        {
+            options->headless = true;
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            int quirks = 0;
+            while (quirks < C8_QUIRKS_COUNT && strcmp(quirk_profiles[quirks].name, name) != 0)
             {
-                C8_DT--;
+                quirks++;
             }
 
-            if (C8_ST > 0)
+            if (quirks == C8_QUIRKS_COUNT)
             {
-                if (!IsSoundPlaying(sound))
+                fprintf(stderr, "Unknown quirks '%s', expected one of:", name);
+                for (int j = 0; j < C8_QUIRKS_COUNT; j++)
                 {
-                    PlaySound(sound);
+                    fprintf(stderr, " %s", quirk_profiles[j].name);
                 }
+                fprintf(stderr, "\n");
+                exit(1);
+            }
 
-                C8_ST--;
+            options->quirks = quirks;
+        }
+        else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc)
+        {
+            const char *keys = argv[++i];
+            bool valid = strlen(keys) == 16;
+            for (int j = 0; valid && j < 16; j++)
+            {
+                char key = keys[j];
+                valid = (key >= '0' && key <= '9') || (key >= 'A' && key <= 'Z') || (key >= 'a' && key <= 'z');
             }
-            else 
+
+            if (!valid)
             {
-                if (IsSoundPlaying(sound))
-                {
-                    StopSound(sound);
-                }
+                fprintf(stderr, "--keymap wants 16 letters or digits, the keys for 0 to F (default %s)\n", C8_DEFAULT_KEYMAP);
+                exit(1);
             }
+
+            options->keymap = keys;
+        }
+        else if (strcmp(argv[i], "--bench-dispatch") == 0)
+        {
+            options->benchDispatch = true;
+        }
+        else if (strcmp(argv[i], "--test") == 0)
+        {
+            options->test = true;
+        }
+        else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc)
+        {
+            options->golden = argv[++i];
+        }
+        else if (strcmp(argv[i], "--update-golden") == 0)
+        {
+            options->updateGolden = true;
+        }
+        else if (strcmp(argv[i], "--pack-create") == 0 && i + 1 < argc)
+        {
+            options->packCreate = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+        {
+            options->stream = argv[++i];
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            options->metrics = argv[++i];
+        }
+        else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc)
+        {
+            options->view = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            options->capture = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture-scale") == 0 && i + 1 < argc)
+        {
+            options->captureScale = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            options->bench = true;
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            options->baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc)
+        {
+            options->saveBaseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            options->resume = true;
+        }
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+        {
+            options->loadState = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc)
+        {
+            options->saveState = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+        {
+            options->cycles = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            options->frames = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+        {
+            options->instances = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            options->batch = true;
+        }
+        else if (strcmp(argv[i], "--lockstep") == 0)
+        {
+            options->lockstep = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options->threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+        {
+            options->chunk = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            options->seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--record-input") == 0 && i + 1 < argc)
+        {
+            options->recordInput = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay-input") == 0 && i + 1 < argc)
+        {
+            options->replayInput = argv[++i];
+        }
+        else
+        {
+            // Only --test and --pack-create look at more than the last one.
+            options->filename = argv[i];
+            options->filenames[options->filenameCount++] = argv[i];
         }
     }
+}
 
-    // De-Initialization
-    //--------------------------------------------------------------------------------------
-    CloseAudioDevice();
-    CloseWindow();                  // Close window and OpenGL context
-    //--------------------------------------------------------------------------------------
+// raylib's GetTime() only works once there is a window, so the headless mode
+// needs its own clock.
+double get_host_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
 
-    return 0;
+// And raylib's WaitTime() may busy-wait, which is the last thing the CPU
+// thread wants.
+void sleep_host(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1000000000.0);
+    nanosleep(&ts, NULL);
 }
 
-void parse_instruction(C8_Instruction *instruction)
+// Runs the interpreter with no window, no audio and no pacing at all - just as
+// fast as the host will go. The timers still tick once per "virtual frame" of
+// C8_CLOCK_SPEED / C8_TIMER_SPEED cycles so that ROMs behave the same as they
+// would in the window, they just get there quicker.
+int run_headless(C8_Options *options)
 {
-    // Note: the ordering in which you & and >> is important, so use brackets
-    // to ensure that the ordering happens as desired.
+    long long totalCycles = options->cycles;
 
-    // All instructions are 2 bytes long and are stored most-significant-byte first.
-    // In memory, the first byte of each instruction should be located at an even
-    // address. If a program includes sprite data, it should be padded so any 
-    // instructions following it will be properly situated in RAM.
-    unsigned char first_byte        = C8_RAM[C8_PC];
-    unsigned char second_byte       = C8_RAM[C8_PC + 1];
-    unsigned short opcode           = (first_byte << 8) | second_byte;
+    if (totalCycles <= 0)
+    {
+        long long totalFrames = options->frames > 0 ? options->frames : C8_HEADLESS_FRAMES;
+        totalCycles = (totalFrames * C8_CLOCK_SPEED) / C8_TIMER_SPEED;
+    }
 
-    instruction->opcode             = opcode;
+    int instances = options->instances > 0 ? options->instances : 1;
+    C8_Machine *machines = calloc(instances, sizeof(C8_Machine));
+    if (machines == NULL)
+    {
+        fprintf(stderr, "Not enough memory for %i instances\n", instances);
+        return 1;
+    }
 
-    // msn or most-significant-nibble - A 4-bit value, the highest 4 bits of the instruction
-    instruction->msn                = (opcode & 0xF000) >> 12;
-    
-    // nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
-    instruction->addr               = (opcode & 0x0FFF);
+    SetTraceLogLevel(LOG_WARNING);
+    reset_machine(&machines[0], options->filename, options->quirks);
 
-    // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
-    instruction->n                  = (opcode & 0x000F);
+    uint32_t seed = options->seed != 0 ? options->seed : C8_DEFAULT_SEED;
+    seed_machine(&machines[0], seed);
 
-    // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
-    instruction->x                  = (opcode & 0x0F00) >> 8;
+    if (options->loadState != NULL && !load_snapshot_file(&machines[0], options->loadState))
+    {
+        free(machines);
+        return 1;
+    }
+
+    // A replay runs for exactly as long as the session it was recorded from,
+    // starting from the generator as it was then.
+    C8_InputLog inputLog = { 0 };
+    if (options->replayInput != NULL)
+    {
+        if (!load_input_log(&inputLog, &machines[0], options->replayInput))
+        {
+            free(machines);
+            return 1;
+        }
+
+        seed = inputLog.seed;
+        seed_machine(&machines[0], seed);
+        totalCycles = inputLog.cycles;
+    }
+
+    // Every instance boots into exactly the same state, so there's no need to
+    // go back to the disk for each one, just copy the first. Then give each a
+    // different seed, the same ones --batch uses.
+    for (int i = 1; i < instances; i++)
+    {
+        machines[i] = machines[0];
+        seed_machine(&machines[i], seed + i);
+    }
+
+    // Each instance is its own session in the stream.
+    C8_Stream stream = { 0 };
+    bool streaming = options->stream != NULL && options->replayInput == NULL && open_stream(&stream, options->stream, instances);
+
+    // And the first instance is the one that's recorded.
+    C8_Capture capture = { 0 };
+    bool capturing = options->capture != NULL && options->replayInput == NULL && open_capture(&capture, options->capture, options->captureScale);
+
+    // The runners keep the cycle count up to date once a frame (a group of
+    // instances at a time with --lockstep, only at the end for a replay).
+    C8_Metrics metrics = { 0 };
+    bool reporting = options->metrics != NULL && open_metrics(&metrics, options->metrics, "headless", instances);
+    if (reporting)
+    {
+        C8_ActiveMetrics = &metrics;
+        start_metrics_thread(&metrics);
+    }
+
+    double startTime = get_host_time();
+    long long frames = 0;
+    if (options->replayInput != NULL)
+    {
+        for (int i = 0; i < instances; i++)
+        {
+            frames = replay_input_log(&inputLog, &machines[i]);
+        }
+    }
+    else if (streaming || capturing)
+    {
+        frames = run_observed_frames(machines, instances, streaming ? &stream : NULL, capturing ? &capture : NULL, totalCycles);
+    }
+    else
+    {
+        frames = options->lockstep 
+            ? run_lockstep(machines, instances, totalCycles) 
+            : run_virtual_frames(machines, instances, run_cycles, totalCycles);
+    }
+    double wallTime = get_host_time() - startTime;
+    free_input_log(&inputLog);
+
+    if (reporting)
+    {
+        atomic_store(&metrics.cycles, totalCycles * instances);
+        stop_metrics_thread(&metrics);
+        close_metrics(&metrics);
+        C8_ActiveMetrics = NULL;
+    }
+
+    if (streaming)
+    {
+        close_stream(&stream);
+    }
+
+    // Waits for the encoder to catch up, which isn't part of the wall time.
+    if (capturing)
+    {
+        close_capture(&capture);
+    }
+
+#if C8_DEBUG_MODE
+    C8_Profile *profile = calloc(1, sizeof(C8_Profile));
+    for (int i = 0; profile != NULL && i < instances; i++)
+    {
+        merge_profile(profile, &machines[i].Profile);
+    }
+
+    if (profile != NULL)
+    {
+        save_profile(profile, &machines[0], C8_PROFILE_FILENAME);
+        free(profile);
+    }
+#endif
+
+    if (options->saveState != NULL && !save_snapshot_file(&machines[0], options->saveState))
+    {
+        free(machines);
+        return 1;
+    }
+
+    printf("rom:        %s\n", options->filename);
+    printf("instances:  %i\n", instances);
+    printf("seed:       %08x\n", seed);
+    printf("cycles:     %lld\n", totalCycles);
+    printf("frames:     %lld\n", frames);
+    printf("wall time:  %.6f s\n", wallTime);
+    printf("IPS:        %.0f\n", wallTime > 0.0 ? (totalCycles * instances) / wallTime : 0.0);
+
+    if (capturing)
+    {
+        printf("captured:   %lld ticks (%lld frames dropped)\n", capture.ticks, capture.dropped);
+    }
+
+    free(machines);
+    return 0;
+}
+
+// Runs the given number of cycles through one of the interpreter cores, ticking
+// the timers at every virtual 60Hz frame boundary. Returns the number of frames.
+// With a batch of machines they're all stepped through each frame in turn, so
+// they move forward together (the way a server would tick all of its sessions)
+// rather than the first one running to the end before the next gets going.
+long long run_virtual_frames(C8_Machine *machines, int machineCount, C8_Engine engine, long long totalCycles)
+{
+    long long executed = 0;
+    long long frames = 0;
+
+    while (executed < totalCycles)
+    {
+        // Every machine starts the frame from the same place, so they all end
+        // it in the same place too.
+        long long count = frame_cycles_left(executed, frames, totalCycles);
+        long long machineExecuted = executed;
+        long long machineFrames = frames;
+
+        for (int i = 0; i < machineCount; i++)
+        {
+            machineExecuted = executed;
+            machineFrames = frames;
+            step_virtual_frames(&machines[i], engine, &machineExecuted, &machineFrames, count);
+        }
+
+        executed = machineExecuted;
+        frames = machineFrames;
+
+        if (C8_ActiveMetrics != NULL)
+        {
+            atomic_store_explicit(&C8_ActiveMetrics->cycles, executed * machineCount, memory_order_relaxed);
+        }
+    }
+
+    return frames;
+}
+
+// The same as run_virtual_frames() with run_cycles(), but every machine's
+// display is offered to the stream at the end of each frame, and the first
+// machine's is captured at every tick. Either can be NULL.
+long long run_observed_frames(C8_Machine *machines, int machineCount, C8_Stream *stream, C8_Capture *capture, long long totalCycles)
+{
+    long long executed = 0;
+    long long frames = 0;
+
+    while (executed < totalCycles)
+    {
+        long long count = frame_cycles_left(executed, frames, totalCycles);
+        long long machineExecuted = executed;
+        long long machineFrames = frames;
+        double now = stream != NULL ? get_host_time() : 0.0;
+
+        for (int i = 0; i < machineCount; i++)
+        {
+            machineExecuted = executed;
+            machineFrames = frames;
+            step_virtual_frames(&machines[i], run_cycles, &machineExecuted, &machineFrames, count);
+
+            if (capture != NULL && i == 0 && machineFrames != frames)
+            {
+                capture_frame(capture, &machines[i]);
+            }
+
+            if (stream != NULL)
+            {
+                stream_frame(stream, i, &machines[i], now);
+                machines[i].DirtyRows = 0;
+            }
+        }
+
+        executed = machineExecuted;
+        frames = machineFrames;
+
+        if (C8_ActiveMetrics != NULL)
+        {
+            atomic_store_explicit(&C8_ActiveMetrics->cycles, executed * machineCount, memory_order_relaxed);
+        }
+    }
+
+    // However soon after the last frame sent the run finished, the viewers
+    // should end up with the final one.
+    for (int i = 0; stream != NULL && i < machineCount; i++)
+    {
+        stream->sessions[i].lastSent = 0.0;
+        stream_frame(stream, i, &machines[i], get_host_time());
+    }
+
+    return frames;
+}
+
+// The cycle that the timers tick on at the end of the given frame (keeps the
+// fractional part of 500 / 60 instead of rounding every frame). Everything that
+// runs virtual frames, the lockstep lanes included, goes by this.
+static inline long long virtual_tick(long long frames)
+{
+    return ((frames + 1) * C8_CLOCK_SPEED) / C8_TIMER_SPEED;
+}
+
+// How many cycles are left of the current frame, or of the run if it ends
+// first. Stepping that many never goes past a tick.
+long long frame_cycles_left(long long executed, long long frames, long long totalCycles)
+{
+    long long end = virtual_tick(frames);
+    return (end < totalCycles ? end : totalCycles) - executed;
+}
+
+// Runs count more cycles on one machine, carrying on from where it had got to
+// (executed cycles and frames so far) and ticking the timers at every 60Hz
+// boundary. This is the only place that does, everything else that runs
+// virtual frames steps through here. So a run split into chunks (or frames)
+// ends up in exactly the same place as one that went in one go.
+static inline void step_virtual_frames(C8_Machine *machine, C8_Engine engine, long long *executed, long long *frames, long long count)
+{
+    long long done = *executed;
+    long long frame = *frames;
+    long long target = done + count;
+
+    while (done < target)
+    {
+        long long nextTick = virtual_tick(frame);
+        long long cycles = (nextTick < target ? nextTick : target) - done;
+
+        engine(machine, (int)cycles);
+        done += cycles;
+
+        if (done == nextTick)
+        {
+            update_timers(machine);
+            frame++;
+        }
+    }
+
+    *executed = done;
+    *frames = frame;
+}
+
+// Puts the machine back into its power-on state with the given ROM loaded.
+void reset_machine(C8_Machine *machine, const char *filename, C8_Quirks quirks)
+{
+    int size = 0;
+    unsigned char *data = load_rom(filename, &size);
+
+    reset_machine_image(machine, data, size, quirks);
+    UnloadFileData(data);
+}
+
+// reset_machine() as a thread, so that reading the ROM in doesn't wait for the
+// window (or the other way round).
+void *boot_machine(void *data)
+{
+    C8_Boot *boot = data;
+    reset_machine(boot->machine, boot->filename, boot->quirks);
+    return NULL;
+}
+
+// The same, but with a ROM that is already in memory (e.g. out of a pack).
+void reset_machine_image(C8_Machine *machine, const unsigned char *data, int size, C8_Quirks quirks)
+{
+    // Clears the caches as well as the registers and RAM. The profile decides
+    // the tables and whether the big font goes in.
+    memset(machine, 0, sizeof(C8_Machine));
+    machine->Quirks = &quirk_profiles[quirks];
+    machine->Instructions = &instruction_sets[quirks];
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+    machine->PC = C8_START;
+    seed_machine(machine, C8_DEFAULT_SEED);
+    flush_block_cache(machine);
+
+    // Every page is the machine's own while the font and ROM go in, then they
+    // are swapped for the shared copy.
+    machine->PrivatePages = C8_ALL_PAGES;
+    load_hexfont_sprites(machine);
+    copy_rom_image(machine, data, size);
+
+    capture_state(machine, machine->BootState);
+    machine->BootHash = 14695981039346656037ULL;
+    for (int i = 0; i < C8_MEMORY; i++)
+    {
+        machine->BootHash ^= machine->RAM[i];
+        machine->BootHash *= 1099511628211ULL;
+    }
+
+    share_boot_image(machine);
+}
+
+// xorshift gets stuck on zero, so that seed is quietly swapped for another.
+void seed_machine(C8_Machine *machine, unsigned int seed)
+{
+    machine->Random = seed != 0 ? seed : C8_DEFAULT_SEED;
+}
+
+// Runs the same ROM for the same number of cycles through every interpreter
+// core that is compiled in, and reports how fast each one was. Each core gets
+// a few runs from a fresh reset and the best one is kept.
+int run_dispatch_benchmark(C8_Options *options)
+{
+    struct 
+    {
+        const char *name;
+        int dispatch;
+        C8_Engine engine;
+    } engines[] = {
+        { "table", C8_DISPATCH_TABLE, run_cycles_table },
+        { "switch", C8_DISPATCH_SWITCH, run_cycles_switch },
+#if defined(__GNUC__)
+        { "threaded", C8_DISPATCH_THREADED, run_cycles_threaded },
+#endif
+        { "blocks", C8_DISPATCH_BLOCKS, run_cycles_blocks },
+    };
+    int engineCount = sizeof(engines) / sizeof(engines[0]);
+    long long totalCycles = options->cycles > 0 ? options->cycles : 10000000;
+    unsigned long long referenceHash = 0;
+    int mismatches = 0;
+    C8_Machine *machine = calloc(1, sizeof(C8_Machine));
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    printf("rom: %s, %lld cycles, best of %i runs\n", options->filename, totalCycles, C8_BENCH_RUNS);
+
+    for (int i = 0; i < engineCount; i++)
+    {
+        double best = 0.0;
+
+        for (int run = 0; run < C8_BENCH_RUNS; run++)
+        {
+            reset_machine(machine, options->filename, options->quirks);
+            seed_machine(machine, C8_BENCH_SEED);
+
+            double startTime = get_host_time();
+            run_virtual_frames(machine, 1, engines[i].engine, totalCycles);
+            double wallTime = get_host_time() - startTime;
+
+            if (run == 0 || wallTime < best)
+            {
+                best = wallTime;
+            }
+        }
+
+        // Every core should end up in exactly the same state as the plain
+        // table one (same seed for Cxkk), if it doesn't then one of them has 
+        // a bug.
+        unsigned long long hash = hash_machine_state(machine);
+        if (i == 0)
+        {
+            referenceHash = hash;
+        }
+        else if (hash != referenceHash)
+        {
+            mismatches++;
+        }
+
+        printf("%-10s %8.2f ns/op %14.0f IPS   %016llx %s%s\n", 
+            engines[i].name, 
+            (best * 1000000000.0) / totalCycles, 
+            best > 0.0 ? totalCycles / best : 0.0,
+            hash,
+            hash == referenceHash ? "ok" : "MISMATCH",
+            C8_DISPATCH == engines[i].dispatch ? "   <- run_cycles()" : "");
+    }
+
+    free(machine);
+    return mismatches > 0 ? 1 : 0;
+}
+
+// Times the pieces of the interpreter on their own, where --bench-dispatch
+// times whole ROMs: decoding, the table dispatch, the draw kernel (different
+// heights, with and without wrapping), CLS, the bulk register copies and the
+// renderer drawing frames captured from the ROM. Each case is run a few times
+// and the mean and spread of those runs is printed. Given a --baseline saved
+// by an earlier --save-baseline, any case more than C8_BENCH_TOLERANCE slower
+// than it was makes the whole run fail.
+int run_micro_benchmarks(C8_Options *options)
+{
+    struct 
+    {
+        const char *name;
+        C8_Handler handler;
+        unsigned short opcode;
+        unsigned char vx;
+        unsigned char vy;
+        unsigned short i;
+    } cases[] = {
+        // parse_instruction() just decodes whatever is at the PC (the ROM's
+        // first instruction), so it doesn't need an opcode of its own.
+        { "parse", parse_instruction, 0x0000, 0, 0, 0 },
+        { "dispatch_7xkk", execute_instruction, 0x7001, 0, 0, 0 },
+        { "dispatch_8xy4", execute_instruction, 0x8014, 0, 0, 0 },
+        { "dispatch_fx1e", execute_instruction, 0xF01E, 0, 0, 0 },
+        { "drw_h1", C8_DRW_VX_VY_NIBBLE, 0xD011, 8, 8, 0 },
+        { "drw_h5", C8_DRW_VX_VY_NIBBLE, 0xD015, 8, 8, 0 },
+        { "drw_h15", C8_DRW_VX_VY_NIBBLE, 0xD01F, 8, 8, 0 },
+        { "drw_h15_wrap_x", C8_DRW_VX_VY_NIBBLE, 0xD01F, 60, 8, 0 },
+        { "drw_h15_wrap_y", C8_DRW_VX_VY_NIBBLE, 0xD01F, 8, 24, 0 },
+        { "drw_h15_wrap_xy", C8_DRW_VX_VY_NIBBLE, 0xD01F, 60, 24, 0 },
+        { "cls", C8_CLS, 0x00E0, 0, 0, 0 },
+        { "ld_i_v0", C8_LD_I_VX, 0xF055, 0, 0, 0x0600 },
+        { "ld_i_vf", C8_LD_I_VX, 0xFF55, 0, 0, 0x0600 },
+        { "ld_vf_i", C8_LD_VX_I, 0xFF65, 0, 0, 0x0600 },
+    };
+    int caseCount = sizeof(cases) / sizeof(cases[0]);
+
+    // Room for every case above plus the two renderer ones.
+    char names[32][32];
+    double means[32];
+    double deviations[32];
+    int resultCount = 0;
+
+    char baseNames[64][32];
+    double baseMeans[64];
+    int baseCount = 0;
+    int regressions = 0;
+
+    if (options->baseline != NULL && !load_baseline(options->baseline, baseNames, baseMeans, 64, &baseCount))
+    {
+        return 1;
+    }
+
+    C8_Machine *machine = calloc(1, sizeof(C8_Machine));
+    C8_Frame *frames = calloc(C8_BENCH_FRAMES, sizeof(C8_Frame));
+    C8_Instruction instruction;
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    // The frames the renderer is timed on are just the first second or so of
+    // the ROM, one per virtual frame.
+    {
+        long long executed = 0;
+        long long frameCount = 0;
+
+        reset_machine(machine, options->filename, options->quirks);
+        seed_machine(machine, C8_BENCH_SEED);
+
+        for (int i = 0; i < C8_BENCH_FRAMES; i++)
+        {
+            step_virtual_frames(machine, run_cycles, &executed, &frameCount, C8_CLOCK_SPEED / C8_TIMER_SPEED);
+            memcpy(frames[i].Buffer, machine->Buffer, sizeof(frames[i].Buffer));
+            memcpy(frames[i].HiresBuffer, machine->HiresBuffer, sizeof(frames[i].HiresBuffer));
+            frames[i].HighRes = machine->HighRes;
+            frames[i].DirtyRows = machine->DirtyRows;
+            machine->DirtyRows = 0;
+        }
+    }
+
+    // Only the render cases need a window, and a hidden one will do. If there
+    // isn't a display to open it on then they are left out.
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(785, 360, "raychip-8");
+    bool hasWindow = IsWindowReady();
+    if (hasWindow)
+    {
+        initialize_renderer();
+    }
+
+    printf("rom: %s, mean +/- stddev of %i runs\n", options->filename, C8_BENCH_RUNS);
+
+    for (int i = 0; i < caseCount + 2; i++)
+    {
+        double samples[C8_BENCH_RUNS];
+        bool render = i >= caseCount;
+        long long count = render ? C8_BENCH_RENDERS : C8_BENCH_OPS;
+        const char *name = render ? (i == caseCount ? "render_frames" : "render_unchanged") : cases[i].name;
+
+        if (render && !hasWindow)
+        {
+            printf("%-18s skipped, no window\n", name);
+            continue;
+        }
+
+        // Run -1 is a warm-up (caches, branch predictors, the CPU's clock)
+        // and doesn't count.
+        for (int run = -1; run < C8_BENCH_RUNS; run++)
+        {
+            double startTime;
+
+            if (render)
+            {
+                // The first frame (and the keypad and HUD) always has to be drawn,
+                // after that "frames" only redraws the rows that changed from
+                // one captured frame to the next and "unchanged" redraws 
+                // nothing, which is what the window does most of the time.
+                memset(C8_ScreenRows, 0, sizeof(C8_ScreenRows));
+                memset(C8_HiresRows, 0, sizeof(C8_HiresRows));
+                C8_KeypadChanged = true;
+                C8_HudChanged = true;
+
+                startTime = get_host_time();
+                for (long long n = 0; n < count; n++)
+                {
+                    render_buffer(i == caseCount || n == 0 ? &frames[n % C8_BENCH_FRAMES] : NULL, 125, 20);
+                }
+            }
+            else
+            {
+                reset_machine(machine, options->filename, options->quirks);
+                seed_machine(machine, C8_BENCH_SEED);
+
+                if (cases[i].opcode != 0x0000)
+                {
+                    write_ram(machine, machine->PC, cases[i].opcode >> 8);
+                    write_ram(machine, machine->PC + 1, cases[i].opcode & 0xFF);
+                }
+
+                memset(&instruction, 0, sizeof(instruction));
+                parse_instruction(machine, &instruction);
+                machine->V[0] = cases[i].vx;
+                machine->V[1] = cases[i].vy;
+                machine->I = cases[i].i;
+
+                C8_Handler handler = cases[i].handler;
+                startTime = get_host_time();
+                for (long long n = 0; n < count; n++)
+                {
+                    handler(machine, &instruction);
+                }
+            }
+
+            if (run >= 0)
+            {
+                samples[run] = ((get_host_time() - startTime) * 1000000000.0) / count;
+            }
+        }
+
+        double mean = 0.0;
+        double variance = 0.0;
+        for (int run = 0; run < C8_BENCH_RUNS; run++)
+        {
+            mean += samples[run] / C8_BENCH_RUNS;
+        }
+        for (int run = 0; run < C8_BENCH_RUNS; run++)
+        {
+            variance += ((samples[run] - mean) * (samples[run] - mean)) / (C8_BENCH_RUNS - 1);
+        }
+
+        strncpy(names[resultCount], name, sizeof(names[resultCount]) - 1);
+        names[resultCount][sizeof(names[resultCount]) - 1] = '\0';
+        means[resultCount] = mean;
+        deviations[resultCount] = sqrt(variance);
+
+        printf("%-18s %10.2f ns/op +/- %8.2f", name, mean, deviations[resultCount]);
+
+        // Compare with the same case in the baseline, if it has one.
+        for (int j = 0; j < baseCount; j++)
+        {
+            if (strcmp(baseNames[j], name) != 0)
+            {
+                continue;
+            }
+
+            double change = baseMeans[j] > 0.0 ? (mean - baseMeans[j]) / baseMeans[j] : 0.0;
+            bool slower = change > C8_BENCH_TOLERANCE;
+            regressions += slower;
+
+            printf("   was %10.2f %+7.1f%% %s", baseMeans[j], change * 100.0, slower ? "SLOWER" : "ok");
+            break;
+        }
+
+        printf("\n");
+        resultCount++;
+    }
+
+    if (hasWindow)
+    {
+        UnloadTexture(C8_ScreenTexture);
+        UnloadTexture(C8_HiresTexture);
+        UnloadRenderTexture(C8_KeypadTexture);
+        UnloadRenderTexture(C8_HudTexture);
+        CloseWindow();
+    }
+
+    // The baseline is one "name mean stddev" line per case.
+    if (options->saveBaseline != NULL)
+    {
+        FILE *file = fopen(options->saveBaseline, "w");
+        if (file != NULL)
+        {
+            for (int i = 0; i < resultCount; i++)
+            {
+                fprintf(file, "%s %.4f %.4f\n", names[i], means[i], deviations[i]);
+            }
+            fclose(file);
+        }
+        else
+        {
+            TraceLog(LOG_WARNING, "BENCH: [%s] Failed to save baseline", options->saveBaseline);
+        }
+    }
+
+    free(frames);
+    free(machine);
+    return regressions > 0 ? 1 : 0;
+}
+
+bool load_baseline(const char *filename, char names[][32], double *means, int capacity, int *count)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        TraceLog(LOG_ERROR, "BENCH: [%s] Failed to load baseline", filename);
+        return false;
+    }
+
+    double deviation;
+    *count = 0;
+    while (*count < capacity && fscanf(file, "%31s %lf %lf", names[*count], &means[*count], &deviation) == 3)
+    {
+        (*count)++;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Runs each ROM (or every .ch8 in a directory) headless for a fixed number of
+// cycles and checks what ends up on the display against the golden file, so
+// the test suite ROMs don't have to be checked by eye in the window anymore.
+// Also reports how long each one took and the last frame the display changed
+// on, i.e. how far into the budget the ROM had actually finished drawing. 
+// With --update-golden the hashes are written to the golden file instead of
+// being checked.
+int run_tests(C8_Options *options)
+{
+    long long totalCycles = options->cycles;
+    if (totalCycles <= 0)
+    {
+        long long totalFrames = options->frames > 0 ? options->frames : C8_TEST_FRAMES;
+        totalCycles = (totalFrames * C8_CLOCK_SPEED) / C8_TIMER_SPEED;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    uint32_t seed = options->seed != 0 ? options->seed : C8_DEFAULT_SEED;
+    const char *single[1] = { options->filename };
+    const char **arguments = options->filenameCount > 0 ? options->filenames : single;
+    int argumentCount = options->filenameCount > 0 ? options->filenameCount : 1;
+
+    // Count the ROMs first, the golden entries need room for all of them.
+    int romCount = 0;
+    for (int i = 0; i < argumentCount; i++)
+    {
+        if (DirectoryExists(arguments[i]))
+        {
+            FilePathList roms = LoadDirectoryFilesEx(arguments[i], ".ch8", false);
+            romCount += roms.count;
+            UnloadDirectoryFiles(roms);
+        }
+        else
+        {
+            romCount++;
+        }
+    }
+
+    // A missing golden file is fine, everything is just "new". One that can't
+    // be read to the end still gets checked against as far as it went, but
+    // isn't written back, that would lose the rest of it.
+    C8_GoldenEntry *entries = NULL;
+    int entryCount = 0;
+    bool loaded = load_golden_file(options->golden, &entries, &entryCount, romCount);
+    if (entries == NULL)
+    {
+        return 1;
+    }
+
+    C8_Machine *machine = calloc(1, sizeof(C8_Machine));
+    int passed = 0;
+    int failed = 0;
+    int added = 0;
+    double totalTime = 0.0;
+
+    printf("golden: %s, %lld cycles, seed %08x\n", options->golden, totalCycles, seed);
+
+    for (int i = 0; i < argumentCount; i++)
+    {
+        FilePathList roms = { 0 };
+        const char *one[1] = { arguments[i] };
+        const char **filenames = one;
+        int count = 1;
+
+        if (DirectoryExists(arguments[i]))
+        {
+            roms = LoadDirectoryFilesEx(arguments[i], ".ch8", false);
+            filenames = (const char **)roms.paths;
+            count = roms.count;
+        }
+
+        for (int j = 0; j < count; j++)
+        {
+            uint64_t last[C8_HEIGHT];
+            long long executed = 0;
+            long long frames = 0;
+            long long settled = 0;
+
+            reset_machine(machine, filenames[j], options->quirks);
+            seed_machine(machine, seed);
+            memcpy(last, machine->Buffer, sizeof(last));
+
+            // One virtual frame at a time, so that we can tell when the
+            // display stopped changing.
+            double startTime = get_host_time();
+            while (executed < totalCycles)
+            {
+                step_virtual_frames(machine, run_cycles, &executed, &frames, frame_cycles_left(executed, frames, totalCycles));
+
+                if (memcmp(last, machine->Buffer, sizeof(last)) != 0)
+                {
+                    memcpy(last, machine->Buffer, sizeof(last));
+                    settled = frames;
+                }
+            }
+            double wallTime = get_host_time() - startTime;
+            totalTime += wallTime;
+
+            unsigned long long hash = hash_framebuffer(machine);
+            const char *name = GetFileName(filenames[j]);
+            const char *result = "NEW";
+
+            // Golden hashes only count for the same ROM run for the same
+            // number of cycles.
+            C8_GoldenEntry *entry = NULL;
+            for (int k = 0; k < entryCount; k++)
+            {
+                if (strcmp(entries[k].name, name) == 0 && entries[k].cycles == totalCycles)
+                {
+                    entry = &entries[k];
+                    break;
+                }
+            }
+
+            if (options->updateGolden)
+            {
+                if (entry == NULL)
+                {
+                    entry = &entries[entryCount++];
+                    strncpy(entry->name, name, sizeof(entry->name) - 1);
+                    entry->cycles = totalCycles;
+                    entry->hash = hash;
+                    added++;
+                }
+                else
+                {
+                    result = entry->hash == hash ? "same" : "UPDATED";
+                    entry->hash = hash;
+                }
+            }
+            else if (entry == NULL)
+            {
+                failed++;
+            }
+            else if (entry->hash == hash)
+            {
+                result = "pass";
+                passed++;
+            }
+            else
+            {
+                result = "FAIL";
+                failed++;
+            }
+
+            printf("%-40s %-7s %016llx %10.3f ms   settled at frame %lld\n", 
+                name, 
+                result, 
+                hash, 
+                wallTime * 1000.0, 
+                settled);
+        }
+
+        if (roms.paths != NULL)
+        {
+            UnloadDirectoryFiles(roms);
+        }
+    }
+
+    int status = 0;
+    if (options->updateGolden)
+    {
+        printf("%i added, %i total, %.3f ms\n", added, entryCount, totalTime * 1000.0);
+        status = save_golden_file(options->golden, entries, entryCount, loaded) ? 0 : 1;
+    }
+    else
+    {
+        printf("%i passed, %i failed, %.3f ms\n", passed, failed, totalTime * 1000.0);
+        status = failed > 0 || !loaded ? 1 : 0;
+    }
+
+    free(machine);
+    free(entries);
+    return status;
+}
+
+// The golden file is one "name cycles hash" line per ROM. The name is everything
+// before the last two fields, so it can have spaces in it. The entries grow to
+// fit the whole file, plus room for extra more. Returns false if the file
+// couldn't be read to the end (a line that doesn't parse or is too long, or no
+// memory), with *count the entries read up to there. No file yet is fine.
+bool load_golden_file(const char *filename, C8_GoldenEntry **entries, int *count, int extra)
+{
+    int capacity = extra > 0 ? extra : 1;
+    *entries = calloc(capacity, sizeof(C8_GoldenEntry));
+    *count = 0;
+    if (*entries == NULL)
+    {
+        TraceLog(LOG_ERROR, "TEST: Not enough memory for the golden hashes");
+        return false;
+    }
+
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        return true;
+    }
+
+    char line[C8_GOLDEN_LINE + 64];
+    int lineNumber = 0;
+    bool complete = true;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] != '\n' && !feof(file))
+        {
+            TraceLog(LOG_ERROR, "TEST: [%s] Line %i is too long", filename, lineNumber);
+            complete = false;
+            break;
+        }
+
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+
+        if (length == 0)
+        {
+            continue;
+        }
+
+        // Split the hash and then the cycles off the end.
+        char *hashField = strrchr(line, ' ');
+        char *end = NULL;
+        unsigned long long hash = 0;
+        long long cycles = 0;
+        char *cyclesField = NULL;
+
+        if (hashField != NULL)
+        {
+            *hashField++ = '\0';
+            hash = strtoull(hashField, &end, 16);
+            cyclesField = strrchr(line, ' ');
+        }
+
+        bool valid = hashField != NULL && end != hashField && *end == '\0' && cyclesField != NULL;
+        if (valid)
+        {
+            *cyclesField++ = '\0';
+            cycles = strtoll(cyclesField, &end, 10);
+            valid = end != cyclesField && *end == '\0' && line[0] != '\0' && strlen(line) < C8_GOLDEN_LINE;
+        }
+
+        if (!valid)
+        {
+            TraceLog(LOG_ERROR, "TEST: [%s] Line %i isn't \"name cycles hash\"", filename, lineNumber);
+            complete = false;
+            break;
+        }
+
+        if (*count + extra >= capacity)
+        {
+            int grown = capacity * 2;
+            C8_GoldenEntry *more = realloc(*entries, grown * sizeof(C8_GoldenEntry));
+            if (more == NULL)
+            {
+                TraceLog(LOG_ERROR, "TEST: [%s] Not enough memory for the golden hashes", filename);
+                complete = false;
+                break;
+            }
+            *entries = more;
+            capacity = grown;
+        }
+
+        C8_GoldenEntry *entry = &(*entries)[(*count)++];
+        memset(entry, 0, sizeof(C8_GoldenEntry));
+        strcpy(entry->name, line);
+        entry->cycles = cycles;
+        entry->hash = hash;
+    }
+
+    if (ferror(file))
+    {
+        TraceLog(LOG_ERROR, "TEST: [%s] Failed to read golden file", filename);
+        complete = false;
+    }
+
+    fclose(file);
+    return complete;
+}
+
+// Won't write over a golden file that wasn't read all the way through, the
+// entries past where it stopped would be lost.
+bool save_golden_file(const char *filename, C8_GoldenEntry *entries, int count, bool loaded)
+{
+    if (!loaded)
+    {
+        TraceLog(LOG_ERROR, "TEST: [%s] Not saving, the golden file wasn't read to the end", filename);
+        return false;
+    }
+
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        TraceLog(LOG_ERROR, "TEST: [%s] Failed to save golden file", filename);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, "%s %lld %016llx\n", entries[i].name, entries[i].cycles, entries[i].hash);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// FNV-1a over just the display, what --batch reports for each machine (the
+// one that's showing, in the 128x64 mode that's a row pair at a time).
+unsigned long long hash_framebuffer(C8_Machine *machine)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    if (machine->HighRes)
+    {
+        for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+        {
+            for (int j = 0; j < 16; j++)
+            {
+                hash ^= (machine->HiresBuffer[i][j / 8] >> (56 - ((j % 8) * 8))) & 0xFF;
+                hash *= 1099511628211ULL;
+            }
+        }
+
+        return hash;
+    }
+
+    for (int i = 0; i < C8_HEIGHT; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            hash ^= (machine->Buffer[i] >> (56 - (j * 8))) & 0xFF;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
+
+// FNV-1a over everything that makes up the machine state, used to check that
+// two runs ended up in the same place.
+unsigned long long hash_machine_state(C8_Machine *machine)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const struct 
+    { 
+        const void *data; 
+        size_t size; 
+    } parts[] = {
+        { machine->V, sizeof(machine->V) },
+        { &machine->I, sizeof(machine->I) },
+        { &machine->DT, sizeof(machine->DT) },
+        { &machine->ST, sizeof(machine->ST) },
+        { &machine->PC, sizeof(machine->PC) },
+        { &machine->SP, sizeof(machine->SP) },
+        { machine->STACK, sizeof(machine->STACK) },
+        { machine->Buffer, sizeof(machine->Buffer) },
+        { &machine->HighRes, sizeof(machine->HighRes) },
+        { machine->HiresBuffer, sizeof(machine->HiresBuffer) },
+        { machine->Flags, sizeof(machine->Flags) },
+    };
+    size_t partCount = sizeof(parts) / sizeof(parts[0]);
+
+    // SUPER-CHIP's last three only count once a program has used them, so
+    // that everything else hashes the same as it always has.
+    uint64_t used = machine->HighRes;
+    for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+    {
+        used |= machine->HiresBuffer[i][0] | machine->HiresBuffer[i][1];
+    }
+    for (int i = 0; i < C8_V_REGISTER_COUNT; i++)
+    {
+        used |= machine->Flags[i];
+    }
+    if (used == 0)
+    {
+        partCount -= 3;
+    }
+
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        const unsigned char *page = ram_page(machine, i);
+        for (int j = 0; j < C8_PAGE_SIZE; j++)
+        {
+            hash ^= page[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    for (size_t i = 0; i < partCount; i++)
+    {
+        const unsigned char *bytes = parts[i].data;
+        for (size_t j = 0; j < parts[i].size; j++)
+        {
+            hash ^= bytes[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
+
+void parse_instruction(C8_Machine *machine, C8_Instruction *instruction)
+{
+    // Note: the ordering in which you & and >> is important, so use brackets
+    // to ensure that the ordering happens as desired.
+
+    // All instructions are 2 bytes long and are stored most-significant-byte first.
+    // In memory, the first byte of each instruction should be located at an even
+    // address. If a program includes sprite data, it should be padded so any 
+    // instructions following it will be properly situated in RAM.
+    // (Bnnn can jump past the end of RAM, so wrap round like everything else.)
+    unsigned char first_byte        = read_ram(machine, machine->PC);
+    unsigned char second_byte       = read_ram(machine, machine->PC + 1);
+    unsigned short opcode           = (first_byte << 8) | second_byte;
+
+    instruction->opcode             = opcode;
+
+    // msn or most-significant-nibble - A 4-bit value, the highest 4 bits of the instruction
+    instruction->msn                = (opcode & 0xF000) >> 12;
+    
+    // nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
+    instruction->addr               = (opcode & 0x0FFF);
+
+    // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
+    instruction->n                  = (opcode & 0x000F);
+
+    // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
+    instruction->x                  = (opcode & 0x0F00) >> 8;
+
+    // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
+    instruction->y                  = (opcode & 0x00F0) >> 4;
+
+    // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
+    instruction->kk                 = (opcode & 0x00FF);
+}
+
+void increment_program_counter(C8_Machine *machine, C8_Instruction *instruction)
+{
+    if (instruction->skip > 0)
+    {
+        instruction->skip = 0;
+    }
+    else
+    {
+        machine->PC += 2;
+    }
+}
+
+// Finds the decoded instruction at the PC, decoding it first if this is the
+// first time we've been here (or the memory has been written to since).
+// Instructions should always be at even addresses, but if a program jumps to
+// an odd one then it gets decoded into the scratch slot every time instead.
+C8_DecodedInstruction *fetch_instruction(C8_Machine *machine, C8_DecodedInstruction *scratch)
+{
+    C8_DecodedInstruction *decoded = scratch;
+
+    if ((machine->PC & 1) == 0)
+    {
+        decoded = &machine->DecodeCache[(machine->PC & (C8_MEMORY - 1)) >> 1];
+        if (decoded->handler != NULL)
+        {
+            return decoded;
+        }
+    }
+
+    parse_instruction(machine, &decoded->instruction);
+    decoded->handler = resolve_handler(machine, &decoded->instruction);
+
+    for (int op = 0; op < C8_OP_COUNT; op++)
+    {
+        if (instruction_handlers[op] == decoded->handler)
+        {
+            decoded->op = op;
+            break;
+        }
+    }
+
+    return decoded;
+}
+
+// The opcode at addr, wrapping round the end of RAM the way parse_instruction()
+// does.
+unsigned short peek_opcode(C8_Machine *machine, int addr)
+{
+    return (read_ram(machine, addr) << 8) | read_ram(machine, addr + 1);
+}
+
+// Nothing from outside (timers, keypad) changes while the machine is inside a
+// run_cycles() call, so a loop that can only be waiting for one of them is stuck
+// until the call is over. These are the usual ones, with PC anywhere in them:
+//   1nnn to itself, Fx0A with no key pressed yet, or SUPER-CHIP's 00FD (both
+//     hold PC where it is) - nothing changes at all
+//   Fx07, 3xkk/4xkk, 1nnn back to the Fx07 - waiting on DT, each time round just
+//     loads the same DT into Vx (which reg is set to)
+//   Ex9E/ExA1, 1nnn back to it - waiting on a key, nothing changes at all
+// Returns how many cycles it takes to go round the loop once, 0 if the machine
+// isn't idling (or would leave the loop next time round).
+int find_idle_loop(C8_Machine *machine, int *reg)
+{
+    int pc = machine->PC & (C8_MEMORY - 1);
+    unsigned short opcode = peek_opcode(machine, pc);
+
+    *reg = -1;
+
+    bool waiting = (opcode & 0xF0FF) == 0xF00A && machine->WaitingForKey && machine->KeyPresses == 0;
+    if (opcode == (0x1000 | pc) || waiting || (opcode == 0x00FD && machine->Quirks->superChip))
+    {
+        return 1;
+    }
+
+    for (int position = 0; position < 3; position++)
+    {
+        int head = pc - (position * 2);
+        unsigned short load = peek_opcode(machine, head);
+        unsigned short test = peek_opcode(machine, head + 2);
+        int x = (load >> 8) & 0xF;
+
+        if (head < 0 || (load & 0xF0FF) != 0xF007 || peek_opcode(machine, head + 4) != (0x1000 | head) ||
+            ((test & 0xF000) != 0x3000 && (test & 0xF000) != 0x4000) || ((test >> 8) & 0xF) != x)
+        {
+            continue;
+        }
+
+        // It goes round again as long as the test doesn't skip the jump. That's
+        // with DT in Vx, and with Vx as it is now if the test is next.
+        bool skipOnEqual = (test & 0xF000) == 0x3000;
+        unsigned char kk = test & 0xFF;
+        if ((machine->DT == kk) == skipOnEqual || (position == 1 && (machine->V[x] == kk) == skipOnEqual))
+        {
+            return 0;
+        }
+
+        *reg = x;
+        return 3;
+    }
+
+    for (int position = 0; position < 2; position++)
+    {
+        int head = pc - (position * 2);
+        unsigned short test = peek_opcode(machine, head);
+        unsigned char key = machine->V[(test >> 8) & 0xF] & 0xF;
+
+        if (head < 0 || ((test & 0xF0FF) != 0xE09E && (test & 0xF0FF) != 0xE0A1) ||
+            peek_opcode(machine, head + 2) != (0x1000 | head))
+        {
+            continue;
+        }
+
+        bool skipWhenPressed = (test & 0xFF) == 0x9E;
+        return (bool)((machine->Keys >> key) & 1) == skipWhenPressed ? 0 : 2;
+    }
+
+    return 0;
+}
+
+// Skips as many whole times round an idle loop as fit in count cycles, the
+// machine ends up exactly where running them would have left it. Returns the
+// number of cycles skipped.
+int skip_idle_cycles(C8_Machine *machine, int count)
+{
+    int reg;
+    int period = find_idle_loop(machine, &reg);
+
+    if (period == 0 || count < period)
+    {
+        return 0;
+    }
+
+    if (reg >= 0)
+    {
+        machine->V[reg] = machine->DT;
+    }
+
+    return count - (count % period);
+}
+
+// Runs a batch of fetch/decode/execute cycles back-to-back without going
+// back out to the main loop in-between. Any of them that would only be spent
+// going round an idle loop are skipped.
+void run_cycles(C8_Machine *machine, int count)
+{
+    machine->Cycles += count;
+    int skipped = skip_idle_cycles(machine, count);
+    count -= skipped;
+
+#if C8_DEBUG_MODE
+    machine->Profile.IdleCycles += skipped;
+    run_cycles_profiled(machine, count);
+#elif C8_DISPATCH == C8_DISPATCH_BLOCKS
+    run_cycles_blocks(machine, count);
+#elif C8_DISPATCH == C8_DISPATCH_THREADED
+    run_cycles_threaded(machine, count);
+#elif C8_DISPATCH == C8_DISPATCH_SWITCH
+    run_cycles_switch(machine, count);
+#else
+    run_cycles_table(machine, count);
+#endif
+}
+
+void run_cycles_table(C8_Machine *machine, int count)
+{
+    C8_DecodedInstruction scratch = {0};
+
+    for (int i = 0; i < count; i++)
+    {
+        C8_DecodedInstruction *decoded = fetch_instruction(machine, &scratch);
+
+        decoded->handler(machine, &decoded->instruction);
+
+        increment_program_counter(machine, &decoded->instruction);
+    }
+}
+
+// The handlers are called directly by name here rather than through a pointer,
+// so the compiler is free to inline the small ones into the switch.
+void run_cycles_switch(C8_Machine *machine, int count)
+{
+    C8_DecodedInstruction scratch = {0};
+
+    for (int i = 0; i < count; i++)
+    {
+        C8_DecodedInstruction *decoded = fetch_instruction(machine, &scratch);
+
+        switch (decoded->op)
+        {
+#define C8_SWITCH_CASE(name)    case C8_OP_##name: C8_##name(machine, &decoded->instruction); break;
+            C8_INSTRUCTION_LIST(C8_SWITCH_CASE)
+#undef C8_SWITCH_CASE
+        }
+
+        increment_program_counter(machine, &decoded->instruction);
+    }
+}
+
+#if defined(__GNUC__)
+// Threaded code using GCC/Clang's labels-as-values: every instruction jumps
+// straight to the next one's label, so there is one indirect branch per
+// instruction (spread out, which the branch predictor likes) and no loop or
+// bounds check like the switch has.
+void run_cycles_threaded(C8_Machine *machine, int count)
+{
+#define C8_THREADED_LABEL(name) &&op_##name,
+    static void *labels[C8_OP_COUNT] = { C8_INSTRUCTION_LIST(C8_THREADED_LABEL) };
+#undef C8_THREADED_LABEL
+
+    C8_DecodedInstruction scratch = {0};
+    C8_DecodedInstruction *decoded;
+
+#define C8_THREADED_NEXT()                                          \
+    if (count-- <= 0)                                               \
+    {                                                               \
+        return;                                                     \
+    }                                                               \
+    decoded = fetch_instruction(machine, &scratch);                          \
+    goto *labels[decoded->op];
+
+#define C8_THREADED_OP(name)                                        \
+    op_##name:                                                      \
+        C8_##name(machine, &decoded->instruction);                           \
+        increment_program_counter(machine, &decoded->instruction);           \
+        C8_THREADED_NEXT();
+
+    C8_THREADED_NEXT();
+    C8_INSTRUCTION_LIST(C8_THREADED_OP)
+
+#undef C8_THREADED_OP
+#undef C8_THREADED_NEXT
+}
+#else
+void run_cycles_threaded(C8_Machine *machine, int count)
+{
+    run_cycles_switch(machine, count);
+}
+#endif
+
+// Does this instruction have to be the last one in a basic block?
+bool is_block_terminator(C8_Op op)
+{
+    switch (op)
+    {
+        case C8_OP_RET:
+        case C8_OP_JP_ADDR:
+        case C8_OP_CALL_ADDR:
+        case C8_OP_SE_VX_BYTE:
+        case C8_OP_SNE_VX_BYTE:
+        case C8_OP_SE_VX_VY:
+        case C8_OP_SNE_VX_VY:
+        case C8_OP_JP_V0_ADDR:
+        case C8_OP_JP_VX_ADDR:
+        case C8_OP_DRW_VX_VY_NIBBLE:
+        case C8_OP_DRW_VX_VY_NIBBLE_CLIP:
+        case C8_OP_SKP_VX:
+        case C8_OP_SKNP_VX:
+        case C8_OP_LD_VX_K:
+        case C8_OP_EXIT:
+        case C8_OP_LD_B_VX:
+        case C8_OP_LD_I_VX:
+        case C8_OP_LD_I_VX_MOVE_I:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Translates the block starting at the PC, returns NULL if there isn't room
+// left in the pool (the caller flushes and tries again).
+C8_Block *translate_block(C8_Machine *machine)
+{
+    C8_Block *block = &machine->BlockCache[machine->PC >> 1];
+    C8_DecodedInstruction *code = &machine->BlockPool[machine->BlockPoolUsed];
+    unsigned short pc = machine->PC;
+    int length = 0;
+
+    if (machine->BlockPoolUsed + C8_BLOCK_MAX_LENGTH > C8_BLOCK_POOL_SIZE)
+    {
+        return NULL;
+    }
+
+    while (length < C8_BLOCK_MAX_LENGTH && pc < C8_MEMORY - 1)
+    {
+        // Copy the instruction out of the decode cache (which is much more
+        // likely to survive a flush than the blocks are), fetch_instruction()
+        // reads from the PC so borrow it for a moment.
+        C8_DecodedInstruction scratch = {0};
+        unsigned short savedPC = machine->PC;
+        machine->PC = pc;
+        code[length] = *fetch_instruction(machine, &scratch);
+        code[length].instruction.skip = 0;
+        machine->PC = savedPC;
+
+        machine->BlockCoverage[pc] = machine->BlockGeneration;
+        machine->BlockCoverage[pc + 1] = machine->BlockGeneration;
+        length++;
+        pc += 2;
+
+        if (is_block_terminator(code[length - 1].op))
+        {
+            break;
+        }
+    }
+
+    machine->BlockPoolUsed += length;
+    block->code = code;
+    block->length = length;
+    block->generation = machine->BlockGeneration;
+
+    return block;
+}
+
+void flush_block_cache(C8_Machine *machine)
+{
+    machine->BlockPoolUsed = 0;
+    machine->BlockGeneration++;
+
+    // Once in a blue moon the generation wraps, so start again from scratch
+    // or very old blocks would come back to life.
+    if (machine->BlockGeneration == 0)
+    {
+        memset(machine->BlockCache, 0, sizeof(machine->BlockCache));
+        memset(machine->BlockCoverage, 0, sizeof(machine->BlockCoverage));
+        machine->BlockGeneration = 1;
+    }
+}
+
+// Runs whole basic blocks at a time. Everything before the last instruction in
+// a block is straight-line code that doesn't look at the PC, so those closures
+// are called back-to-back and the PC is only moved on once, just before running
+// the last one (which might jump/skip/call and so needs the real PC). Odd PCs
+// and blocks that don't fit into what's left of the count are stepped through
+// one instruction at a time like the table core does.
+void run_cycles_blocks(C8_Machine *machine, int count)
+{
+    C8_DecodedInstruction scratch = {0};
+
+    while (count > 0)
+    {
+        C8_Block *block = NULL;
+
+        if ((machine->PC & 1) == 0 && machine->PC < C8_MEMORY - 1)
+        {
+            block = &machine->BlockCache[machine->PC >> 1];
+            if (block->generation != machine->BlockGeneration)
+            {
+                block = translate_block(machine);
+                if (block == NULL)
+                {
+                    flush_block_cache(machine);
+                    block = translate_block(machine);
+                }
+            }
+        }
+
+        if (block == NULL || block->length > count)
+        {
+            C8_DecodedInstruction *decoded = fetch_instruction(machine, &scratch);
+            decoded->handler(machine, &decoded->instruction);
+            increment_program_counter(machine, &decoded->instruction);
+            count--;
+            continue;
+        }
+
+        // Take copies, the last instruction could write to memory and flush
+        // the block cache out from under us.
+        C8_DecodedInstruction *code = block->code;
+        int length = block->length;
+        int last = length - 1;
+
+        if (last > 0)
+        {
+            for (int i = 0; i < last; i++)
+            {
+                code[i].handler(machine, &code[i].instruction);
+            }
+
+            machine->PC += last * 2;
+        }
+
+        code[last].handler(machine, &code[last].instruction);
+        increment_program_counter(machine, &code[last].instruction);
+
+        count -= length;
+    }
+}
+
+// Throws away any decoded instructions (and translated blocks) overlapping the
+// given range of RAM.
+void invalidate_decode_cache(C8_Machine *machine, int addr, int length)
+{
+    bool blocksHit = false;
+
+    // Writes wrap round the end of RAM, so does this.
+    addr &= C8_MEMORY - 1;
+    if (addr + length > C8_MEMORY)
+    {
+        invalidate_decode_cache(machine, 0, addr + length - C8_MEMORY);
+        length = C8_MEMORY - addr;
+    }
+
+    for (int i = addr >> 1; i <= (addr + length - 1) >> 1 && i < C8_MEMORY / 2; i++)
+    {
+        machine->DecodeCache[i].handler = NULL;
+    }
+
+    for (int i = addr; i < addr + length && i < C8_MEMORY; i++)
+    {
+        blocksHit |= machine->BlockCoverage[i] == machine->BlockGeneration;
+    }
+
+    if (blocksHit)
+    {
+        flush_block_cache(machine);
+    }
+}
+
+// Addresses wrap round the end of RAM, like everywhere else.
+unsigned char read_ram(C8_Machine *machine, int addr)
+{
+    addr &= C8_MEMORY - 1;
+    return (machine->PrivatePages & (1u << (addr / C8_PAGE_SIZE))) ? machine->RAM[addr] : machine->Image[addr];
+}
+
+// Copy on write: the first write to a shared page takes the machine's own copy
+// of it first.
+void write_ram(C8_Machine *machine, int addr, unsigned char value)
+{
+    addr &= C8_MEMORY - 1;
+    int page = addr / C8_PAGE_SIZE;
+
+    if ((machine->PrivatePages & (1u << page)) == 0)
+    {
+        memcpy(&machine->RAM[page * C8_PAGE_SIZE], &machine->Image[page * C8_PAGE_SIZE], C8_PAGE_SIZE);
+        machine->PrivatePages |= 1u << page;
+    }
+
+    machine->RAM[addr] = value;
+}
+
+// Wherever the page currently lives, for reading a whole page at a time.
+const unsigned char *ram_page(C8_Machine *machine, int page)
+{
+    return (machine->PrivatePages & (1u << page)) ? &machine->RAM[page * C8_PAGE_SIZE] : &machine->Image[page * C8_PAGE_SIZE];
+}
+
+// Pages the two machines are still sharing can't be different, so only the
+// rest need comparing.
+bool same_ram(C8_Machine *a, C8_Machine *b)
+{
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        const unsigned char *pageA = ram_page(a, i);
+        const unsigned char *pageB = ram_page(b, i);
+
+        if (pageA != pageB && memcmp(pageA, pageB, C8_PAGE_SIZE) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Swaps the machine's freshly booted RAM for the shared copy of it, making one
+// if this is the first machine to boot this ROM. If there's no memory for one
+// the machine just keeps all of its pages to itself.
+void share_boot_image(C8_Machine *machine)
+{
+    C8_BootImage *image;
+
+    pthread_mutex_lock(&C8_BootImagesLock);
+    for (image = C8_BootImages; image != NULL; image = image->next)
+    {
+        if (image->hash == machine->BootHash && memcmp(image->RAM, machine->RAM, C8_MEMORY) == 0)
+        {
+            break;
+        }
+    }
+
+    if (image == NULL)
+    {
+        image = malloc(sizeof(C8_BootImage));
+        if (image != NULL)
+        {
+            memcpy(image->RAM, machine->RAM, C8_MEMORY);
+            image->hash = machine->BootHash;
+            image->next = C8_BootImages;
+            C8_BootImages = image;
+        }
+    }
+    pthread_mutex_unlock(&C8_BootImagesLock);
+
+    if (image != NULL)
+    {
+        machine->Image = image->RAM;
+        machine->PrivatePages = 0;
+    }
+}
+
+// Both timers count down at 60Hz while they're non-zero.
+void update_timers(C8_Machine *machine)
+{
+    if (machine->DT > 0) 
+    {
+        machine->DT--;
+    }
+
+    if (machine->ST > 0)
+    {
+        machine->ST--;
+    }
+}
+
+// Reads the ROM file in, NULL if there isn't one or it's too big to fit. The
+// data is the caller's to UnloadFileData().
+unsigned char *load_rom(const char *filename, int *size)
+{
+    unsigned char *filedata = LoadFileData(filename, size);
+
+    if (filedata == NULL)
+    {
+        TraceLog(LOG_ERROR, "FILEIO: [%s] Failed to find ROM data", filename);
+    }
+    else if (*size > C8_MAX_ROM_SIZE)
+    {
+        TraceLog(LOG_ERROR, "FILEIO: [%s] ROM is %i bytes, only %i fit in memory", filename, *size, C8_MAX_ROM_SIZE);
+        UnloadFileData(filedata);
+        filedata = NULL;
+    }
+    else
+    {
+        TraceLog(LOG_INFO, "FILEIO: [%s] ROM data loaded %i bytes of data", filename, *size);
+    }
+
+    return filedata;
+}
+
+// Most Chip-8 programs start at location 0x200 (512), and everything from there
+// to the end of RAM is theirs. Anything bigger has already been turned away.
+void copy_rom_image(C8_Machine *machine, const unsigned char *data, int size)
+{
+    if (data == NULL || size <= 0)
+    {
+        return;
+    }
+
+    memcpy(&machine->RAM[C8_START], data, size < C8_MAX_ROM_SIZE ? size : C8_MAX_ROM_SIZE);
+    invalidate_decode_cache(machine, 0, C8_MEMORY);
+}
+
+void initialize_renderer()
+{
+    Image image = 
+    {
+        .data = C8_ScreenPixels,
+        .width = C8_WIDTH,
+        .height = C8_HEIGHT,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE
+    };
+
+    C8_ScreenTexture = LoadTextureFromImage(image);
+    SetTextureFilter(C8_ScreenTexture, TEXTURE_FILTER_POINT);
+
+    image.data = C8_HiresPixels;
+    image.width = C8_HIRES_WIDTH;
+    image.height = C8_HIRES_HEIGHT;
+    C8_HiresTexture = LoadTextureFromImage(image);
+    SetTextureFilter(C8_HiresTexture, TEXTURE_FILTER_POINT);
+
+    C8_KeypadTexture = LoadRenderTexture(C8_KEYPAD_SIZE, C8_KEYPAD_SIZE);
+    C8_KeypadChanged = true;
+
+    C8_HudTexture = LoadRenderTexture(C8_HUD_WIDTH, C8_HUD_HEIGHT);
+    C8_HudChanged = true;
+}
+
+// Draws the frame, if there is one (NULL means the screen hasn't changed). Only
+// the frame's dirty rows (which cover any frames that were skipped) can be any
+// different to what's in the texture, and of those only the ones that really
+// are get redrawn, a sprite drawn and then undrawn costs nothing. Each mode has
+// its own texture, so switching between them only has to redraw whatever
+// changed since that one was last on screen, which could be any row.
+void render_buffer(C8_Frame *frame, int originX, int originY)
+{
+    bool modeChanged = frame != NULL && frame->HighRes != C8_ScreenHighRes;
+    if (modeChanged)
+    {
+        C8_ScreenHighRes = frame->HighRes;
+    }
+
+    bool highRes = C8_ScreenHighRes;
+    int width = highRes ? C8_HIRES_WIDTH : C8_WIDTH;
+    int height = highRes ? C8_HIRES_HEIGHT : C8_HEIGHT;
+    Texture2D texture = highRes ? C8_HiresTexture : C8_ScreenTexture;
+    unsigned char *screenPixels = highRes ? C8_HiresPixels : C8_ScreenPixels;
+
+    // Work out which rows are different to what's in the texture. The dirty
+    // rows are pairs of rows in the 128x64 mode.
+    uint32_t candidates = frame == NULL ? 0 : modeChanged ? 0xFFFFFFFF : frame->DirtyRows;
+    uint64_t dirtyRows = 0;
+    for (int i = 0; candidates != 0 && i < height; i++)
+    {
+        if (((candidates >> (highRes ? i >> 1 : i)) & 1) == 0)
+        {
+            continue;
+        }
+
+        const uint64_t *row = highRes ? frame->HiresBuffer[i] : &frame->Buffer[i];
+        const uint64_t *shown = highRes ? C8_HiresRows[i] : &C8_ScreenRows[i];
+        dirtyRows |= (uint64_t)(row[0] != shown[0] || (highRes && row[1] != shown[1])) << i;
+    }
+
+    // The profiler overlay changes with every frame, even when the screen doesn't.
+    bool overlayChanged = false;
+#if C8_DEBUG_MODE
+    if (frame != NULL)
+    {
+        C8_ShownFrame = frame;
+        overlayChanged = true;
+    }
+#endif
+
+    // Nothing has changed since the last frame, so what's on screen is still
+    // correct. Skip drawing altogether, but still poll for input (which would
+    // normally happen in EndDrawing) so that the keyboard and window still work.
+    if (dirtyRows == 0 && !modeChanged && !C8_KeypadChanged && !C8_HudChanged && !overlayChanged)
+    {
+        PollInputEvents();
+        return;
+    }
+
+    if (C8_KeypadChanged)
+    {
+        draw_keypad(C8_KeypadKeys);
+        C8_KeypadChanged = false;
+    }
+
+    if (C8_HudChanged)
+    {
+        draw_hud(&C8_HudStats);
+        C8_HudChanged = false;
+    }
+
+    // Expand only the rows that have changed into the texture's pixels, and
+    // upload just the band of rows between the first and last changed one.
+    int firstRow = height;
+    int lastRow = -1;
+
+    for (int i = 0; i < height; i++)
+    {
+        if ((dirtyRows & (1ull << i)) == 0)
+        {
+            continue;
+        }
+
+        const uint64_t *row = highRes ? frame->HiresBuffer[i] : &frame->Buffer[i];
+        unsigned char *pixels = &screenPixels[i * width];
+        if (highRes)
+        {
+            C8_HiresRows[i][0] = row[0];
+            C8_HiresRows[i][1] = row[1];
+        }
+        else
+        {
+            C8_ScreenRows[i] = row[0];
+        }
+
+        for (int j = 0; j < width; j++)
+        {
+            pixels[j] = ((row[j / 64] >> (63 - (j % 64))) & 1) ? 255 : 0;
+        }
+
+        if (i < firstRow)
+        {
+            firstRow = i;
+        }
+        lastRow = i;
+    }
+
+    if (lastRow >= 0)
+    {
+        Rectangle rows = { 0, firstRow, width, (lastRow - firstRow) + 1 };
+        UpdateTextureRec(texture, rows, &screenPixels[firstRow * width]);
+    }
+
+    BeginDrawing();
+
+    ClearBackground(RAYWHITE);
+
+    // Frame
+    {
+        int frameOriginX = originX - C8_PIXEL_WIDTH;
+        int frameOriginY = originY - C8_PIXEL_WIDTH;
+        int frameWidth = (C8_WIDTH * C8_PIXEL_WIDTH) + (C8_PIXEL_WIDTH * 2);
+        int frameHeight = (C8_HEIGHT * C8_PIXEL_HEIGHT) + (C8_PIXEL_WIDTH * 2);
+        DrawRectangle(frameOriginX, frameOriginY, frameWidth, frameHeight, DARKGRAY);
+    }    
+
+    // Screen
+    {
+        Rectangle source = { 0, 0, width, height };
+        Rectangle dest = { originX, originY, C8_WIDTH * C8_PIXEL_WIDTH, C8_HEIGHT * C8_PIXEL_HEIGHT };
+        Vector2 origin = { 0, 0 };
+
+        // White pixels tinted green come out green, black ones stay black.
+        // The 128x64 texture goes in the same space, at half the pixel size.
+        DrawTexturePro(texture, source, dest, origin, 0.0f, GREEN);
+    }
+
+    // Keypad (render textures are upside down, hence the negative height)
+    {
+        Rectangle source = { 0, 0, C8_KEYPAD_SIZE, -C8_KEYPAD_SIZE };
+        Vector2 position = { C8_KEYPAD_X, C8_KEYPAD_Y };
+        DrawTextureRec(C8_KeypadTexture.texture, source, position, WHITE);
+    }
+
+    // HUD (the same)
+    {
+        Rectangle source = { 0, 0, C8_HUD_WIDTH, -C8_HUD_HEIGHT };
+        Vector2 position = { C8_HUD_X, C8_HUD_Y };
+        DrawTextureRec(C8_HudTexture.texture, source, position, WHITE);
+    }
+
+#if C8_DEBUG_MODE
+    if (C8_ShownFrame != NULL)
+    {
+        draw_profile_overlay(C8_ShownFrame, originX, originY);
+    }
+#endif
+
+    EndDrawing();
+}
+
+// Fills in C8_KeyMap, C8_KeyLookup and the labels from the 16 characters of a
+// --keymap (already checked to be letters or digits), whose raylib key codes
+// are the same as their upper case ASCII. If a key is in there twice, the
+// last one wins.
+void set_key_map(const char *keys)
+{
+    memset(C8_KeyLookup, -1, sizeof(C8_KeyLookup));
+
+    for (int i = 0; i < 16; i++)
+    {
+        int key = keys[i] >= 'a' && keys[i] <= 'z' ? keys[i] - 'a' + 'A' : keys[i];
+        C8_KeyMap[i] = key;
+        C8_KeyLookup[key] = i;
+        C8_KeyLabels[i][0] = key;
+        C8_KeyLabels[i][1] = '\0';
+    }
+
+    C8_KeypadChanged = true;
+}
+
+// Updates the keypad, one bit per key, for the CPU thread to pick up. Called
+// once a frame. Presses come off raylib's queue of keys that went down this
+// frame, and only the keys that were already held need checking for release,
+// rather than asking about all 16 every time. A key pressed this frame stays
+// down for it even if it has already been let go, and the presses go to the
+// CPU thread on their own as well, so a quick tap is never lost.
+unsigned short read_input(unsigned short *presses)
+{
+    unsigned short keys = C8_KeypadKeys;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (((keys >> i) & 1) && !IsKeyDown(C8_KeyMap[i]))
+        {
+            keys &= ~(1u << i);
+        }
+    }
+
+    *presses = 0;
+    for (int key = GetKeyPressed(); key != 0; key = GetKeyPressed())
+    {
+        if (key > 0 && key < C8_HOST_KEYS && C8_KeyLookup[key] >= 0)
+        {
+            *presses |= 1u << C8_KeyLookup[key];
+        }
+    }
+    keys |= *presses;
+
+    if (keys != C8_KeypadKeys)
+    {
+        C8_KeypadKeys = keys;
+        C8_KeypadChanged = true;
+    }
+
+    return keys;
+}
+
+// Only the profiles with SUPER-CHIP get the big font, so nothing else boots any
+// differently.
+void load_hexfont_sprites(C8_Machine *machine)
+{
+    int size = machine->Quirks->superChip ? C8_START : C8_BIG_FONT_ADDR;
+    memcpy(machine->RAM, C8_InterpreterArea, size);
+}
+
+//----------------------------------------------------------------------------------
+// Profiler
+//----------------------------------------------------------------------------------
+#if C8_DEBUG_MODE
+
+// The time stamp counter where there is one (cheap enough to read around every
+// instruction), nanoseconds everywhere else.
+unsigned long long read_profile_clock()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#endif
+}
+
+// The table core again, but counting and timing every instruction. This is
+// what run_cycles() uses whatever C8_DISPATCH says when the profiler is built
+// in, so the other cores don't pay for it.
+void run_cycles_profiled(C8_Machine *machine, int count)
+{
+    C8_DecodedInstruction scratch = {0};
+    C8_Profile *profile = &machine->Profile;
+
+    for (int i = 0; i < count; i++)
+    {
+        int pc = machine->PC & (C8_MEMORY - 1);
+        C8_DecodedInstruction *decoded = fetch_instruction(machine, &scratch);
+        int op = decoded->op;
+
+        unsigned long long start = read_profile_clock();
+        decoded->handler(machine, &decoded->instruction);
+        increment_program_counter(machine, &decoded->instruction);
+        unsigned long long ticks = read_profile_clock() - start;
+
+        profile->OpCount[op]++;
+        profile->OpTicks[op] += ticks;
+        profile->PCCount[pc]++;
+    }
+}
+
+// Adds one machine's counts onto another's, for the runs with more than one.
+void merge_profile(C8_Profile *into, C8_Profile *from)
+{
+    for (int i = 0; i < C8_OP_COUNT; i++)
+    {
+        into->OpCount[i] += from->OpCount[i];
+        into->OpTicks[i] += from->OpTicks[i];
+    }
+
+    for (int i = 0; i < C8_MEMORY; i++)
+    {
+        into->PCCount[i] += from->PCCount[i];
+    }
+
+    into->IdleCycles += from->IdleCycles;
+}
+
+// Writes the report as CSV: every instruction that ran, most time first, then
+// the C8_PROFILE_HOT_PCS addresses that ran the most, with the opcode that is
+// there now (it may have been something else at the time, if the ROM rewrites
+// itself).
+bool save_profile(C8_Profile *profile, C8_Machine *machine, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        TraceLog(LOG_WARNING, "PROFILE: [%s] Failed to save profile", filename);
+        return false;
+    }
+
+    int order[C8_OP_COUNT];
+    unsigned long long totalTicks = 0;
+    unsigned long long totalCount = 0;
+
+    for (int i = 0; i < C8_OP_COUNT; i++)
+    {
+        int j = i;
+        while (j > 0 && profile->OpTicks[order[j - 1]] < profile->OpTicks[i])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+
+        totalTicks += profile->OpTicks[i];
+        totalCount += profile->OpCount[i];
+    }
+
+    fprintf(file, "op,count,ticks,ticks_per_op,share\n");
+    for (int i = 0; i < C8_OP_COUNT; i++)
+    {
+        int op = order[i];
+        if (profile->OpCount[op] == 0)
+        {
+            continue;
+        }
+
+        fprintf(file, "%s,%llu,%llu,%.1f,%.2f%%\n",
+            instruction_names[op],
+            profile->OpCount[op],
+            profile->OpTicks[op],
+            (double)profile->OpTicks[op] / profile->OpCount[op],
+            totalTicks > 0 ? (100.0 * profile->OpTicks[op]) / totalTicks : 0.0);
+    }
+    fprintf(file, "idle,%llu,,,\n", profile->IdleCycles);
+
+    // Picking the busiest address out of what's left each time round is plenty
+    // quick enough for a few dozen of them.
+    bool listed[C8_MEMORY] = { false };
+
+    fprintf(file, "\npc,count,opcode,share\n");
+    for (int i = 0; i < C8_PROFILE_HOT_PCS; i++)
+    {
+        int hottest = -1;
+        for (int pc = 0; pc < C8_MEMORY; pc++)
+        {
+            if (!listed[pc] && profile->PCCount[pc] > 0 && (hottest < 0 || profile->PCCount[pc] > profile->PCCount[hottest]))
+            {
+                hottest = pc;
+            }
+        }
+
+        if (hottest < 0)
+        {
+            break;
+        }
+
+        listed[hottest] = true;
+        fprintf(file, "0x%03X,%llu,%04X,%.2f%%\n",
+            hottest,
+            profile->PCCount[hottest],
+            peek_opcode(machine, hottest),
+            totalCount > 0 ? (100.0 * profile->PCCount[hottest]) / totalCount : 0.0);
+    }
+
+    fclose(file);
+    TraceLog(LOG_INFO, "PROFILE: [%s] Saved profile of %llu instructions", filename, totalCount);
+
+    return true;
+}
+
+// The top few instructions by time so far, drawn over the corner of the screen.
+void draw_profile_overlay(C8_Frame *frame, int originX, int originY)
+{
+    bool shown[C8_OP_COUNT] = { false };
+    unsigned long long totalTicks = 0;
+
+    for (int i = 0; i < C8_OP_COUNT; i++)
+    {
+        totalTicks += frame->OpTicks[i];
+    }
+
+    DrawRectangle(originX, originY, 170, 16 + (C8_PROFILE_OVERLAY_OPS * 12), Fade(BLACK, 0.6f));
+    DrawText("time per instruction", originX + 4, originY + 4, 10, WHITE);
+
+    for (int i = 0; i < C8_PROFILE_OVERLAY_OPS && totalTicks > 0; i++)
+    {
+        int top = -1;
+        for (int op = 0; op < C8_OP_COUNT; op++)
+        {
+            if (!shown[op] && frame->OpCount[op] > 0 && (top < 0 || frame->OpTicks[op] > frame->OpTicks[top]))
+            {
+                top = op;
+            }
+        }
+
+        if (top < 0)
+        {
+            break;
+        }
+
+        shown[top] = true;
+        int y = originY + 16 + (i * 12);
+        DrawText(instruction_names[top], originX + 4, y, 10, GREEN);
+        DrawText(TextFormat("%5.1f%%", (100.0 * frame->OpTicks[top]) / totalTicks), originX + 130, y, 10, GREEN);
+    }
+}
+
+#endif
+
+//----------------------------------------------------------------------------------
+// CPU Thread
+//----------------------------------------------------------------------------------
+
+// Hands the back frame over and takes the spare one to draw the next into. If
+// the render thread hasn't taken the one this replaces, it will never see it,
+// so its dirty rows go along with this one. (It may still take it before the
+// swap, then this frame just has a few more rows to look at than it needs.)
+void publish_frame(C8_FrameExchange *exchange)
+{
+    unsigned int middle = atomic_load_explicit(&exchange->middle, memory_order_relaxed);
+    if ((middle & C8_FRAME_FRESH) != 0)
+    {
+        exchange->frames[exchange->back].DirtyRows |= exchange->frames[middle & ~C8_FRAME_FRESH].DirtyRows;
+    }
+
+    unsigned int spare = atomic_exchange_explicit(&exchange->middle, exchange->back | C8_FRAME_FRESH, memory_order_acq_rel);
+    exchange->back = spare & ~C8_FRAME_FRESH;
+}
+
+// The newest frame, or NULL if there hasn't been one since last time. Frames
+// the CPU thread published in between are just never seen.
+C8_Frame *take_frame(C8_FrameExchange *exchange)
+{
+    if ((atomic_load_explicit(&exchange->middle, memory_order_relaxed) & C8_FRAME_FRESH) == 0)
+    {
+        return NULL;
+    }
+
+    unsigned int fresh = atomic_exchange_explicit(&exchange->middle, exchange->front, memory_order_acq_rel);
+    exchange->front = fresh & ~C8_FRAME_FRESH;
+
+    return &exchange->frames[exchange->front];
+}
+
+// What the window's main loop used to do, on its own thread: work out how many
+// cycles are owed since the last time round and run them, tick the timers at
+// 60Hz (or step back a frame when rewinding), and publish a frame whenever the
+// display changes or the timers tick. Everything that touches the machine,
+// snapshots and the input log included, happens here.
+void *run_emulator(void *data)
+{
+    C8_Emulator *emulator = data;
+    C8_Machine *machine = emulator->machine;
+    const double cycleTime = 1.0 / C8_CLOCK_SPEED;
+    const double timerTime = 1.0 / C8_TIMER_SPEED;
+
+    double lastCycleTime = get_host_time();
+    double lastTimerTime = lastCycleTime;
+    double cycleAccumulator = 0.0;
+
+    // The CPU thread's half of the HUD, worked out every C8_METRICS_INTERVAL
+    // and sent along with every frame. The render thread adds its own timings.
+    C8_Stats stats = { 0, -1.0, C8_CLOCK_SPEED, -1.0, -1.0, 0, -1.0, -1.0 };
+    double statsStart = lastCycleTime;
+    long long statsCycles = 0;
+    double statsDispatch = 0.0;
+    double statsJitter = 0.0;
+
+    while (atomic_load_explicit(&emulator->running, memory_order_relaxed))
+    {
+        double time = get_host_time();
+        bool ticked = false;
+
+        // Every press since last time goes down here, even if the key is up
+        // again by now (then it comes up next time round). One the machine
+        // already has down was let go and pressed again in between, so it goes
+        // up first. Either way Fx0A sees it, and so does the input log.
+        unsigned short keys = atomic_load_explicit(&emulator->keys, memory_order_acquire);
+        unsigned short presses = atomic_exchange_explicit(&emulator->presses, 0, memory_order_relaxed);
+        if ((presses & get_key_mask(machine)) != 0)
+        {
+            set_key_mask(machine, get_key_mask(machine) & ~presses);
+            if (emulator->inputLog != NULL)
+            {
+                record_input(emulator->inputLog, machine);
+            }
+        }
+
+        set_key_mask(machine, keys | presses);
+        if (emulator->inputLog != NULL)
+        {
+            record_input(emulator->inputLog, machine);
+        }
+
+        int requests = atomic_exchange_explicit(&emulator->requests, 0, memory_order_relaxed);
+        if ((requests & C8_REQUEST_SAVE) != 0)
+        {
+            save_snapshot_file(machine, emulator->statePath);
+        }
+
+        if ((requests & C8_REQUEST_LOAD) != 0)
+        {
+            load_snapshot_file(machine, emulator->statePath);
+        }
+
+        // While rewinding the CPU is paused and every timer tick steps back a
+        // frame instead.
+        bool rewinding = atomic_load_explicit(&emulator->rewinding, memory_order_relaxed);
+
+        // Work out how many cycles we owe since the last time round the loop and
+        // run them all in one go. That way the clock speed doesn't depend on how
+        // fast the loop spins. If we fall too far behind (debugger paused...)
+        // only catch up so much and drop the rest, otherwise we'd get a burst of
+        // thousands of cycles at once.
+        cycleAccumulator += time - lastCycleTime;
+        lastCycleTime = time;
+
+        int owedCycles = (int)(cycleAccumulator / cycleTime);
+        if (owedCycles > C8_MAX_CATCHUP_CYCLES)
+        {
+            stats.droppedCycles += owedCycles - C8_MAX_CATCHUP_CYCLES;
+            owedCycles = C8_MAX_CATCHUP_CYCLES;
+            cycleAccumulator = owedCycles * cycleTime;
+        }
+
+        if (owedCycles > 0)
+        {
+            cycleAccumulator -= owedCycles * cycleTime;
+
+            if (!rewinding)
+            {
+                double dispatchStart = get_host_time();
+                run_cycles(machine, owedCycles);
+                statsDispatch += get_host_time() - dispatchStart;
+                statsCycles += owedCycles;
+                stats.cycles += owedCycles;
+            }
+        }
+
+        // The ticks keep to their own schedule, each one is due a timerTime
+        // after the last one was due (not after it actually ran), so a late
+        // tick doesn't make every one after it late too. One goes per time round
+        // the loop, and like the cycles, if we fall too far behind the ticks
+        // that were missed are dropped rather than all run at once.
+        if (time - lastTimerTime >= timerTime)
+        {
+            // How late this tick is (they're only ever late, never early).
+            if (time - lastTimerTime - timerTime > statsJitter)
+            {
+                statsJitter = time - lastTimerTime - timerTime;
+            }
+
+            lastTimerTime += timerTime;
+            if (time - lastTimerTime >= C8_MAX_CATCHUP_TICKS * timerTime)
+            {
+                lastTimerTime = time;
+            }
+            ticked = true;
+
+            if (rewinding)
+            {
+                rewind_frame(machine);
+            }
+            else
+            {
+                update_timers(machine);
+                record_rewind_frame(machine);
+
+                if (emulator->inputLog != NULL)
+                {
+                    record_timer_tick(emulator->inputLog, machine);
+                }
+            }
+
+            if (emulator->capture != NULL)
+            {
+                capture_frame(emulator->capture, machine);
+            }
+        }
+
+        if (time - statsStart >= C8_METRICS_INTERVAL)
+        {
+            stats.ips = statsCycles / (time - statsStart);
+            stats.timerJitter = statsJitter * 1000.0;
+            stats.dispatchTime = (statsDispatch * 1000.0) / (time - statsStart);
+            statsStart = time;
+            statsCycles = 0;
+            statsDispatch = 0.0;
+            statsJitter = 0.0;
+        }
+
+        // The beeper picks this up on the audio thread, there's nothing else to
+        // do for it here. It's quiet while rewinding.
+        atomic_store_explicit(&C8_BeeperOn, machine->ST > 0 && !rewinding, memory_order_relaxed);
+
+        if (machine->DisplayChanged || ticked)
+        {
+            C8_Frame *frame = &emulator->exchange.frames[emulator->exchange.back];
+            memcpy(frame->Buffer, machine->Buffer, sizeof(frame->Buffer));
+            if (machine->HighRes)
+            {
+                memcpy(frame->HiresBuffer, machine->HiresBuffer, sizeof(frame->HiresBuffer));
+            }
+            frame->HighRes = machine->HighRes;
+            frame->DirtyRows = machine->DirtyRows;
+            frame->Stats = stats;
+#if C8_DEBUG_MODE
+            memcpy(frame->OpCount, machine->Profile.OpCount, sizeof(frame->OpCount));
+            memcpy(frame->OpTicks, machine->Profile.OpTicks, sizeof(frame->OpTicks));
+#endif
+            publish_frame(&emulator->exchange);
+
+            if (emulator->stream != NULL)
+            {
+                stream_frame(emulator->stream, 0, machine, time);
+            }
+
+            machine->DirtyRows = 0;
+            machine->DisplayChanged = false;
+        }
+
+        // Nothing can happen before the next cycle or tick is due, or, when the
+        // ROM is only waiting on the timers or the keypad, before the next tick.
+        int idleReg;
+        double nextTick = lastTimerTime + timerTime;
+        double wake = lastCycleTime + cycleTime - cycleAccumulator;
+        if (wake > nextTick || (!rewinding && find_idle_loop(machine, &idleReg) != 0))
+        {
+            wake = nextTick;
+        }
+
+        double now = get_host_time();
+        if (wake > now)
+        {
+            sleep_host(wake - now);
+        }
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------
+// Beeper
+//----------------------------------------------------------------------------------
+
+// Opens the stream and leaves it running until exit, silent while the flag is
+// clear. Without an audio device there just isn't any sound.
+void start_beeper()
+{
+    if (!IsAudioDeviceReady())
+    {
+        return;
+    }
+
+    SetAudioStreamBufferSizeDefault(C8_AUDIO_BUFFER_FRAMES);
+    C8_BeeperStream = LoadAudioStream(C8_AUDIO_SAMPLE_RATE, 16, 1);
+    SetAudioStreamCallback(C8_BeeperStream, generate_beeper_samples);
+    PlayAudioStream(C8_BeeperStream);
+    C8_BeeperStarted = true;
+}
+
+void stop_beeper()
+{
+    if (C8_BeeperStarted)
+    {
+        UnloadAudioStream(C8_BeeperStream);
+        C8_BeeperStarted = false;
+    }
+}
+
+// raylib's callback, on the audio thread, for the next frames samples. The
+// flag is looked at for every sample, so a beep starts and stops on the sample
+// it's seen on and always from the start of the pattern.
+void generate_beeper_samples(void *buffer, unsigned int frames)
+{
+    short *samples = buffer;
+    uint64_t pattern[2] =
+    {
+        atomic_load_explicit(&C8_BeeperPattern[0], memory_order_relaxed),
+        atomic_load_explicit(&C8_BeeperPattern[1], memory_order_relaxed)
+    };
+    double step = (double)atomic_load_explicit(&C8_BeeperRate, memory_order_relaxed) / C8_AUDIO_SAMPLE_RATE;
+    double position = C8_BeeperPosition;
+
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        if (!atomic_load_explicit(&C8_BeeperOn, memory_order_relaxed))
+        {
+            samples[i] = 0;
+            position = 0.0;
+            continue;
+        }
+
+        int bit = (int)position;
+        samples[i] = ((pattern[bit / 64] >> (63 - (bit % 64))) & 1) ? C8_BEEPER_AMPLITUDE : -C8_BEEPER_AMPLITUDE;
+
+        position += step;
+        if (position >= 128.0)
+        {
+            position -= 128.0;
+        }
+    }
+
+    C8_BeeperPosition = position;
+}
+
+//----------------------------------------------------------------------------------
+// Framebuffer Streaming
+//----------------------------------------------------------------------------------
+
+// Opens a UDP socket to send sessions' displays to host:port. Sends never block,
+// if the socket can't take a frame right now it's just not sent (and the next
+// one carries the difference instead).
+bool open_stream(C8_Stream *stream, const char *target, int sessionCount)
+{
+    memset(stream, 0, sizeof(C8_Stream));
+    stream->socket = -1;
+
+#if defined(_WIN32)
+    TraceLog(LOG_ERROR, "STREAM: [%s] Streaming isn't supported on Windows", target);
+    return false;
+#else
+    char host[256];
+    const char *port = strrchr(target, ':');
+    if (port == NULL || port == target || (size_t)(port - target) >= sizeof(host))
+    {
+        TraceLog(LOG_ERROR, "STREAM: [%s] Expected host:port", target);
+        return false;
+    }
+    memcpy(host, target, port - target);
+    host[port - target] = '\0';
+
+    struct addrinfo hints = { 0 };
+    struct addrinfo *result = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(host, port + 1, &hints, &result) != 0 || result == NULL)
+    {
+        TraceLog(LOG_ERROR, "STREAM: [%s] Failed to find host", target);
+        return false;
+    }
+
+    stream->socket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (stream->socket >= 0)
+    {
+        fcntl(stream->socket, F_SETFL, fcntl(stream->socket, F_GETFL) | O_NONBLOCK);
+        memcpy(&stream->address, result->ai_addr, result->ai_addrlen);
+        stream->addressLength = result->ai_addrlen;
+    }
+    freeaddrinfo(result);
+
+    stream->sessions = calloc(sessionCount, sizeof(C8_StreamSession));
+    stream->sessionCount = sessionCount;
+
+    if (stream->socket < 0 || stream->sessions == NULL)
+    {
+        TraceLog(LOG_ERROR, "STREAM: [%s] Failed to open socket", target);
+        close_stream(stream);
+        return false;
+    }
+
+    TraceLog(LOG_INFO, "STREAM: [%s] Streaming %i session(s)", target, sessionCount);
+    return true;
+#endif
+}
+
+void close_stream(C8_Stream *stream)
+{
+#if !defined(_WIN32)
+    if (stream->socket >= 0)
+    {
+        close(stream->socket);
+    }
+#endif
+
+    free(stream->sessions);
+    memset(stream, 0, sizeof(C8_Stream));
+    stream->socket = -1;
+}
+
+// Sends the rows that have changed since the last frame the viewer was sent,
+// XORed against it and run-length encoded, at most C8_STREAM_FPS times a second
+// per session. A display that hasn't changed costs nothing apart from the
+// keyframe (every row, so a viewer that joins late or lost a packet can catch
+// up) every C8_STREAM_KEYFRAME_SECONDS. The stream is always 64x32, in the
+// 128x64 mode it's each 2x2 square of pixels ORed together.
+void stream_frame(C8_Stream *stream, int session, C8_Machine *machine, double now)
+{
+#if !defined(_WIN32)
+    C8_StreamSession *state = &stream->sessions[session];
+    state->dirty |= machine->DirtyRows;
+
+    if (now - state->lastSent < 1.0 / C8_STREAM_FPS)
+    {
+        return;
+    }
+
+    const uint64_t *buffer = machine->Buffer;
+    uint64_t halved[C8_HEIGHT];
+    if (machine->HighRes)
+    {
+        for (int i = 0; i < C8_HEIGHT; i++)
+        {
+            const uint64_t *top = machine->HiresBuffer[i * 2];
+            const uint64_t *bottom = machine->HiresBuffer[(i * 2) + 1];
+            halved[i] = ((uint64_t)halve_pixels(top[0] | bottom[0]) << 32) | halve_pixels(top[1] | bottom[1]);
+        }
+        buffer = halved;
+    }
+
+    bool keyframe = state->sequence == 0 || now - state->lastKeyframe >= C8_STREAM_KEYFRAME_SECONDS;
+    unsigned char rows[C8_HEIGHT * 8];
+    uint32_t mask = 0;
+    int length = 0;
+
+    for (int i = 0; i < C8_HEIGHT; i++)
+    {
+        if (!keyframe && ((state->dirty >> i) & 1) == 0)
+        {
+            continue;
+        }
+
+        uint64_t row = keyframe ? buffer[i] : buffer[i] ^ state->sent[i];
+
+        if (keyframe || row != 0)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                rows[length++] = row >> (56 - (j * 8));
+            }
+            mask |= 1u << i;
+        }
+    }
+
+    // Whatever was drawn, it's back to what the viewer already has.
+    if (mask == 0)
+    {
+        state->dirty = 0;
+        return;
+    }
+
+    unsigned char packet[C8_STREAM_MAX_PACKET];
+    memset(packet, 0, C8_STREAM_HEADER_SIZE);
+    memcpy(packet, C8_STREAM_MAGIC, 4);
+    packet[4] = keyframe ? C8_STREAM_KEYFRAME : 0;
+    packet[6] = session & 0xFF;
+    packet[7] = session >> 8;
+    for (int i = 0; i < 4; i++)
+    {
+        packet[8 + i] = state->sequence >> (i * 8);
+        packet[12 + i] = mask >> (i * 8);
+    }
+
+    int size = rle_encode(rows, length, &packet[C8_STREAM_HEADER_SIZE], C8_STREAM_MAX_PACKET - C8_STREAM_HEADER_SIZE);
+    if (size < 0)
+    {
+        return;
+    }
+
+    // Only once it has actually gone does the viewer have this frame.
+    ssize_t sent = sendto(stream->socket, packet, C8_STREAM_HEADER_SIZE + size, 0, (struct sockaddr *)&stream->address, stream->addressLength);
+    if (sent == C8_STREAM_HEADER_SIZE + size)
+    {
+        memcpy(state->sent, buffer, sizeof(state->sent));
+        state->dirty = 0;
+        state->sequence++;
+        state->lastSent = now;
+        if (keyframe)
+        {
+            state->lastKeyframe = now;
+        }
+    }
+#endif
+}
+
+// ORs each pair of pixels (bits 2n and 2n + 1) in a word of the 128x64 display
+// together, squeezing them down into one word of 32, still in order.
+uint32_t halve_pixels(uint64_t pixels)
+{
+    pixels = (pixels | (pixels >> 1)) & 0x5555555555555555ULL;
+    pixels = (pixels | (pixels >> 1)) & 0x3333333333333333ULL;
+    pixels = (pixels | (pixels >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    pixels = (pixels | (pixels >> 4)) & 0x00FF00FF00FF00FFULL;
+    pixels = (pixels | (pixels >> 8)) & 0x0000FFFF0000FFFFULL;
+    pixels = (pixels | (pixels >> 16)) & 0x00000000FFFFFFFFULL;
+
+    return (uint32_t)pixels;
+}
+
+// Listens on the port for streamed sessions and shows every one it has heard
+// from in a grid, in the order they turned up. A session that misses a packet
+// keeps its last frame until the next keyframe puts it right.
+int run_viewer(C8_Options *options)
+{
+#if defined(_WIN32)
+    TraceLog(LOG_ERROR, "STREAM: Viewing isn't supported on Windows");
+    return 1;
+#else
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short)atoi(options->view));
+
+    int listener = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        TraceLog(LOG_ERROR, "STREAM: [%s] Failed to listen on port", options->view);
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return 1;
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    C8_ViewSession *sessions = calloc(C8_VIEW_SESSIONS, sizeof(C8_ViewSession));
+    unsigned char *pixels = calloc(C8_VIEW_GRID * C8_WIDTH * C8_VIEW_GRID * C8_HEIGHT, 1);
+    int order[C8_VIEW_SESSIONS];
+    int seen = 0;
+
+    InitWindow(785, 360, "raychip-8 viewer");
+    SetTargetFPS(C8_STREAM_FPS);
+
+    Image image = 
+    {
+        .data = pixels,
+        .width = C8_VIEW_GRID * C8_WIDTH,
+        .height = C8_VIEW_GRID * C8_HEIGHT,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE
+    };
+    Texture2D texture = LoadTextureFromImage(image);
+    SetTextureFilter(texture, TEXTURE_FILTER_POINT);
+
+    while (!WindowShouldClose())
+    {
+        unsigned char packet[C8_STREAM_MAX_PACKET];
+        unsigned char rows[C8_HEIGHT * 8];
+        ssize_t size;
+
+        while ((size = recv(listener, packet, sizeof(packet), 0)) >= C8_STREAM_HEADER_SIZE)
+        {
+            if (memcmp(packet, C8_STREAM_MAGIC, 4) != 0)
+            {
+                continue;
+            }
+
+            int id = packet[6] | (packet[7] << 8);
+            bool keyframe = (packet[4] & C8_STREAM_KEYFRAME) != 0;
+            uint32_t sequence = 0;
+            uint32_t mask = 0;
+            int rowCount = 0;
+
+            for (int i = 0; i < 4; i++)
+            {
+                sequence |= (uint32_t)packet[8 + i] << (i * 8);
+                mask |= (uint32_t)packet[12 + i] << (i * 8);
+            }
+            for (int i = 0; i < C8_HEIGHT; i++)
+            {
+                rowCount += (mask >> i) & 1;
+            }
+
+            if (id >= C8_VIEW_SESSIONS ||
+                rle_decode(&packet[C8_STREAM_HEADER_SIZE], (int)size - C8_STREAM_HEADER_SIZE, rows, sizeof(rows)) != rowCount * 8)
+            {
+                continue;
+            }
+
+            // A delta only makes sense on top of the frame right before it.
+            C8_ViewSession *session = &sessions[id];
+            if (!keyframe && (!session->synced || sequence != session->sequence + 1))
+            {
+                session->synced = false;
+                continue;
+            }
+
+            for (int i = 0, j = 0; i < C8_HEIGHT; i++)
+            {
+                if ((mask & (1u << i)) == 0)
+                {
+                    continue;
+                }
+
+                uint64_t row = 0;
+                for (int k = 0; k < 8; k++)
+                {
+                    row = (row << 8) | rows[(j * 8) + k];
+                }
+                session->Buffer[i] = keyframe ? row : session->Buffer[i] ^ row;
+                j++;
+            }
+
+            if (!session->active)
+            {
+                session->active = true;
+                order[seen++] = id;
+            }
+            session->synced = true;
+            session->sequence = sequence;
+        }
+
+        // As square a grid as will fit everything seen so far.
+        int columns = 1;
+        while (columns * columns < seen)
+        {
+            columns++;
+        }
+        int gridRows = seen > 0 ? (seen + columns - 1) / columns : 1;
+
+        for (int n = 0; n < seen; n++)
+        {
+            C8_ViewSession *session = &sessions[order[n]];
+            int originX = (n % columns) * C8_WIDTH;
+            int originY = (n / columns) * C8_HEIGHT;
+
+            for (int i = 0; i < C8_HEIGHT; i++)
+            {
+                unsigned char *row = &pixels[((originY + i) * C8_VIEW_GRID * C8_WIDTH) + originX];
+                for (int j = 0; j < C8_WIDTH; j++)
+                {
+                    row[j] = ((session->Buffer[i] >> (C8_WIDTH - 1 - j)) & 1) ? 255 : 0;
+                }
+            }
+        }
+        UpdateTexture(texture, pixels);
+
+        // Scale the used part of the grid up to fill the window, keeping it
+        // the right shape.
+        float width = (float)(columns * C8_WIDTH);
+        float height = (float)(gridRows * C8_HEIGHT);
+        float scale = (GetScreenWidth() - 20) / width;
+        if ((GetScreenHeight() - 40) / height < scale)
+        {
+            scale = (GetScreenHeight() - 40) / height;
+        }
+
+        Rectangle source = { 0, 0, width, height };
+        Rectangle dest = { 10, 30, width * scale, height * scale };
+        Vector2 origin = { 0, 0 };
+
+        BeginDrawing();
+        ClearBackground(DARKGRAY);
+        DrawText(TextFormat("port %s, %i session(s)", options->view, seen), 10, 8, 16, RAYWHITE);
+        DrawTexturePro(texture, source, dest, origin, 0.0f, GREEN);
+        for (int n = 0; n < seen; n++)
+        {
+            Rectangle cell = 
+            {
+                dest.x + ((n % columns) * C8_WIDTH * scale), 
+                dest.y + ((n / columns) * C8_HEIGHT * scale), 
+                C8_WIDTH * scale, 
+                C8_HEIGHT * scale
+            };
+            DrawRectangleLinesEx(cell, 1.0f, sessions[order[n]].synced ? DARKGRAY : RED);
+        }
+        EndDrawing();
+    }
+
+    UnloadTexture(texture);
+    CloseWindow();
+    close(listener);
+    free(pixels);
+    free(sessions);
+    return 0;
+#endif
+}
+
+//----------------------------------------------------------------------------------
+// Metrics
+//----------------------------------------------------------------------------------
+
+// A target ending in a port number is host:port, anything else is a file that
+// the lines are added to the end of (so C:\metrics.jsonl is still a file).
+bool open_metrics(C8_Metrics *metrics, const char *target, const char *mode, int machineCount)
+{
+    memset(metrics, 0, sizeof(C8_Metrics));
+    metrics->mode = mode;
+    metrics->machineCount = machineCount;
+    metrics->startTime = get_host_time();
+    atomic_init(&metrics->cycles, 0);
+    atomic_init(&metrics->busyNanos, 0);
+    atomic_init(&metrics->running, false);
+
+    const char *port = strrchr(target, ':');
+    if (port != NULL && port != target && port[1] != '\0' && strspn(port + 1, "0123456789") == strlen(port + 1))
+    {
+        metrics->udp = open_stream(&metrics->stream, target, 1);
+        return metrics->udp;
+    }
+
+    metrics->file = fopen(target, "a");
+    if (metrics->file == NULL)
+    {
+        TraceLog(LOG_ERROR, "METRICS: [%s] Failed to open file", target);
+        return false;
+    }
+
+    return true;
+}
+
+void close_metrics(C8_Metrics *metrics)
+{
+    if (metrics->udp)
+    {
+        close_stream(&metrics->stream);
+    }
+
+    if (metrics->file != NULL)
+    {
+        fclose(metrics->file);
+    }
+
+    metrics->udp = false;
+    metrics->file = NULL;
+}
+
+// One JSON object per line. Over UDP it doesn't block, a line that doesn't go
+// is just gone, there'll be another one along in a second.
+void write_metrics(C8_Metrics *metrics, const C8_Stats *stats)
+{
+    const double measured[6] = { stats->ips, stats->targetIps, stats->frameTime, stats->timerJitter, stats->dispatchTime, stats->drawTime };
+    char values[6][32];
+    char dropped[32] = "null";
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (measured[i] < 0.0)
+        {
+            snprintf(values[i], sizeof(values[i]), "null");
+        }
+        else
+        {
+            snprintf(values[i], sizeof(values[i]), "%.3f", measured[i]);
+        }
+    }
+
+    if (stats->droppedCycles >= 0)
+    {
+        snprintf(dropped, sizeof(dropped), "%lld", stats->droppedCycles);
+    }
+
+    char line[512];
+    int length = snprintf(line, sizeof(line),
+        "{\"time\":%.3f,\"mode\":\"%s\",\"machines\":%i,\"cycles\":%lld,\"ips\":%s,\"target_ips\":%s,"
+        "\"frame_ms\":%s,\"timer_jitter_ms\":%s,\"dropped_cycles\":%s,\"dispatch_ms\":%s,\"draw_ms\":%s}\n",
+        get_host_time() - metrics->startTime, metrics->mode, metrics->machineCount, stats->cycles,
+        values[0], values[1], values[2], values[3], dropped, values[4], values[5]);
+
+    if (metrics->file != NULL)
+    {
+        fwrite(line, 1, length, metrics->file);
+        fflush(metrics->file);
+    }
+#if !defined(_WIN32)
+    else if (metrics->udp)
+    {
+        sendto(metrics->stream.socket, line, length, 0, (struct sockaddr *)&metrics->stream.address, metrics->stream.addressLength);
+    }
+#endif
+}
+
+void start_metrics_thread(C8_Metrics *metrics)
+{
+    atomic_store(&metrics->running, true);
+    pthread_create(&metrics->thread, NULL, run_metrics_reporter, metrics);
+}
+
+// Waits for the last line, which covers the run up to the end.
+void stop_metrics_thread(C8_Metrics *metrics)
+{
+    atomic_store(&metrics->running, false);
+    pthread_join(metrics->thread, NULL);
+}
+
+// Headless and batch runs aren't paced, so there's nothing to drop and no
+// frames or timer ticks to time. What matters is whether the host still runs
+// every machine faster than C8_CLOCK_SPEED, i.e. ips against target_ips.
+void *run_metrics_reporter(void *data)
+{
+    C8_Metrics *metrics = data;
+    long long lastCycles = 0;
+    long long lastBusy = 0;
+    double lastTime = metrics->startTime;
+    bool running = true;
+
+    while (running)
+    {
+        // Short naps rather than one long one, so that the last line goes out
+        // as soon as the run has finished.
+        running = atomic_load(&metrics->running);
+        double now = get_host_time();
+        if (running && now - lastTime < C8_METRICS_INTERVAL)
+        {
+            sleep_host(0.01);
+            continue;
+        }
+
+        long long cycles = atomic_load_explicit(&metrics->cycles, memory_order_relaxed);
+        long long busy = atomic_load_explicit(&metrics->busyNanos, memory_order_relaxed);
+        double elapsed = now - lastTime;
+
+        C8_Stats stats;
+        stats.cycles = cycles;
+        stats.ips = elapsed > 0.0 ? (cycles - lastCycles) / elapsed : 0.0;
+        stats.targetIps = (double)C8_CLOCK_SPEED * metrics->machineCount;
+        stats.frameTime = -1.0;
+        stats.timerJitter = -1.0;
+        stats.droppedCycles = 0;
+        stats.dispatchTime = metrics->timed && elapsed > 0.0 ? ((busy - lastBusy) / 1000000.0) / elapsed : -1.0;
+        stats.drawTime = -1.0;
+        write_metrics(metrics, &stats);
+
+        lastCycles = cycles;
+        lastBusy = busy;
+        lastTime = now;
+    }
+
+    return NULL;
+}
+
+// Redraws the HUD texture (what goes under the keypad) with the given stats.
+// The IPS goes red when the CPU thread isn't keeping up with C8_CLOCK_SPEED.
+void draw_hud(const C8_Stats *stats)
+{
+    BeginTextureMode(C8_HudTexture);
+
+    ClearBackground(RAYWHITE);
+
+    if (stats->ips < 0.0)
+    {
+        DrawText("measuring...", 0, 0, 10, DARKGRAY);
+    }
+    else
+    {
+        Color ipsColor = stats->ips < stats->targetIps * 0.98 ? RED : DARKGRAY;
+        DrawText(TextFormat("IPS %.0f/%.0f", stats->ips, stats->targetIps), 0, 0, 10, ipsColor);
+        DrawText(TextFormat("frame %.1f ms", stats->frameTime), 0, 12, 10, DARKGRAY);
+        DrawText(TextFormat("jitter %.2f ms", stats->timerJitter), 0, 24, 10, DARKGRAY);
+        DrawText(TextFormat("dropped %lld", stats->droppedCycles), 0, 36, 10, stats->droppedCycles > 0 ? RED : DARKGRAY);
+        DrawText(TextFormat("cpu %.1f ms/s", stats->dispatchTime), 0, 48, 10, DARKGRAY);
+        DrawText(TextFormat("draw %.1f ms/s", stats->drawTime), 0, 60, 10, DARKGRAY);
+    }
+
+    EndTextureMode();
+}
+
+//----------------------------------------------------------------------------------
+// Frame Capture
+//----------------------------------------------------------------------------------
+
+// Opens the GIF and starts the encoder thread. Nothing after this is written
+// from the thread running the machine, it only ever queues frames up.
+bool open_capture(C8_Capture *capture, const char *filename, int scale)
+{
+    memset(capture, 0, sizeof(C8_Capture));
+    capture->scale = scale < 1 ? 1 : scale > C8_CAPTURE_MAX_SCALE ? C8_CAPTURE_MAX_SCALE : scale;
+    capture->frames = malloc(C8_CAPTURE_QUEUE * sizeof(C8_CaptureFrame));
+    capture->file = fopen(filename, "wb");
+    atomic_init(&capture->head, 0);
+    atomic_init(&capture->tail, 0);
+    atomic_init(&capture->done, false);
+
+    if (capture->frames == NULL || capture->file == NULL)
+    {
+        TraceLog(LOG_ERROR, "CAPTURE: [%s] Failed to open file", filename);
+        free(capture->frames);
+        if (capture->file != NULL)
+        {
+            fclose(capture->file);
+        }
+        return false;
+    }
+
+    if (pthread_create(&capture->thread, NULL, run_capture_encoder, capture) != 0)
+    {
+        TraceLog(LOG_ERROR, "CAPTURE: [%s] Failed to start the encoder", filename);
+        free(capture->frames);
+        fclose(capture->file);
+        return false;
+    }
+
+    return true;
+}
+
+// Waits for the encoder to get through what's left in the queue and finish the
+// file. Only once the machine has stopped.
+void close_capture(C8_Capture *capture)
+{
+    atomic_store_explicit(&capture->done, true, memory_order_release);
+    pthread_join(capture->thread, NULL);
+
+    fclose(capture->file);
+    free(capture->frames);
+
+    if (capture->dropped > 0)
+    {
+        TraceLog(LOG_WARNING, "CAPTURE: %lld frames dropped, the encoder fell behind", capture->dropped);
+    }
+}
+
+// The other way round from halve_pixels(), spreads 32 pixels out over a word
+// with each one doubled.
+uint64_t double_pixels(uint32_t pixels)
+{
+    uint64_t spread = pixels;
+    spread = (spread | (spread << 16)) & 0x0000FFFF0000FFFFULL;
+    spread = (spread | (spread << 8)) & 0x00FF00FF00FF00FFULL;
+    spread = (spread | (spread << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    spread = (spread | (spread << 2)) & 0x3333333333333333ULL;
+    spread = (spread | (spread << 1)) & 0x5555555555555555ULL;
+
+    return spread | (spread << 1);
+}
+
+// Called at every tick. Copies the display into the queue if it has changed,
+// or if the encoder is that far behind just counts it as dropped. Headless,
+// the ticks come far faster than the encoder could ever go, but most of them
+// don't change anything.
+void capture_frame(C8_Capture *capture, C8_Machine *machine)
+{
+    unsigned int head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&capture->tail, memory_order_acquire);
+    long long tick = capture->ticks++;
+
+    uint64_t doubled[C8_HIRES_HEIGHT][2];
+    const uint64_t (*buffer)[2] = machine->HiresBuffer;
+    if (!machine->HighRes)
+    {
+        for (int i = 0; i < C8_HEIGHT; i++)
+        {
+            doubled[i * 2][0] = double_pixels(machine->Buffer[i] >> 32);
+            doubled[i * 2][1] = double_pixels(machine->Buffer[i] & 0xFFFFFFFF);
+            doubled[(i * 2) + 1][0] = doubled[i * 2][0];
+            doubled[(i * 2) + 1][1] = doubled[i * 2][1];
+        }
+        buffer = (const uint64_t (*)[2])doubled;
+    }
+
+    if (tick > 0 && memcmp(buffer, capture->last, sizeof(capture->last)) == 0)
+    {
+        return;
+    }
+
+    if (head - tail >= C8_CAPTURE_QUEUE)
+    {
+        capture->dropped++;
+        return;
+    }
+
+    memcpy(capture->last, buffer, sizeof(capture->last));
+
+    C8_CaptureFrame *frame = &capture->frames[head & (C8_CAPTURE_QUEUE - 1)];
+    memcpy(frame->Buffer, buffer, sizeof(frame->Buffer));
+    frame->tick = tick;
+
+    atomic_store_explicit(&capture->head, head + 1, memory_order_release);
+}
+
+// The encoder thread. Takes frames off the queue until it's empty and closed,
+// then writes out the last one, which runs on until the final tick.
+void *run_capture_encoder(void *data)
+{
+    C8_Capture *capture = data;
+    const int width = C8_WIDTH * capture->scale;
+    const int height = C8_HEIGHT * capture->scale;
+
+    // Header, screen size and the palette (GREEN is the same as the window's),
+    // then the extension that tells viewers to loop it.
+    static const unsigned char palette[] = { 0, 0, 0, 0, 228, 48 };
+    static const unsigned char loop[] = { 0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0 };
+    unsigned char screen[] = { width & 0xFF, width >> 8, height & 0xFF, height >> 8, 0x80, 0, 0 };
+    fwrite("GIF89a", 1, 6, capture->file);
+    fwrite(screen, 1, sizeof(screen), capture->file);
+    fwrite(palette, 1, sizeof(palette), capture->file);
+    fwrite(loop, 1, sizeof(loop), capture->file);
+
+    while (true)
+    {
+        // done first, so that once it's set, head is known to be final.
+        bool done = atomic_load_explicit(&capture->done, memory_order_acquire);
+        unsigned int head = atomic_load_explicit(&capture->head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+
+        if (tail == head)
+        {
+            if (done)
+            {
+                break;
+            }
+
+            sleep_host(1.0 / (C8_TIMER_SPEED * 4));
+            continue;
+        }
+
+        C8_CaptureFrame *frame = &capture->frames[tail & (C8_CAPTURE_QUEUE - 1)];
+        add_gif_frame(capture, (const uint64_t (*)[2])frame->Buffer, frame->tick);
+
+        atomic_store_explicit(&capture->tail, tail + 1, memory_order_release);
+    }
+
+    // A run with no ticks at all still gets its one (blank) frame.
+    capture->havePending = true;
+    long long end = ((capture->ticks * 100) + (C8_TIMER_SPEED / 2)) / C8_TIMER_SPEED;
+    long long delay = end - capture->writtenTime;
+    while (delay > 0xFFFF)
+    {
+        write_gif_frame(capture, 0xFFFF);
+        delay -= 0xFFFF;
+    }
+    write_gif_frame(capture, delay < C8_CAPTURE_MIN_DELAY ? C8_CAPTURE_MIN_DELAY : (int)delay);
+
+    fputc(0x3B, capture->file);
+    return NULL;
+}
+
+// A frame only goes into the GIF once the display changes again, when it's
+// known how long it was up for. Frames up for less than the shortest delay
+// worth having are skipped, the next frame takes over their time.
+void add_gif_frame(C8_Capture *capture, const uint64_t (*buffer)[2], long long tick)
+{
+    if (capture->havePending && memcmp(buffer, capture->pending, sizeof(capture->pending)) == 0)
+    {
+        return;
+    }
+
+    if (capture->havePending)
+    {
+        // In centiseconds, rounded, so the delays add up to the right time
+        // even though a 60th of a second isn't a whole number of them.
+        long long time = ((tick * 100) + (C8_TIMER_SPEED / 2)) / C8_TIMER_SPEED;
+        long long delay = time - capture->writtenTime;
+
+        if (delay >= C8_CAPTURE_MIN_DELAY)
+        {
+            while (delay > 0xFFFF)
+            {
+                write_gif_frame(capture, 0xFFFF);
+                delay -= 0xFFFF;
+            }
+            write_gif_frame(capture, (int)delay);
+            capture->writtenTime = time;
+        }
+    }
+
+    memcpy(capture->pending, buffer, sizeof(capture->pending));
+    capture->havePending = true;
+}
+
+// Writes the pending frame. Only the band of rows that changed since the last
+// one is encoded, the rest is left showing from before. The scale is of the
+// 64x32 mode, so a 128x64 pixel is half of it (and at odd scales some are a
+// pixel bigger than others).
+void write_gif_frame(C8_Capture *capture, int delay)
+{
+    FILE *file = capture->file;
+    const int scale = capture->scale;
+    const int width = C8_WIDTH * scale;
+
+    int top = 0;
+    int bottom = C8_HIRES_HEIGHT - 1;
+    if (capture->started)
+    {
+        while (top < bottom && memcmp(capture->pending[top], capture->shown[top], sizeof(capture->shown[0])) == 0)
+        {
+            top++;
+        }
+        while (bottom > top && memcmp(capture->pending[bottom], capture->shown[bottom], sizeof(capture->shown[0])) == 0)
+        {
+            bottom--;
+        }
+    }
+
+    // Out to whole pairs of rows, which always start and end on a whole row
+    // of the GIF.
+    top &= ~1;
+    bottom |= 1;
+    int y = (top * scale) / 2;
+    int height = (((bottom - top) + 1) * scale) / 2;
+
+    // Graphic control (leave the last frame in place, the delay) and the image
+    // descriptor.
+    unsigned char control[] = { 0x21, 0xF9, 4, 0x04, delay & 0xFF, delay >> 8, 0, 0 };
+    unsigned char image[] = { 0x2C, 0, 0, y & 0xFF, y >> 8, width & 0xFF, width >> 8, height & 0xFF, height >> 8, 0 };
+    fwrite(control, 1, sizeof(control), file);
+    fwrite(image, 1, sizeof(image), file);
+    fputc(C8_GIF_CODE_SIZE, file);
+
+    // LZW, with the dictionary as a tree: codes[code][pixel] is the code for
+    // that string followed by one more pixel, or 0 if there isn't one yet.
+    const int clear = 1 << C8_GIF_CODE_SIZE;
+    const int end = clear + 1;
+    int size = C8_GIF_CODE_SIZE + 1;
+    int next = end + 1;
+    int prefix = -1;
+
+    memset(capture->codes, 0, sizeof(capture->codes));
+    capture->blockSize = 0;
+    capture->bits = 0;
+    capture->bitCount = 0;
+    write_gif_code(capture, clear, size);
+
+    for (int line = y; line < y + height; line++)
+    {
+        const uint64_t *pixels = capture->pending[(line * 2) / scale];
+
+        for (int x = 0; x < width; x++)
+        {
+            int column = (x * 2) / scale;
+            int pixel = (pixels[column / 64] >> (63 - (column % 64))) & 1;
+            if (prefix < 0)
+            {
+                prefix = pixel;
+                continue;
+            }
+
+            int code = capture->codes[prefix][pixel];
+            if (code != 0)
+            {
+                prefix = code;
+                continue;
+            }
+
+            write_gif_code(capture, prefix, size);
+
+            // The decoder is always one code behind, so the code size goes
+            // up one code later than you'd think.
+            if (next < C8_GIF_MAX_CODES)
+            {
+                capture->codes[prefix][pixel] = next++;
+                if (next == (1 << size) + 1 && size < 12)
+                {
+                    size++;
+                }
+            }
+            else
+            {
+                write_gif_code(capture, clear, size);
+                memset(capture->codes, 0, sizeof(capture->codes));
+                size = C8_GIF_CODE_SIZE + 1;
+                next = end + 1;
+            }
+
+            prefix = pixel;
+        }
+    }
+
+    write_gif_code(capture, prefix, size);
+    if (next == (1 << size) && size < 12)
+    {
+        size++;
+    }
+    write_gif_code(capture, end, size);
+
+    if (capture->bitCount > 0)
+    {
+        capture->block[capture->blockSize++] = (unsigned char)capture->bits;
+    }
+    flush_gif_block(capture);
+    fputc(0, file);
+
+    memcpy(capture->shown, capture->pending, sizeof(capture->shown));
+    capture->started = true;
+}
+
+// Codes are packed least significant bit first into blocks of up to 255 bytes.
+void write_gif_code(C8_Capture *capture, int code, int size)
+{
+    capture->bits |= (uint32_t)code << capture->bitCount;
+    capture->bitCount += size;
+
+    while (capture->bitCount >= 8)
+    {
+        capture->block[capture->blockSize++] = (unsigned char)capture->bits;
+        capture->bits >>= 8;
+        capture->bitCount -= 8;
+
+        if (capture->blockSize == sizeof(capture->block))
+        {
+            flush_gif_block(capture);
+        }
+    }
+}
+
+void flush_gif_block(C8_Capture *capture)
+{
+    if (capture->blockSize > 0)
+    {
+        fputc(capture->blockSize, capture->file);
+        fwrite(capture->block, 1, capture->blockSize, capture->file);
+        capture->blockSize = 0;
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Batch Runner
+//----------------------------------------------------------------------------------
+
+int get_core_count()
+{
+#if defined(_WIN32)
+    return 4;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Returns the job at the back of the queue (or the front when stealing), -1
+// if it's empty.
+int take_job(C8_WorkQueue *queue, bool steal)
+{
+    int job = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0)
+    {
+        if (steal)
+        {
+            job = queue->jobs[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        }
+        else
+        {
+            job = queue->jobs[(queue->head + queue->count - 1) % queue->capacity];
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return job;
+}
+
+// A job is only ever in one queue at a time, so there is always room.
+void put_job(C8_WorkQueue *queue, int job)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void *run_batch_worker(void *data)
+{
+    C8_Worker *worker = data;
+    C8_Batch *batch = worker->batch;
+    C8_WorkQueue *own = &batch->queues[worker->index];
+
+    while (true)
+    {
+        // Taken before looking in the queues, so a job that goes back in one
+        // after we've looked still wakes us up.
+        unsigned int requeued = atomic_load(&batch->requeued);
+        int job = take_job(own, false);
+
+        for (int i = 1; job < 0 && i < batch->workerCount; i++)
+        {
+            job = take_job(&batch->queues[(worker->index + i) % batch->workerCount], true);
+        }
+
+        if (job < 0)
+        {
+            // Nothing to steal, but the machines that other workers are in the
+            // middle of might still come back to a queue. Sleep until one does
+            // or the last of them is finished.
+            pthread_mutex_lock(&batch->lock);
+            while (batch->remaining > 0 && atomic_load(&batch->requeued) == requeued)
+            {
+                pthread_cond_wait(&batch->changed, &batch->lock);
+            }
+            int remaining = batch->remaining;
+            pthread_mutex_unlock(&batch->lock);
+
+            if (remaining == 0)
+            {
+                return NULL;
+            }
+
+            continue;
+        }
+
+        C8_BatchJob *current = &batch->jobs[job];
+        long long count = batch->totalCycles - current->executed;
+        if (count > batch->chunk)
+        {
+            count = batch->chunk;
+        }
+
+        double startTime = get_host_time();
+        step_virtual_frames(current->machine, run_cycles, &current->executed, &current->frames, count);
+        double elapsed = get_host_time() - startTime;
+        current->wallTime += elapsed;
+
+        if (batch->metrics != NULL)
+        {
+            atomic_fetch_add_explicit(&batch->metrics->cycles, count, memory_order_relaxed);
+            atomic_fetch_add_explicit(&batch->metrics->busyNanos, (long long)(elapsed * 1000000000.0), memory_order_relaxed);
+        }
+
+        if (current->executed < batch->totalCycles)
+        {
+            put_job(own, job);
+
+            pthread_mutex_lock(&batch->lock);
+            atomic_fetch_add(&batch->requeued, 1);
+            pthread_cond_signal(&batch->changed);
+            pthread_mutex_unlock(&batch->lock);
+        }
+        else
+        {
+            pthread_mutex_lock(&batch->lock);
+            batch->remaining--;
+            if (batch->remaining == 0)
+            {
+                pthread_cond_broadcast(&batch->changed);
+            }
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+}
+
+// Runs every .ch8 in a directory (or just the one ROM) headless, --instances
+// copies of each with a different seed, spread over a pool of worker threads
+// that step the machines --chunk cycles at a time. Everything is loaded up
+// front, the workers only ever touch the machines.
+int run_batch(C8_Options *options)
+{
+    long long totalCycles = options->cycles;
+    if (totalCycles <= 0)
+    {
+        long long totalFrames = options->frames > 0 ? options->frames : C8_HEADLESS_FRAMES;
+        totalCycles = (totalFrames * C8_CLOCK_SPEED) / C8_TIMER_SPEED;
+    }
+
+    int instances = options->instances > 0 ? options->instances : 1;
+    int workerCount = options->threads > 0 ? options->threads : get_core_count();
+    if (workerCount > C8_BATCH_MAX_THREADS)
+    {
+        workerCount = C8_BATCH_MAX_THREADS;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    uint32_t seed = options->seed != 0 ? options->seed : C8_DEFAULT_SEED;
+    FilePathList roms = { 0 };
+    const char *single[1] = { options->filename };
+    const char **filenames = single;
+    int romCount = 1;
+
+    // A pack stays open (mapped) for the whole run, each ROM in it is copied
+    // straight into its first machine and the names point into its index.
+    C8_Pack pack = { 0 };
+    const char **packNames = NULL;
+
+    if (IsFileExtension(options->filename, C8_PACK_EXTENSION))
+    {
+        if (!open_pack(&pack, options->filename))
+        {
+            return 1;
+        }
+
+        packNames = calloc(pack.count > 0 ? pack.count : 1, sizeof(const char *));
+        for (int i = 0; i < pack.count; i++)
+        {
+            packNames[i] = get_pack_name(&pack, i);
+        }
+        filenames = packNames;
+        romCount = pack.count;
+    }
+    else if (DirectoryExists(options->filename))
+    {
+        roms = LoadDirectoryFilesEx(options->filename, ".ch8", false);
+        filenames = (const char **)roms.paths;
+        romCount = roms.count;
+    }
+
+    C8_Batch batch = { 0 };
+    batch.jobCount = romCount * instances;
+    batch.workerCount = workerCount;
+    batch.totalCycles = totalCycles;
+    batch.chunk = options->chunk > 0 ? options->chunk : C8_BATCH_CHUNK;
+    batch.remaining = batch.jobCount;
+    batch.jobs = calloc(batch.jobCount > 0 ? batch.jobCount : 1, sizeof(C8_BatchJob));
+    batch.queues = calloc(workerCount, sizeof(C8_WorkQueue));
+    C8_Machine *machines = calloc(batch.jobCount > 0 ? batch.jobCount : 1, sizeof(C8_Machine));
+
+    if (batch.jobs == NULL || batch.queues == NULL || machines == NULL)
+    {
+        fprintf(stderr, "Not enough memory for %i machines\n", batch.jobCount);
+        free(batch.jobs);
+        free(batch.queues);
+        free(machines);
+        UnloadDirectoryFiles(roms);
+        if (pack.data != NULL)
+        {
+            close_pack(&pack);
+        }
+        free(packNames);
+        return 1;
+    }
+
+    for (int i = 0; i < romCount; i++)
+    {
+        for (int j = 0; j < instances; j++)
+        {
+            int index = (i * instances) + j;
+            C8_BatchJob *job = &batch.jobs[index];
+
+            job->filename = filenames[i];
+            job->instance = j;
+            job->seed = seed + j;
+            job->machine = &machines[index];
+
+            if (j == 0 && pack.data != NULL)
+            {
+                const char *name;
+                int size;
+                const unsigned char *image = get_pack_rom(&pack, i, &name, &size);
+                reset_machine_image(job->machine, image, size, options->quirks);
+            }
+            else if (j == 0)
+            {
+                reset_machine(job->machine, job->filename, options->quirks);
+            }
+            else
+            {
+                *job->machine = machines[i * instances];
+            }
+            seed_machine(job->machine, job->seed);
+        }
+    }
+
+    // Deal the jobs out round-robin to start with, stealing evens it up later.
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].jobs = malloc((batch.jobCount > 0 ? batch.jobCount : 1) * sizeof(int));
+        batch.queues[i].capacity = batch.jobCount > 0 ? batch.jobCount : 1;
+    }
+
+    for (int i = 0; i < batch.jobCount; i++)
+    {
+        put_job(&batch.queues[i % workerCount], i);
+    }
+
+    pthread_t threads[C8_BATCH_MAX_THREADS];
+    C8_Worker workers[C8_BATCH_MAX_THREADS];
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+    atomic_init(&batch.requeued, 0);
+
+    // Every worker adds its chunks' cycles and time to the counters.
+    C8_Metrics metrics = { 0 };
+    bool reporting = options->metrics != NULL && open_metrics(&metrics, options->metrics, "batch", batch.jobCount);
+    if (reporting)
+    {
+        metrics.timed = true;
+        batch.metrics = &metrics;
+        start_metrics_thread(&metrics);
+    }
+
+    double startTime = get_host_time();
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers[i].batch = &batch;
+        workers[i].index = i;
+        pthread_create(&threads[i], NULL, run_batch_worker, &workers[i]);
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double wallTime = get_host_time() - startTime;
+
+    if (reporting)
+    {
+        stop_metrics_thread(&metrics);
+        close_metrics(&metrics);
+    }
+
+    long long cycles = 0;
+    for (int i = 0; i < batch.jobCount; i++)
+    {
+        C8_BatchJob *job = &batch.jobs[i];
+        cycles += job->executed;
+
+        printf("%-32s %4i %08x  %016llx %12lld cycles %14.0f IPS\n",
+            GetFileName(job->filename),
+            job->instance,
+            job->seed,
+            hash_framebuffer(job->machine),
+            job->executed,
+            job->wallTime > 0.0 ? job->executed / job->wallTime : 0.0);
+    }
+
+#if C8_DEBUG_MODE
+    // One report for the lot, which only makes much sense for a single ROM
+    // (the opcodes listed are from the first one).
+    C8_Profile *profile = calloc(1, sizeof(C8_Profile));
+    for (int i = 0; profile != NULL && i < batch.jobCount; i++)
+    {
+        merge_profile(profile, &batch.jobs[i].machine->Profile);
+    }
+
+    if (profile != NULL && batch.jobCount > 0)
+    {
+        save_profile(profile, batch.jobs[0].machine, C8_PROFILE_FILENAME);
+    }
+    free(profile);
+#endif
+
+    printf("machines:   %i (%i roms x %i)\n", batch.jobCount, romCount, instances);
+    printf("threads:    %i\n", workerCount);
+    printf("cycles:     %lld\n", cycles);
+    printf("wall time:  %.6f s\n", wallTime);
+    printf("IPS:        %.0f\n", wallTime > 0.0 ? cycles / wallTime : 0.0);
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+        free(batch.queues[i].jobs);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.changed);
+    free(batch.queues);
+    free(batch.jobs);
+    free(machines);
+
+    if (roms.paths != NULL)
+    {
+        UnloadDirectoryFiles(roms);
+    }
+
+    if (pack.data != NULL)
+    {
+        close_pack(&pack);
+    }
+    free(packNames);
+
+    return 0;
+}
+
+//----------------------------------------------------------------------------------
+// ROM Packs
+//----------------------------------------------------------------------------------
+
+// Opens a pack made by --pack-create. Everything in the index is checked up
+// front, so get_pack_rom() can trust it afterwards.
+bool open_pack(C8_Pack *pack, const char *filename)
+{
+    memset(pack, 0, sizeof(C8_Pack));
+
+#if !defined(_WIN32)
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size < 0x7FFFFFFF)
+    {
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            pack->data = data;
+            pack->size = (int)info.st_size;
+            pack->mapped = true;
+        }
+    }
+
+    // The mapping stays valid once the file is closed.
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+
+    if (pack->data == NULL)
+    {
+        pack->data = LoadFileData(filename, &pack->size);
+    }
+
+    if (pack->data == NULL)
+    {
+        TraceLog(LOG_ERROR, "PACK: [%s] Failed to open ROM pack", filename);
+        return false;
+    }
+
+    const unsigned char *data = pack->data;
+    bool valid = pack->size >= C8_PACK_HEADER_SIZE 
+        && memcmp(data, C8_PACK_MAGIC, 4) == 0 
+        && data[4] == C8_PACK_VERSION;
+
+    if (valid)
+    {
+        unsigned int count = data[8] | (data[9] << 8) | (data[10] << 16) | ((unsigned int)data[11] << 24);
+        valid = count <= (unsigned int)(pack->size - C8_PACK_HEADER_SIZE) / C8_PACK_ENTRY_SIZE;
+        pack->count = valid ? (int)count : 0;
+    }
+
+    for (int i = 0; valid && i < pack->count; i++)
+    {
+        const unsigned char *entry = &data[C8_PACK_HEADER_SIZE + (i * C8_PACK_ENTRY_SIZE)];
+        unsigned int offset = 0;
+        unsigned int size = 0;
+
+        for (int j = 0; j < 4; j++)
+        {
+            offset |= (unsigned int)entry[C8_PACK_NAME_SIZE + j] << (j * 8);
+            size |= (unsigned int)entry[C8_PACK_NAME_SIZE + 4 + j] << (j * 8);
+        }
+
+        valid = entry[C8_PACK_NAME_SIZE - 1] == '\0' 
+            && size <= C8_MAX_ROM_SIZE 
+            && offset <= (unsigned int)pack->size 
+            && size <= (unsigned int)pack->size - offset;
+    }
+
+    if (!valid)
+    {
+        TraceLog(LOG_ERROR, "PACK: [%s] Not a valid ROM pack", filename);
+        close_pack(pack);
+        return false;
+    }
+
+    TraceLog(LOG_INFO, "PACK: [%s] %i ROMs, %i bytes%s", filename, pack->count, pack->size, pack->mapped ? " (mapped)" : "");
+    return true;
+}
+
+void close_pack(C8_Pack *pack)
+{
+#if !defined(_WIN32)
+    if (pack->mapped)
+    {
+        munmap((void *)pack->data, pack->size);
+    }
+    else
+#endif
+    {
+        UnloadFileData((unsigned char *)pack->data);
+    }
+
+    memset(pack, 0, sizeof(C8_Pack));
+}
+
+// The ROM is a pointer straight into the pack, which is read-only, and both it
+// and the name stay valid until the pack is closed. The ROM is checked against
+// its hash first, and like load_rom() it's NULL (with a size of 0) if it's bad.
+const unsigned char *get_pack_rom(C8_Pack *pack, int index, const char **name, int *size)
+{
+    const unsigned char *entry = &pack->data[C8_PACK_HEADER_SIZE + (index * C8_PACK_ENTRY_SIZE)];
+    unsigned int offset = 0;
+    unsigned long long expected = 0;
+
+    *size = 0;
+    for (int j = 0; j < 4; j++)
+    {
+        offset |= (unsigned int)entry[C8_PACK_NAME_SIZE + j] << (j * 8);
+        *size |= entry[C8_PACK_NAME_SIZE + 4 + j] << (j * 8);
+    }
+    for (int j = 0; j < 8; j++)
+    {
+        expected |= (unsigned long long)entry[C8_PACK_NAME_SIZE + 8 + j] << (j * 8);
+    }
+
+    const unsigned char *rom = &pack->data[offset];
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int k = 0; k < *size; k++)
+    {
+        hash ^= rom[k];
+        hash *= 1099511628211ULL;
+    }
+
+    *name = (const char *)entry;
+    if (hash != expected)
+    {
+        TraceLog(LOG_ERROR, "PACK: [%s] ROM doesn't match its hash, %016llx not %016llx", *name, hash, expected);
+        *size = 0;
+        return NULL;
+    }
+
+    return rom;
+}
+
+// Just the name, without reading (or checking) the ROM.
+const char *get_pack_name(C8_Pack *pack, int index)
+{
+    return (const char *)&pack->data[C8_PACK_HEADER_SIZE + (index * C8_PACK_ENTRY_SIZE)];
+}
+
+// Builds a pack out of every ROM given (or every .ch8 in a directory). ROMs
+// that are too big are left out, and ROMs with the same contents are only 
+// stored once.
+int create_pack(C8_Options *options)
+{
+    const char *single[1] = { options->filename };
+    const char **arguments = options->filenameCount > 0 ? options->filenames : single;
+    int argumentCount = options->filenameCount > 0 ? options->filenameCount : 1;
+
+    int capacity = 64;
+    int count = 0;
+    unsigned char **roms = malloc(capacity * sizeof(unsigned char *));
+    int *sizes = malloc(capacity * sizeof(int));
+    unsigned long long *hashes = malloc(capacity * sizeof(unsigned long long));
+    char (*names)[C8_PACK_NAME_SIZE] = malloc(capacity * C8_PACK_NAME_SIZE);
+    bool failed = roms == NULL || sizes == NULL || hashes == NULL || names == NULL;
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    for (int i = 0; !failed && i < argumentCount; i++)
+    {
+        FilePathList list = { 0 };
+        const char *one[1] = { arguments[i] };
+        const char **filenames = one;
+        int filenameCount = 1;
+
+        if (DirectoryExists(arguments[i]))
+        {
+            list = LoadDirectoryFilesEx(arguments[i], ".ch8", false);
+            filenames = (const char **)list.paths;
+            filenameCount = list.count;
+        }
+
+        for (int j = 0; !failed && j < filenameCount; j++)
+        {
+            int size = 0;
+            unsigned char *data = load_rom(filenames[j], &size);
+            if (data == NULL)
+            {
+                continue;
+            }
+
+            // Each one is kept as soon as it has grown, so whatever did grow
+            // still gets freed if a later one doesn't.
+            if (count == capacity)
+            {
+                int grown = capacity * 2;
+                unsigned char **moreRoms = realloc(roms, grown * sizeof(unsigned char *));
+                roms = moreRoms != NULL ? moreRoms : roms;
+                int *moreSizes = realloc(sizes, grown * sizeof(int));
+                sizes = moreSizes != NULL ? moreSizes : sizes;
+                unsigned long long *moreHashes = realloc(hashes, grown * sizeof(unsigned long long));
+                hashes = moreHashes != NULL ? moreHashes : hashes;
+                char (*moreNames)[C8_PACK_NAME_SIZE] = realloc(names, grown * C8_PACK_NAME_SIZE);
+                names = moreNames != NULL ? moreNames : names;
+
+                if (moreRoms == NULL || moreSizes == NULL || moreHashes == NULL || moreNames == NULL)
+                {
+                    UnloadFileData(data);
+                    failed = true;
+                    break;
+                }
+                capacity = grown;
+            }
+
+            const char *name = GetFileName(filenames[j]);
+            if (strlen(name) >= C8_PACK_NAME_SIZE)
+            {
+                TraceLog(LOG_WARNING, "PACK: [%s] Name cut short to %i characters", name, C8_PACK_NAME_SIZE - 1);
+            }
+
+            roms[count] = data;
+            sizes[count] = size;
+            hashes[count] = 14695981039346656037ULL;
+            for (int k = 0; k < size; k++)
+            {
+                hashes[count] ^= data[k];
+                hashes[count] *= 1099511628211ULL;
+            }
+            memset(names[count], 0, C8_PACK_NAME_SIZE);
+            strncpy(names[count], name, C8_PACK_NAME_SIZE - 1);
+            count++;
+        }
+
+        if (list.paths != NULL)
+        {
+            UnloadDirectoryFiles(list);
+        }
+    }
+
+    // Worst case, no two ROMs are the same.
+    int dataStart = C8_PACK_HEADER_SIZE + (count * C8_PACK_ENTRY_SIZE);
+    int size = dataStart;
+    for (int i = 0; i < count; i++)
+    {
+        size += sizes[i];
+    }
+
+    unsigned char *pack = failed ? NULL : calloc(size, 1);
+    int tail = dataStart;
+    int unique = 0;
+
+    if (pack == NULL)
+    {
+        TraceLog(LOG_ERROR, "PACK: [%s] Not enough memory for the ROMs", options->packCreate);
+        for (int i = 0; i < count; i++)
+        {
+            UnloadFileData(roms[i]);
+        }
+        free(names);
+        free(hashes);
+        free(sizes);
+        free(roms);
+        return 1;
+    }
+
+    memcpy(pack, C8_PACK_MAGIC, 4);
+    pack[4] = C8_PACK_VERSION;
+    for (int i = 0; i < 4; i++)
+    {
+        pack[8 + i] = (unsigned int)count >> (i * 8);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned char *entry = &pack[C8_PACK_HEADER_SIZE + (i * C8_PACK_ENTRY_SIZE)];
+        int offset = tail;
+
+        for (int j = 0; j < i; j++)
+        {
+            if (hashes[j] == hashes[i] && sizes[j] == sizes[i] && memcmp(roms[j], roms[i], sizes[i]) == 0)
+            {
+                const unsigned char *other = &pack[C8_PACK_HEADER_SIZE + (j * C8_PACK_ENTRY_SIZE)];
+                offset = other[C8_PACK_NAME_SIZE] | (other[C8_PACK_NAME_SIZE + 1] << 8) | (other[C8_PACK_NAME_SIZE + 2] << 16) | (other[C8_PACK_NAME_SIZE + 3] << 24);
+                break;
+            }
+        }
+
+        if (offset == tail)
+        {
+            memcpy(&pack[tail], roms[i], sizes[i]);
+            tail += sizes[i];
+            unique++;
+        }
+
+        memcpy(entry, names[i], C8_PACK_NAME_SIZE);
+        for (int j = 0; j < 4; j++)
+        {
+            entry[C8_PACK_NAME_SIZE + j] = (unsigned int)offset >> (j * 8);
+            entry[C8_PACK_NAME_SIZE + 4 + j] = (unsigned int)sizes[i] >> (j * 8);
+        }
+        for (int j = 0; j < 8; j++)
+        {
+            entry[C8_PACK_NAME_SIZE + 8 + j] = hashes[i] >> (j * 8);
+        }
+    }
+
+    bool saved = SaveFileData(options->packCreate, pack, tail);
+    if (saved)
+    {
+        printf("%s: %i roms (%i unique), %i bytes\n", options->packCreate, count, unique, tail);
+    }
+    else
+    {
+        TraceLog(LOG_ERROR, "PACK: [%s] Failed to save ROM pack", options->packCreate);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        UnloadFileData(roms[i]);
+    }
+    free(pack);
+    free(names);
+    free(hashes);
+    free(sizes);
+    free(roms);
+
+    return saved ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Lockstep Engine
+//----------------------------------------------------------------------------------
+#if defined(__GNUC__)
+
+// Packs a byte-per-lane mask (0x00 or 0xFF) into one bit per lane, eight lanes
+// at a time with a multiply that gathers the low bit of each byte into the top
+// byte. And the other way round, spreading each bit back out over its byte.
+uint32_t lane_bits(C8_LaneBytes mask)
+{
+    uint64_t parts[C8_LANES / 8];
+    uint32_t bits = 0;
+
+    memcpy(parts, &mask, sizeof(parts));
+    for (int i = 0; i < C8_LANES / 8; i++)
+    {
+        bits |= (uint32_t)(((parts[i] & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56) << (i * 8);
+    }
+
+    return bits;
+}
+
+C8_LaneBytes lane_mask(uint32_t bits)
+{
+    uint64_t parts[C8_LANES / 8];
+    C8_LaneBytes mask;
+
+    for (int i = 0; i < C8_LANES / 8; i++)
+    {
+        uint64_t spread = (((bits >> (i * 8)) & 0xFF) * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+        parts[i] = (((spread + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL) * 0xFF;
+    }
+    memcpy(&mask, parts, sizeof(mask));
+
+    return mask;
+}
+
+// Copies one lane's registers into its machine, and back again, around the
+// instructions that aren't done with vectors.
+void gather_lane(C8_LaneGroup *group, int lane)
+{
+    C8_Machine *machine = group->machines[lane];
+
+    for (int i = 0; i < C8_V_REGISTER_COUNT; i++)
+    {
+        machine->V[i] = group->V[i][lane];
+    }
+    machine->PC = group->PC[lane];
+    machine->I = group->I[lane];
+    machine->DT = group->DT[lane];
+    machine->ST = group->ST[lane];
+}
+
+void scatter_lane(C8_LaneGroup *group, int lane)
+{
+    C8_Machine *machine = group->machines[lane];
+
+    for (int i = 0; i < C8_V_REGISTER_COUNT; i++)
+    {
+        group->V[i][lane] = machine->V[i];
+    }
+    group->PC[lane] = machine->PC;
+    group->I[lane] = machine->I;
+    group->DT[lane] = machine->DT;
+    group->ST[lane] = machine->ST;
+}
+
+// Runs the instruction on each of the lanes one at a time, through their own
+// machines, for everything the vector code below doesn't handle.
+void execute_lanes_scalar(C8_LaneGroup *group, uint32_t lanes, C8_DecodedInstruction *decoded)
+{
+    if (decoded->op == C8_OP_LD_B_VX || decoded->op == C8_OP_LD_I_VX || decoded->op == C8_OP_LD_I_VX_MOVE_I)
+    {
+        group->written |= lanes;
+    }
+
+    while (lanes != 0)
+    {
+        int lane = __builtin_ctz(lanes);
+        C8_Machine *machine = group->machines[lane];
+        C8_Instruction instruction = decoded->instruction;
+
+        gather_lane(group, lane);
+        decoded->handler(machine, &instruction);
+        increment_program_counter(machine, &instruction);
+        scatter_lane(group, lane);
+
+        lanes &= lanes - 1;
+    }
+}
+
+// Every lane in the mask moves on to its next instruction, and the ones that
+// are also in skip jump over it.
+void advance_lanes(C8_LaneGroup *group, C8_LaneBytes mask, C8_LaneBytes skip)
+{
+    group->PC += __builtin_convertvector(mask & (2 + (skip & 2)), C8_LaneShorts);
+}
+
+// Runs one instruction on all of the lanes in the mask (which are all at the
+// same address, with the same opcode there). The ALU and skip instructions are
+// done for all of the lanes at once, with the result only kept for the lanes
+// in the mask.
+void execute_lanes(C8_LaneGroup *group, uint32_t lanes, C8_LaneBytes mask, C8_DecodedInstruction *decoded)
+{
+    C8_Instruction *instruction = &decoded->instruction;
+    C8_LaneBytes vx = group->V[instruction->x];
+    C8_LaneBytes vy = group->V[instruction->y];
+    C8_LaneBytes none = { 0 };
+    C8_LaneBytes flag;
+
+    // The same mask again, as wide as PC and I.
+    C8_LaneShorts wide = __builtin_convertvector((C8_LaneFlags)mask, C8_LaneShorts);
+    C8_LaneShorts nowhere = { 0 };
+
+// The vector compares give 0 or -1 per lane, these turn that into the 0 or 1
+// that VF expects, or the all-ones mask that the skips want.
+#define C8_LANE_BOOL(condition)     ((C8_LaneBytes)(condition) & 1)
+#define C8_LANE_MASK(condition)     ((C8_LaneBytes)(condition))
+#define C8_LANE_STORE(reg, value)   (reg) = ((value) & mask) | ((reg) & ~mask)
+#define C8_LANE_STORE_WIDE(reg, value)  (reg) = ((value) & wide) | ((reg) & ~wide)
+
+    switch (decoded->op)
+    {
+        case C8_OP_SYS_ADDR:
+            break;
+
+        case C8_OP_LD_VX_BYTE:
+            C8_LANE_STORE(group->V[instruction->x], none + instruction->kk);
+            break;
+
+        case C8_OP_ADD_VX_BYTE:
+            C8_LANE_STORE(group->V[instruction->x], vx + instruction->kk);
+            break;
+
+        case C8_OP_LD_VX_VY:
+            C8_LANE_STORE(group->V[instruction->x], vy);
+            break;
+
+        case C8_OP_OR_VX_VY:
+            C8_LANE_STORE(group->V[instruction->x], vx | vy);
+            break;
+
+        case C8_OP_AND_VX_VY:
+            C8_LANE_STORE(group->V[instruction->x], vx & vy);
+            break;
+
+        case C8_OP_XOR_VX_VY:
+            C8_LANE_STORE(group->V[instruction->x], vx ^ vy);
+            break;
+
+        case C8_OP_OR_VX_VY_RESET_VF:
+            C8_LANE_STORE(group->V[instruction->x], vx | vy);
+            C8_LANE_STORE(group->V[C8_VF], none);
+            break;
+
+        case C8_OP_AND_VX_VY_RESET_VF:
+            C8_LANE_STORE(group->V[instruction->x], vx & vy);
+            C8_LANE_STORE(group->V[C8_VF], none);
+            break;
+
+        case C8_OP_XOR_VX_VY_RESET_VF:
+            C8_LANE_STORE(group->V[instruction->x], vx ^ vy);
+            C8_LANE_STORE(group->V[C8_VF], none);
+            break;
+
+        case C8_OP_ADD_VX_VY:
+            // Same order as C8_ADD_VX_VY(): store the sum, then compare it with
+            // Vy as it is now (which matters when x or y is F).
+            C8_LANE_STORE(group->V[instruction->x], vx + vy);
+            vx = group->V[instruction->x];
+            vy = group->V[instruction->y];
+            C8_LANE_STORE(group->V[C8_VF], C8_LANE_BOOL(vx < vy));
+            break;
+
+        case C8_OP_SUB_VX_VY:
+            flag = C8_LANE_BOOL(vx >= vy);
+            C8_LANE_STORE(group->V[instruction->x], vx - vy);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_SHR_VX_VY:
+            flag = vx & 1;
+            C8_LANE_STORE(group->V[instruction->x], vx >> 1);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_SUBN_VX_VY:
+            flag = C8_LANE_BOOL(vy >= vx);
+            C8_LANE_STORE(group->V[instruction->x], vy - vx);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_SHL_VX_VY:
+            flag = vx >> 7;
+            C8_LANE_STORE(group->V[instruction->x], vx << 1);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_SHR_VX_VY_SHIFT_VY:
+            flag = vy & 1;
+            C8_LANE_STORE(group->V[instruction->x], vy >> 1);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_SHL_VX_VY_SHIFT_VY:
+            flag = vy >> 7;
+            C8_LANE_STORE(group->V[instruction->x], vy << 1);
+            C8_LANE_STORE(group->V[C8_VF], flag);
+            break;
+
+        case C8_OP_LD_I_ADDR:
+            C8_LANE_STORE_WIDE(group->I, nowhere + instruction->addr);
+            break;
+
+        case C8_OP_ADD_I_VX:
+            group->I += __builtin_convertvector(vx, C8_LaneShorts) & wide;
+            break;
+
+        case C8_OP_LD_F_VX:
+            C8_LANE_STORE_WIDE(group->I, __builtin_convertvector(vx, C8_LaneShorts));
+            break;
+
+        case C8_OP_LD_VX_DT:
+            C8_LANE_STORE(group->V[instruction->x], group->DT);
+            break;
+
+        case C8_OP_LD_DT_VX:
+            C8_LANE_STORE(group->DT, vx);
+            break;
+
+        case C8_OP_LD_ST_VX:
+            C8_LANE_STORE(group->ST, vx);
+            break;
+
+        // The skips are where the lanes can go their separate ways, each lane
+        // moves on by 2 or 4 depending on its own registers.
+        case C8_OP_SE_VX_BYTE:
+            advance_lanes(group, mask, C8_LANE_MASK(vx == instruction->kk));
+            return;
+
+        case C8_OP_SNE_VX_BYTE:
+            advance_lanes(group, mask, C8_LANE_MASK(vx != instruction->kk));
+            return;
+
+        case C8_OP_SE_VX_VY:
+            advance_lanes(group, mask, C8_LANE_MASK(vx == vy));
+            return;
+
+        case C8_OP_SNE_VX_VY:
+            advance_lanes(group, mask, C8_LANE_MASK(vx != vy));
+            return;
+
+        case C8_OP_JP_ADDR:
+            C8_LANE_STORE_WIDE(group->PC, nowhere + instruction->addr);
+            return;
+
+        default:
+            execute_lanes_scalar(group, lanes, decoded);
+            return;
+    }
+
+#undef C8_LANE_STORE_WIDE
+#undef C8_LANE_STORE
+#undef C8_LANE_MASK
+#undef C8_LANE_BOOL
+
+    advance_lanes(group, mask, none);
+}
+
+// Where the lane's next event is: its next frame boundary, when the timers
+// tick, or the end of the run, whichever comes first.
+long long next_lane_event(long long frames, long long totalCycles)
+{
+    long long tick = virtual_tick(frames);
+    return tick < totalCycles ? tick : totalCycles;
+}
+
+// Runs every active lane until it has done totalCycles instructions. Each time
+// round, the lanes with the lowest PC go together (as long as they've got the
+// same opcode there) and the rest wait. That way lanes that have drifted apart,
+// e.g. one took a skip and the others didn't, line up again at the next
+// backwards jump instead of staying out of step forever. The lanes never affect
+// each other and each one ticks its own timers when it reaches its own frame
+// boundaries, so the order they run in doesn't change the results.
+void run_lanes(C8_LaneGroup *group, long long totalCycles)
+{
+    C8_DecodedInstruction scratch = {0};
+    long long events[C8_LANES];
+    long long frames[C8_LANES] = {0};
+    uint32_t waiting = totalCycles > 0 ? group->active : 0;
+
+    // Counts down the instructions each lane has left before its next event,
+    // so the only per-instruction bookkeeping is one vector subtract.
+    C8_LaneInts countdown;
+    C8_LaneInts zero = { 0 };
+
+    for (int lane = 0; lane < C8_LANES; lane++)
+    {
+        events[lane] = next_lane_event(0, totalCycles);
+        countdown[lane] = (int)events[lane];
+    }
+
+    while (waiting != 0)
+    {
+        // Most of the time every lane is at the same place, so try the first
+        // one's PC before bothering to look for the lowest.
+        int leader = __builtin_ctz(waiting);
+        unsigned short pc = group->PC[leader];
+        uint32_t lanes = lane_bits(__builtin_convertvector(group->PC == pc, C8_LaneBytes)) & waiting;
+
+        if (lanes != waiting)
+        {
+            C8_LaneShorts idle = ~__builtin_convertvector((C8_LaneFlags)lane_mask(waiting), C8_LaneShorts);
+            C8_LaneShorts keys = group->PC | idle;
+
+            for (int lane = 0; lane < C8_LANES; lane++)
+            {
+                pc = keys[lane] < pc ? keys[lane] : pc;
+            }
+
+            lanes = lane_bits(__builtin_convertvector(group->PC == pc, C8_LaneBytes)) & waiting;
+            leader = __builtin_ctz(lanes);
+        }
+
+        // Lanes whose RAM is still the same as when they started can't have a
+        // different opcode here, only the ones that have written to it need
+        // checking against the leader.
+        C8_Machine *machine = group->machines[leader];
+        unsigned char first = read_ram(machine, pc);
+        unsigned char second = read_ram(machine, pc + 1);
+        uint32_t check = group->written & lanes & ~(1u << leader);
+
+        while (check != 0)
+        {
+            int lane = __builtin_ctz(check);
+            C8_Machine *other = group->machines[lane];
+
+            if (read_ram(other, pc) != first || read_ram(other, pc + 1) != second)
+            {
+                lanes &= ~(1u << lane);
+            }
+            check &= check - 1;
+        }
+
+        // Take a copy, a scalar handler writing to the leader's RAM would
+        // throw away the cached one.
+        machine->PC = pc;
+        C8_DecodedInstruction decoded = *fetch_instruction(machine, &scratch);
+        decoded.instruction.skip = 0;
+
+        C8_LaneBytes mask = lane_mask(lanes);
+        execute_lanes(group, lanes, mask, &decoded);
+
+        // The mask is -1 in each lane that ran, which is exactly what comes
+        // off its countdown.
+        countdown += __builtin_convertvector((C8_LaneFlags)mask, C8_LaneInts);
+        uint32_t due = lane_bits(__builtin_convertvector(countdown == zero, C8_LaneBytes)) & lanes;
+
+        while (due != 0)
+        {
+            int lane = __builtin_ctz(due);
+
+            if (events[lane] == virtual_tick(frames[lane]))
+            {
+                group->DT[lane] -= group->DT[lane] > 0;
+                group->ST[lane] -= group->ST[lane] > 0;
+                frames[lane]++;
+            }
+
+            if (events[lane] == totalCycles)
+            {
+                waiting &= ~(1u << lane);
+            }
+            else
+            {
+                long long next = next_lane_event(frames[lane], totalCycles);
+                countdown[lane] = (int)(next - events[lane]);
+                events[lane] = next;
+            }
+
+            due &= due - 1;
+        }
+    }
+}
+
+// Runs the machines (all booted from the same ROM, but free to go their
+// separate ways) C8_LANES at a time through the lockstep engine. Ends with
+// every machine in exactly the state it would have been in if it was run on
+// its own through run_virtual_frames(). Returns the number of frames.
+long long run_lockstep(C8_Machine *machines, int machineCount, long long totalCycles)
+{
+    for (int first = 0; first < machineCount; first += C8_LANES)
+    {
+        C8_LaneGroup group = {0};
+
+        for (int lane = 0; lane < C8_LANES && first + lane < machineCount; lane++)
+        {
+            group.machines[lane] = &machines[first + lane];
+            group.active |= 1u << lane;
+            scatter_lane(&group, lane);
+
+            if (!same_ram(&machines[first + lane], &machines[first]))
+            {
+                group.written |= 1u << lane;
+            }
+        }
+
+        // Spare lanes just point at the first machine and are never run.
+        for (int lane = 0; lane < C8_LANES; lane++)
+        {
+            if (group.machines[lane] == NULL)
+            {
+                group.machines[lane] = group.machines[0];
+            }
+        }
+
+        run_lanes(&group, totalCycles);
+
+        for (int lane = 0; lane < C8_LANES; lane++)
+        {
+            if ((group.active & (1u << lane)) != 0)
+            {
+                gather_lane(&group, lane);
+                group.machines[lane]->Cycles += totalCycles;
+            }
+        }
+
+        if (C8_ActiveMetrics != NULL)
+        {
+            long long done = first + C8_LANES < machineCount ? first + C8_LANES : machineCount;
+            atomic_store_explicit(&C8_ActiveMetrics->cycles, done * totalCycles, memory_order_relaxed);
+        }
+    }
+
+    return (totalCycles * C8_TIMER_SPEED) / C8_CLOCK_SPEED;
+}
+#else
+// Without the vector extensions there's nothing to gain from the lanes, so the
+// machines just run one after another.
+long long run_lockstep(C8_Machine *machines, int machineCount, long long totalCycles)
+{
+    return run_virtual_frames(machines, machineCount, run_cycles, totalCycles);
+}
+#endif
+
+//----------------------------------------------------------------------------------
+// Save States
+//----------------------------------------------------------------------------------
+
+// Writes the whole machine into the raw (C8_STATE_SIZE bytes) layout.
+void capture_state(C8_Machine *machine, unsigned char *raw)
+{
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        memcpy(&raw[C8_STATE_RAM + (i * C8_PAGE_SIZE)], ram_page(machine, i), C8_PAGE_SIZE);
+    }
+    memcpy(&raw[C8_STATE_V], machine->V, C8_V_REGISTER_COUNT);
+    raw[C8_STATE_I]         = machine->I & 0xFF;
+    raw[C8_STATE_I + 1]     = machine->I >> 8;
+    raw[C8_STATE_DT]        = machine->DT;
+    raw[C8_STATE_ST]        = machine->ST;
+    raw[C8_STATE_PC]        = machine->PC & 0xFF;
+    raw[C8_STATE_PC + 1]    = machine->PC >> 8;
+    raw[C8_STATE_SP]        = machine->SP;
+
+    for (int i = 0; i < C8_STACK_SIZE; i++)
+    {
+        raw[C8_STATE_STACK + (i * 2)]       = machine->STACK[i] & 0xFF;
+        raw[C8_STATE_STACK + (i * 2) + 1]   = machine->STACK[i] >> 8;
+    }
+
+    for (int i = 0; i < C8_HEIGHT; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            raw[C8_STATE_BUFFER + (i * 8) + j] = machine->Buffer[i] >> (56 - (j * 8));
+        }
+    }
+
+    unsigned short keys = get_key_mask(machine);
+    raw[C8_STATE_KEYBOARD]      = keys & 0xFF;
+    raw[C8_STATE_KEYBOARD + 1]  = keys >> 8;
+
+    for (int i = 0; i < 4; i++)
+    {
+        raw[C8_STATE_RANDOM + i] = machine->Random >> (i * 8);
+    }
+
+    raw[C8_STATE_HIRES] = machine->HighRes;
+    for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            raw[C8_STATE_HIRES_BUFFER + (i * 16) + j] = machine->HiresBuffer[i][j / 8] >> (56 - ((j % 8) * 8));
+        }
+    }
+    memcpy(&raw[C8_STATE_FLAGS], machine->Flags, C8_V_REGISTER_COUNT);
+}
+
+// The reverse of capture_state(). As RAM may now be completely different, all
+// the decoded instructions are thrown away and the whole display is redrawn.
+// Pages that are back to how they were at boot go back to being shared.
+void apply_state(C8_Machine *machine, const unsigned char *raw)
+{
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        const unsigned char *page = &raw[C8_STATE_RAM + (i * C8_PAGE_SIZE)];
+
+        if (machine->Image != NULL && memcmp(page, &machine->Image[i * C8_PAGE_SIZE], C8_PAGE_SIZE) == 0)
+        {
+            machine->PrivatePages &= ~(1u << i);
+        }
+        else
+        {
+            memcpy(&machine->RAM[i * C8_PAGE_SIZE], page, C8_PAGE_SIZE);
+            machine->PrivatePages |= 1u << i;
+        }
+    }
+    memcpy(machine->V, &raw[C8_STATE_V], C8_V_REGISTER_COUNT);
+    machine->I    = raw[C8_STATE_I] | (raw[C8_STATE_I + 1] << 8);
+    machine->DT   = raw[C8_STATE_DT];
+    machine->ST   = raw[C8_STATE_ST];
+    machine->PC   = raw[C8_STATE_PC] | (raw[C8_STATE_PC + 1] << 8);
+    machine->SP   = raw[C8_STATE_SP] % C8_STACK_SIZE;
+
+    for (int i = 0; i < C8_STACK_SIZE; i++)
+    {
+        machine->STACK[i] = raw[C8_STATE_STACK + (i * 2)] | (raw[C8_STATE_STACK + (i * 2) + 1] << 8);
+    }
+
+    for (int i = 0; i < C8_HEIGHT; i++)
+    {
+        machine->Buffer[i] = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            machine->Buffer[i] = (machine->Buffer[i] << 8) | raw[C8_STATE_BUFFER + (i * 8) + j];
+        }
+    }
+
+    // Not a press, the keys were already down in the state.
+    machine->Keys = raw[C8_STATE_KEYBOARD] | (raw[C8_STATE_KEYBOARD + 1] << 8);
+    machine->KeyPresses = 0;
+
+    machine->Random = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        machine->Random |= (uint32_t)raw[C8_STATE_RANDOM + i] << (i * 8);
+    }
+    seed_machine(machine, machine->Random);
+
+    machine->HighRes = raw[C8_STATE_HIRES] != 0;
+    for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+    {
+        machine->HiresBuffer[i][0] = 0;
+        machine->HiresBuffer[i][1] = 0;
+        for (int j = 0; j < 16; j++)
+        {
+            machine->HiresBuffer[i][j / 8] = (machine->HiresBuffer[i][j / 8] << 8) | raw[C8_STATE_HIRES_BUFFER + (i * 16) + j];
+        }
+    }
+    memcpy(machine->Flags, &raw[C8_STATE_FLAGS], C8_V_REGISTER_COUNT);
+
+    invalidate_decode_cache(machine, 0, C8_MEMORY);
+    flush_block_cache(machine);
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+}
+
+// A simple run-length encoding that is good at the long runs of zeros you get
+// from XORing two states together. Each run starts with a control byte:
+//   0x00 - 0x7F: (n + 1) zero bytes
+//   0x80 - 0xFF: (n - 0x7F) literal bytes follow
+// Returns the encoded size, or -1 if it doesn't fit in the output.
+int rle_encode(const unsigned char *data, int size, unsigned char *out, int capacity)
+{
+    int length = 0;
+    int i = 0;
+
+    while (i < size)
+    {
+        int run = 0;
+
+        if (data[i] == 0)
+        {
+            while (i + run < size && run < 128 && data[i + run] == 0)
+            {
+                run++;
+            }
+
+            if (length + 1 > capacity)
+            {
+                return -1;
+            }
+            out[length++] = run - 1;
+        }
+        else
+        {
+            // Keep going until we hit a pair of zeros (a single zero is
+            // cheaper to leave in the literals than to start a new run for).
+            while (i + run < size && run < 128 && 
+                   !(data[i + run] == 0 && (i + run + 1 >= size || data[i + run + 1] == 0)))
+            {
+                run++;
+            }
+
+            if (length + 1 + run > capacity)
+            {
+                return -1;
+            }
+            out[length++] = 0x7F + run;
+            memcpy(&out[length], &data[i], run);
+            length += run;
+        }
+
+        i += run;
+    }
+
+    return length;
+}
+
+// Returns the decoded size, or -1 if the data is corrupt or too big.
+int rle_decode(const unsigned char *data, int size, unsigned char *out, int capacity)
+{
+    int length = 0;
+    int i = 0;
+
+    while (i < size)
+    {
+        unsigned char control = data[i++];
+
+        if (control < 0x80)
+        {
+            int run = control + 1;
+            if (length + run > capacity)
+            {
+                return -1;
+            }
+            memset(&out[length], 0, run);
+            length += run;
+        }
+        else
+        {
+            int run = control - 0x7F;
+            if (length + run > capacity || i + run > size)
+            {
+                return -1;
+            }
+            memcpy(&out[length], &data[i], run);
+            length += run;
+            i += run;
+        }
+    }
+
+    return length;
+}
+
+// Snapshot header (all little-endian):
+//   0   4   magic "C8ST"
+//   4   1   version
+//   5   2   which RAM pages are in the snapshot, one bit each (version 3)
+//   7   1   reserved (0)
+//   8   8   hash of RAM after the ROM was loaded
+//   16  ... RLE(raw state XOR boot state), with just those pages of RAM
+// Returns the size of the snapshot, or 0 if it didn't fit.
+int save_snapshot(C8_Machine *machine, unsigned char *data, int capacity)
+{
+    unsigned char raw[C8_STATE_SIZE];
+
+    if (capacity < C8_SNAPSHOT_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    capture_state(machine, raw);
+    for (int i = 0; i < C8_STATE_SIZE; i++)
+    {
+        raw[i] ^= machine->BootState[i];
+    }
+
+    // Only pages the machine has written to can be any different from boot.
+    // Those that are (not all zeros) are packed down to the front, the rest
+    // of the state follows straight after them.
+    uint32_t pages = 0;
+    int packed = 0;
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        const unsigned char *page = &raw[C8_STATE_RAM + (i * C8_PAGE_SIZE)];
+        bool changed = false;
+
+        for (int j = 0; (machine->PrivatePages & (1u << i)) && !changed && j < C8_PAGE_SIZE; j++)
+        {
+            changed = page[j] != 0;
+        }
+
+        if (changed)
+        {
+            memmove(&raw[C8_STATE_RAM + (packed * C8_PAGE_SIZE)], page, C8_PAGE_SIZE);
+            pages |= 1u << i;
+            packed++;
+        }
+    }
+    int rawSize = (packed * C8_PAGE_SIZE) + (C8_STATE_SIZE - C8_STATE_V);
+    memmove(&raw[C8_STATE_RAM + (packed * C8_PAGE_SIZE)], &raw[C8_STATE_V], C8_STATE_SIZE - C8_STATE_V);
+
+    memset(data, 0, C8_SNAPSHOT_HEADER_SIZE);
+    memcpy(data, C8_SNAPSHOT_MAGIC, 4);
+    data[4] = C8_SNAPSHOT_VERSION;
+    data[5] = pages & 0xFF;
+    data[6] = pages >> 8;
+    for (int i = 0; i < 8; i++)
+    {
+        data[8 + i] = machine->BootHash >> (i * 8);
+    }
+
+    int length = rle_encode(raw, rawSize, &data[C8_SNAPSHOT_HEADER_SIZE], capacity - C8_SNAPSHOT_HEADER_SIZE);
+    if (length < 0)
+    {
+        return 0;
+    }
+
+    return C8_SNAPSHOT_HEADER_SIZE + length;
+}
+
+bool load_snapshot(C8_Machine *machine, const unsigned char *data, int size)
+{
+    unsigned char raw[C8_STATE_SIZE];
+    unsigned char packed[C8_STATE_SIZE];
+    unsigned long long hash = 0;
+
+    if (size < C8_SNAPSHOT_HEADER_SIZE || memcmp(data, C8_SNAPSHOT_MAGIC, 4) != 0)
+    {
+        TraceLog(LOG_WARNING, "STATE: Not a raychip-8 snapshot");
+        return false;
+    }
+
+    if (data[4] < 1 || data[4] > C8_SNAPSHOT_VERSION)
+    {
+        TraceLog(LOG_WARNING, "STATE: Unsupported snapshot version %i", data[4]);
+        return false;
+    }
+
+    // Version 1 didn't have the random number generator, it just carries on
+    // from wherever it is now (and so do the flag registers before version 4).
+    // Before version 3 every page of RAM was there.
+    int rawSize = data[4] == 1 ? C8_STATE_RANDOM : data[4] < 4 ? C8_STATE_HIRES : C8_STATE_SIZE;
+    uint32_t pages = data[4] >= 3 ? (uint32_t)(data[5] | (data[6] << 8)) : C8_ALL_PAGES;
+    int pageCount = 0;
+    for (int i = 0; i < C8_PAGE_COUNT; i++)
+    {
+        pageCount += (pages >> i) & 1;
+    }
+    int packedSize = (pageCount * C8_PAGE_SIZE) + (rawSize - C8_STATE_V);
+
+    for (int i = 0; i < 8; i++)
+    {
+        hash |= (unsigned long long)data[8 + i] << (i * 8);
+    }
+
+    if (hash != machine->BootHash)
+    {
+        TraceLog(LOG_WARNING, "STATE: Snapshot was taken with a different ROM");
+        return false;
+    }
+
+    if (rle_decode(&data[C8_SNAPSHOT_HEADER_SIZE], size - C8_SNAPSHOT_HEADER_SIZE, packed, packedSize) != packedSize)
+    {
+        TraceLog(LOG_WARNING, "STATE: Snapshot is corrupt");
+        return false;
+    }
+
+    // Pages that were left out hadn't changed, i.e. XOR to zeros.
+    memset(raw, 0, C8_STATE_SIZE);
+    for (int i = 0, j = 0; i < C8_PAGE_COUNT; i++)
+    {
+        if (pages & (1u << i))
+        {
+            memcpy(&raw[C8_STATE_RAM + (i * C8_PAGE_SIZE)], &packed[j * C8_PAGE_SIZE], C8_PAGE_SIZE);
+            j++;
+        }
+    }
+    memcpy(&raw[C8_STATE_V], &packed[pageCount * C8_PAGE_SIZE], rawSize - C8_STATE_V);
+
+    for (int i = 0; i < rawSize; i++)
+    {
+        raw[i] ^= machine->BootState[i];
+    }
+
+    if (rawSize < C8_STATE_SIZE)
+    {
+        unsigned char current[C8_STATE_SIZE];
+        capture_state(machine, current);
+        memcpy(&raw[rawSize], &current[rawSize], C8_STATE_SIZE - rawSize);
+    }
+
+    // Nothing before version 4 could have been in the 128x64 mode.
+    if (data[4] < 4)
+    {
+        memset(&raw[C8_STATE_HIRES], 0, C8_STATE_FLAGS - C8_STATE_HIRES);
+    }
+
+    apply_state(machine, raw);
+
+    return true;
+}
+
+bool save_snapshot_file(C8_Machine *machine, const char *filename)
+{
+    unsigned char data[C8_SNAPSHOT_MAX_SIZE];
+    int size = save_snapshot(machine, data, sizeof(data));
+
+    if (size == 0 || !SaveFileData(filename, data, size))
+    {
+        TraceLog(LOG_WARNING, "STATE: [%s] Failed to save snapshot", filename);
+        return false;
+    }
+
+    TraceLog(LOG_INFO, "STATE: [%s] Saved snapshot (%i bytes)", filename, size);
+    return true;
+}
+
+bool load_snapshot_file(C8_Machine *machine, const char *filename)
+{
+    int size = 0;
+    unsigned char *data = LoadFileData(filename, &size);
+
+    if (data == NULL)
+    {
+        TraceLog(LOG_WARNING, "STATE: [%s] Failed to load snapshot", filename);
+        return false;
+    }
+
+    bool loaded = load_snapshot(machine, data, size);
+    UnloadFileData(data);
+
+    if (loaded)
+    {
+        TraceLog(LOG_INFO, "STATE: [%s] Loaded snapshot", filename);
+    }
+
+    return loaded;
+}
+
+//----------------------------------------------------------------------------------
+// Rewind
+//----------------------------------------------------------------------------------
+
+// Forgets all history, the current state becomes the first keyframe.
+void reset_rewind(C8_Machine *machine)
+{
+    C8_RewindHead = 0;
+    C8_RewindCount = 0;
+    C8_RewindArenaTail = 0;
+    C8_RewindSinceKeyframe = 0;
+
+    record_rewind_frame(machine);
+}
+
+// Drops the oldest entry and then any deltas that depended on it, so the new
+// oldest entry is a keyframe again.
+void drop_oldest_rewind_frames()
+{
+    do
+    {
+        C8_RewindHead = (C8_RewindHead + 1) % C8_REWIND_FRAMES;
+        C8_RewindCount--;
+    } 
+    while (C8_RewindCount > 0 && !C8_RewindEntries[C8_RewindHead].keyframe);
+}
+
+// Called once per 60Hz frame. Costs one capture, one XOR pass and one RLE pass
+// over the state then a copy into the arena - nothing is allocated.
+void record_rewind_frame(C8_Machine *machine)
+{
+    static unsigned char current[C8_STATE_SIZE];
+    static unsigned char diff[C8_STATE_SIZE];
+    static unsigned char encoded[C8_SNAPSHOT_MAX_SIZE];
+
+    bool keyframe = C8_RewindCount == 0 || C8_RewindSinceKeyframe >= C8_REWIND_KEYFRAME_INTERVAL - 1;
+    const unsigned char *against = keyframe ? machine->BootState : C8_RewindState;
+
+    capture_state(machine, current);
+    for (int i = 0; i < C8_STATE_SIZE; i++)
+    {
+        diff[i] = current[i] ^ against[i];
+    }
+
+    int size = rle_encode(diff, C8_STATE_SIZE, encoded, sizeof(encoded));
+
+    // Find room in the arena, wrapping round to the start rather than
+    // splitting an entry across the end, and push out whatever is in the way.
+    int offset = C8_RewindArenaTail;
+    if (offset + size > C8_REWIND_ARENA_SIZE)
+    {
+        offset = 0;
+    }
+
+    while (C8_RewindCount > 0)
+    {
+        C8_RewindEntry *oldest = &C8_RewindEntries[C8_RewindHead];
+        bool overlaps = oldest->offset < offset + size && offset < oldest->offset + oldest->size;
+
+        if (!overlaps && C8_RewindCount < C8_REWIND_FRAMES)
+        {
+            break;
+        }
+
+        drop_oldest_rewind_frames();
+    }
+
+    // If the history has just been emptied out then this has to be a keyframe
+    // after all.
+    if (C8_RewindCount == 0 && !keyframe)
+    {
+        C8_RewindSinceKeyframe = C8_REWIND_KEYFRAME_INTERVAL;
+        record_rewind_frame(machine);
+        return;
+    }
+
+    C8_RewindEntry *entry = &C8_RewindEntries[(C8_RewindHead + C8_RewindCount) % C8_REWIND_FRAMES];
+    entry->offset = offset;
+    entry->size = size;
+    entry->keyframe = keyframe;
+    memcpy(&C8_RewindArena[offset], encoded, size);
+
+    C8_RewindCount++;
+    C8_RewindArenaTail = offset + size;
+    C8_RewindSinceKeyframe = keyframe ? 0 : C8_RewindSinceKeyframe + 1;
+    memcpy(C8_RewindState, current, C8_STATE_SIZE);
+}
+
+// XORs an entry's (decoded) data into the given state.
+void apply_rewind_entry(C8_RewindEntry *entry, unsigned char *state)
+{
+    static unsigned char diff[C8_STATE_SIZE];
+
+    rle_decode(&C8_RewindArena[entry->offset], entry->size, diff, C8_STATE_SIZE);
+    for (int i = 0; i < C8_STATE_SIZE; i++)
+    {
+        state[i] ^= diff[i];
+    }
+}
+
+// Steps the machine back one frame. Returns false when there's nothing older.
+bool rewind_frame(C8_Machine *machine)
+{
+    if (C8_RewindCount <= 1)
+    {
+        return false;
+    }
+
+    int newest = (C8_RewindHead + C8_RewindCount - 1) % C8_REWIND_FRAMES;
+    C8_RewindEntry *entry = &C8_RewindEntries[newest];
+
+    if (!entry->keyframe)
+    {
+        // A delta is this frame XOR the one before, so XORing it back into 
+        // this frame gives the one before.
+        apply_rewind_entry(entry, C8_RewindState);
+        C8_RewindSinceKeyframe--;
+    }
+    else
+    {
+        // Going back past a keyframe means rebuilding the frame before it
+        // from the previous keyframe and all the deltas after that.
+        int index = (newest + C8_REWIND_FRAMES - 1) % C8_REWIND_FRAMES;
+        int since = 0;
+        
+        while (!C8_RewindEntries[index].keyframe)
+        {
+            index = (index + C8_REWIND_FRAMES - 1) % C8_REWIND_FRAMES;
+            since++;
+        }
+
+        memcpy(C8_RewindState, machine->BootState, C8_STATE_SIZE);
+        for (int i = 0; i <= since; i++)
+        {
+            apply_rewind_entry(&C8_RewindEntries[(index + i) % C8_REWIND_FRAMES], C8_RewindState);
+        }
+
+        C8_RewindSinceKeyframe = since;
+    }
+
+    C8_RewindCount--;
+    C8_RewindArenaTail = entry->offset;
+    apply_state(machine, C8_RewindState);
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------
+// Input Logs
+//----------------------------------------------------------------------------------
+
+// The keypad as one bit per key (key 0 in bit 0), the way it goes into the
+// state and the input logs. Any key that goes down is a press for a waiting
+// Fx0A, which picks it up on its next cycle.
+unsigned short get_key_mask(C8_Machine *machine)
+{
+    return machine->Keys;
+}
 
-    // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
-    instruction->y                  = (opcode & 0x00F0) >> 4;
+void set_key_mask(C8_Machine *machine, unsigned short keys)
+{
+    machine->KeyPresses |= keys & ~machine->Keys;
+    machine->Keys = keys;
+}
 
-    // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
-    instruction->kk                 = (opcode & 0x00FF);
+// Starts a new (empty) log for the machine as it is right now, with the keypad
+// as it is now as the first event.
+void begin_input_log(C8_InputLog *log, C8_Machine *machine, uint32_t seed)
+{
+    free_input_log(log);
+    log->seed = seed;
+    log->bootHash = machine->BootHash;
+    log->keys = get_key_mask(machine);
+    add_input_event(log, machine->Cycles, C8_INPUT_KEYS, log->keys);
 }
 
-void increment_program_counter(C8_Instruction *instruction)
+void add_input_event(C8_InputLog *log, long long cycle, unsigned char kind, unsigned short keys)
 {
-    if (instruction->skip > 0)
+    if (log->count == log->capacity)
     {
-        instruction->skip = 0;
+        int capacity = log->capacity > 0 ? log->capacity * 2 : 1024;
+        C8_InputEvent *events = realloc(log->events, capacity * sizeof(C8_InputEvent));
+        if (events == NULL)
+        {
+            TraceLog(LOG_WARNING, "INPUT: Out of memory, input log is incomplete");
+            return;
+        }
+
+        log->events = events;
+        log->capacity = capacity;
     }
-    else
+
+    log->events[log->count].cycle = cycle;
+    log->events[log->count].kind = kind;
+    log->events[log->count].keys = keys;
+    log->count++;
+}
+
+// Called after every read_input(), only adds an event when a key went up or down.
+void record_input(C8_InputLog *log, C8_Machine *machine)
+{
+    unsigned short keys = get_key_mask(machine);
+    if (keys != log->keys)
     {
-        C8_PC += 2;
+        log->keys = keys;
+        add_input_event(log, machine->Cycles, C8_INPUT_KEYS, keys);
     }
 }
 
-void load_rom()
+// The window ticks the timers off the wall clock rather than every so many
+// cycles, so the ticks have to go into the log too.
+void record_timer_tick(C8_InputLog *log, C8_Machine *machine)
 {
-    int i;
-    int filesize = 0;
-    unsigned char *filedata = LoadFileData(C8_FILENAME, &filesize);
+    add_input_event(log, machine->Cycles, C8_INPUT_TICK, log->keys);
+}
+
+// Input log header (all little-endian):
+//   0   4   magic "C8IN"
+//   4   1   version
+//   5   3   reserved (0)
+//   8   4   seed
+//   12  4   reserved (0)
+//   16  8   hash of RAM after the ROM was loaded
+//   24  8   cycles the session ran for
+//   32  ... events: 8 cycle, 1 kind, 2 keypad
+bool save_input_log(C8_InputLog *log, const char *filename)
+{
+    int size = C8_INPUT_HEADER_SIZE + (log->count * C8_INPUT_EVENT_SIZE);
+    unsigned char *data = calloc(size, 1);
+
+    if (data == NULL)
+    {
+        TraceLog(LOG_WARNING, "INPUT: [%s] Failed to save input log", filename);
+        return false;
+    }
+
+    memcpy(data, C8_INPUT_MAGIC, 4);
+    data[4] = C8_INPUT_VERSION;
+    for (int i = 0; i < 4; i++)
+    {
+        data[8 + i] = log->seed >> (i * 8);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        data[16 + i] = log->bootHash >> (i * 8);
+        data[24 + i] = (unsigned long long)log->cycles >> (i * 8);
+    }
 
-    if (filedata != NULL)
+    for (int i = 0; i < log->count; i++)
     {
-        TraceLog(LOG_INFO, "FILEIO: [$s] ROM data loaded %i bytes of data", C8_FILENAME, filesize);
-        for (i = 0; i < filesize; i++)
+        unsigned char *event = &data[C8_INPUT_HEADER_SIZE + (i * C8_INPUT_EVENT_SIZE)];
+        for (int j = 0; j < 8; j++)
         {
-            // Will convert the char to the int representation (note, the char code - not
-            // the digital representation of the char). Most Chip-8 programs start at 
-            // location 0x200 (512).
-            C8_RAM[C8_START + i] = filedata[i];
+            event[j] = (unsigned long long)log->events[i].cycle >> (j * 8);
         }
+        event[8]    = log->events[i].kind;
+        event[9]    = log->events[i].keys & 0xFF;
+        event[10]   = log->events[i].keys >> 8;
     }
-    else
+
+    bool saved = SaveFileData(filename, data, size);
+    free(data);
+
+    if (!saved)
     {
-        TraceLog(LOG_ERROR, "FILEIO: [%s] Failed to find ROM data", C8_FILENAME);
+        TraceLog(LOG_WARNING, "INPUT: [%s] Failed to save input log", filename);
+        return false;
     }
+
+    TraceLog(LOG_INFO, "INPUT: [%s] Saved %i events over %lld cycles", filename, log->count, log->cycles);
+    return true;
 }
 
-void render_buffer(int originX, int originY)
+// Reads a log back in, as long as it was recorded with the ROM that's loaded
+// into the machine.
+bool load_input_log(C8_InputLog *log, C8_Machine *machine, const char *filename)
 {
-    BeginDrawing();
+    int size = 0;
+    unsigned char *data = LoadFileData(filename, &size);
+    unsigned long long hash = 0;
+    unsigned long long cycles = 0;
 
-    ClearBackground(RAYWHITE);
+    free_input_log(log);
 
-    // Frame
+    if (data == NULL)
     {
-        int frameOriginX = originX - C8_PIXEL_WIDTH;
-        int frameOriginY = originY - C8_PIXEL_WIDTH;
-        int frameWidth = (C8_WIDTH * C8_PIXEL_WIDTH) + (C8_PIXEL_WIDTH * 2);
-        int frameHeight = (C8_HEIGHT * C8_PIXEL_HEIGHT) + (C8_PIXEL_WIDTH * 2);
-        DrawRectangle(frameOriginX, frameOriginY, frameWidth, frameHeight, DARKGRAY);
-    }    
+        TraceLog(LOG_WARNING, "INPUT: [%s] Failed to load input log", filename);
+        return false;
+    }
 
-    // Screen
+    if (size < C8_INPUT_HEADER_SIZE || memcmp(data, C8_INPUT_MAGIC, 4) != 0 || data[4] != C8_INPUT_VERSION ||
+        (size - C8_INPUT_HEADER_SIZE) % C8_INPUT_EVENT_SIZE != 0)
     {
-        for (int i = 0; i < C8_HEIGHT; i++)
+        TraceLog(LOG_WARNING, "INPUT: [%s] Not a raychip-8 input log", filename);
+        UnloadFileData(data);
+        return false;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        hash |= (unsigned long long)data[16 + i] << (i * 8);
+        cycles |= (unsigned long long)data[24 + i] << (i * 8);
+    }
+
+    if (hash != machine->BootHash)
+    {
+        TraceLog(LOG_WARNING, "INPUT: [%s] Input log was recorded with a different ROM", filename);
+        UnloadFileData(data);
+        return false;
+    }
+
+    log->seed = data[8] | (data[9] << 8) | (data[10] << 16) | ((uint32_t)data[11] << 24);
+    log->bootHash = hash;
+    log->cycles = (long long)cycles;
+
+    int count = (size - C8_INPUT_HEADER_SIZE) / C8_INPUT_EVENT_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned char *event = &data[C8_INPUT_HEADER_SIZE + (i * C8_INPUT_EVENT_SIZE)];
+        unsigned long long cycle = 0;
+        for (int j = 0; j < 8; j++)
         {
-            for (int j = 0; j < C8_WIDTH; j++)
-            {
-                int x = (j * C8_PIXEL_WIDTH) + originX;
-                int y = (i * C8_PIXEL_HEIGHT) + originY;
-                Color pixel_color = C8_Buffer[i][j] ? GREEN : BLACK;
-                DrawRectangle(x, y, C8_PIXEL_WIDTH, C8_PIXEL_HEIGHT, pixel_color);
-            }
-        }    
+            cycle |= (unsigned long long)event[j] << (j * 8);
+        }
+
+        add_input_event(log, (long long)cycle, event[8], event[9] | (event[10] << 8));
     }
 
-    EndDrawing();
+    UnloadFileData(data);
+    return true;
+}
+
+void free_input_log(C8_InputLog *log)
+{
+    free(log->events);
+    memset(log, 0, sizeof(C8_InputLog));
 }
 
-void read_input()
+// Runs the machine through the logged session again: up to each event's cycle,
+// then the keypad change or timer tick, right to the end of the session. As
+// long as it started in the same state with the same seed, it ends up exactly
+// where the session did. Returns the number of timer ticks.
+long long replay_input_log(C8_InputLog *log, C8_Machine *machine)
 {
-    // This should of course be replaced with a configurable mapping.
-    // I suspect that some kind of hashtable that marries the raylib key
-    // enum to the correct key - and then we can check the IsKeyDown
-    // for each.
-    C8_Keyboard[0x1] = IsKeyDown(KEY_ONE);
-    C8_Keyboard[0x2] = IsKeyDown(KEY_TWO);
-    C8_Keyboard[0x3] = IsKeyDown(KEY_THREE);
-    C8_Keyboard[0xC] = IsKeyDown(KEY_FOUR);
+    long long start = machine->Cycles;
+    long long frames = 0;
 
-    C8_Keyboard[0x4] = IsKeyDown(KEY_Q);
-    C8_Keyboard[0x5] = IsKeyDown(KEY_W);
-    C8_Keyboard[0x6] = IsKeyDown(KEY_E);
-    C8_Keyboard[0xD] = IsKeyDown(KEY_R);
+    for (int i = 0; i <= log->count; i++)
+    {
+        long long target = start + (i < log->count ? log->events[i].cycle : log->cycles);
 
-    C8_Keyboard[0x7] = IsKeyDown(KEY_A);
-    C8_Keyboard[0x8] = IsKeyDown(KEY_S);
-    C8_Keyboard[0x9] = IsKeyDown(KEY_D);
-    C8_Keyboard[0xE] = IsKeyDown(KEY_F);
+        while (machine->Cycles < target)
+        {
+            long long count = target - machine->Cycles;
+            run_cycles(machine, count < C8_CLOCK_SPEED ? (int)count : C8_CLOCK_SPEED);
+        }
 
-    C8_Keyboard[0xA] = IsKeyDown(KEY_Z);
-    C8_Keyboard[0x0] = IsKeyDown(KEY_X);
-    C8_Keyboard[0xB] = IsKeyDown(KEY_C);
-    C8_Keyboard[0xF] = IsKeyDown(KEY_V);
-}
+        if (i == log->count)
+        {
+            break;
+        }
 
-void load_hexfont_sprites()
-{
-    // Programs may also refer to a group of sprites representing the 
-    // hexadecimal digits 0 through F. These sprites are 5 bytes long, 
-    // or 8x5 pixels. The data should be stored in the interpreter 
-    // area of Chip-8 memory (0x000 to 0x1FF). Below is a listing of 
-    // each character's bytes, in binary and hexadecimal:
-    
-    C8_RAM[C8_FONT_0_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_0_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_0_ADDR + 2] = 0x90;              // *  *
-    C8_RAM[C8_FONT_0_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_0_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_1_ADDR] = 0x20;                  //   * 
-    C8_RAM[C8_FONT_1_ADDR + 1] = 0x60;              //  ** 
-    C8_RAM[C8_FONT_1_ADDR + 2] = 0x20;              //   * 
-    C8_RAM[C8_FONT_1_ADDR + 3] = 0x20;              //   * 
-    C8_RAM[C8_FONT_1_ADDR + 4] = 0x70;              //  ***
-    
-    C8_RAM[C8_FONT_2_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_2_ADDR + 1] = 0x10;              //    *
-    C8_RAM[C8_FONT_2_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_2_ADDR + 3] = 0x80;              // *   
-    C8_RAM[C8_FONT_2_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_3_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_3_ADDR + 1] = 0x10;              //    *
-    C8_RAM[C8_FONT_3_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_3_ADDR + 3] = 0x10;              //    *
-    C8_RAM[C8_FONT_3_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_4_ADDR] = 0x90;                  // *  *
-    C8_RAM[C8_FONT_4_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_4_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_4_ADDR + 3] = 0x10;              //    *
-    C8_RAM[C8_FONT_4_ADDR + 4] = 0x10;              //    *
-    
-    C8_RAM[C8_FONT_5_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_5_ADDR + 1] = 0x80;              // *   
-    C8_RAM[C8_FONT_5_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_5_ADDR + 3] = 0x10;              //    *
-    C8_RAM[C8_FONT_5_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_6_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_6_ADDR + 1] = 0x80;              // *   
-    C8_RAM[C8_FONT_6_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_6_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_6_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_7_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_7_ADDR + 1] = 0x10;              //    *
-    C8_RAM[C8_FONT_7_ADDR + 2] = 0x20;              //   * 
-    C8_RAM[C8_FONT_7_ADDR + 3] = 0x40;              //  *  
-    C8_RAM[C8_FONT_7_ADDR + 4] = 0x40;              //  *  
-    
-    C8_RAM[C8_FONT_8_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_8_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_8_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_8_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_8_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_9_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_9_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_9_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_9_ADDR + 3] = 0x10;              //    *
-    C8_RAM[C8_FONT_9_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_A_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_A_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_A_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_A_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_A_ADDR + 4] = 0x90;              // *  *
-    
-    C8_RAM[C8_FONT_B_ADDR] = 0xE0;                  // *** 
-    C8_RAM[C8_FONT_B_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_B_ADDR + 2] = 0xE0;              // *** 
-    C8_RAM[C8_FONT_B_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_B_ADDR + 4] = 0xE0;              // *** 
-    
-    C8_RAM[C8_FONT_C_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_C_ADDR + 1] = 0x80;              // *   
-    C8_RAM[C8_FONT_C_ADDR + 2] = 0x80;              // *   
-    C8_RAM[C8_FONT_C_ADDR + 3] = 0x80;              // *   
-    C8_RAM[C8_FONT_C_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_D_ADDR] = 0xE0;                  // *** 
-    C8_RAM[C8_FONT_D_ADDR + 1] = 0x90;              // *  *
-    C8_RAM[C8_FONT_D_ADDR + 2] = 0x90;              // *  *
-    C8_RAM[C8_FONT_D_ADDR + 3] = 0x90;              // *  *
-    C8_RAM[C8_FONT_D_ADDR + 4] = 0xE0;              // *** 
-    
-    C8_RAM[C8_FONT_E_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_E_ADDR + 1] = 0x80;              // *   
-    C8_RAM[C8_FONT_E_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_E_ADDR + 3] = 0x80;              // *   
-    C8_RAM[C8_FONT_E_ADDR + 4] = 0xF0;              // ****
-    
-    C8_RAM[C8_FONT_F_ADDR] = 0xF0;                  // ****
-    C8_RAM[C8_FONT_F_ADDR + 1] = 0x80;              // *   
-    C8_RAM[C8_FONT_F_ADDR + 2] = 0xF0;              // ****
-    C8_RAM[C8_FONT_F_ADDR + 3] = 0x80;              // *   
-    C8_RAM[C8_FONT_F_ADDR + 4] = 0x80;              // *   
+        if (log->events[i].kind == C8_INPUT_TICK)
+        {
+            update_timers(machine);
+            frames++;
+        }
+        else
+        {
+            set_key_mask(machine, log->events[i].keys);
+        }
+    }
+
+    return frames;
 }
 
 //----------------------------------------------------------------------------------
 // Follows the Chip-8 Instruction Set Functions
 //----------------------------------------------------------------------------------
 
+// The instructions that the platforms don't agree on are written once, as an
+// inline function with the quirk as a parameter, and then built twice: once
+// with it off and once with it on. It's a constant in each, so the check
+// folds away and neither handler pays anything for the other.
+#define C8_QUIRK_HANDLERS(name, variant, function)                              \
+    void C8_##name(C8_Machine *machine, C8_Instruction *instruction)            \
+    {                                                                           \
+        function(machine, instruction, false);                                  \
+    }                                                                           \
+    void C8_##variant(C8_Machine *machine, C8_Instruction *instruction)         \
+    {                                                                           \
+        function(machine, instruction, true);                                   \
+    }
+
 // Jump to a machine code routine at nnn.
 // This instruction is only used on the old computers on which the Chip-8
 // was originally implemented. It is ignored by modern interpreters.
-void C8_SYS_ADDR(C8_Instruction *instruction)
+void C8_SYS_ADDR(C8_Machine *machine, C8_Instruction *instruction)
 {
 
 }
 
 // Clear the display.
-void C8_CLS(C8_Instruction *instruction)
+// (In the 128x64 mode it's that display that's cleared.)
+void C8_CLS(C8_Machine *machine, C8_Instruction *instruction)
 {
-    memset(&C8_Buffer, false, sizeof(C8_Buffer));
+    if (machine->HighRes)
+    {
+        memset(machine->HiresBuffer, 0, sizeof(machine->HiresBuffer));
+    }
+    else
+    {
+        memset(machine->Buffer, 0, sizeof(machine->Buffer));
+    }
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
 }
 
 // Return from a subroutine.
 // The interpreter sets the program counter to the address at the top of 
 // the stack, then subtracts 1 from the stack pointer.
-void C8_RET(C8_Instruction *instruction)
+void C8_RET(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_SP -= 1;
+    machine->SP -= 1;
 
     // So, I guess we should handle this manually like in C8_CALL_ADDR?
     // If the stack pointer drops below zero, it will wrap-around back
@@ -606,26 +7020,26 @@ void C8_RET(C8_Instruction *instruction)
     // and we'll potentially open ourselves up writing memory out of bounds?
     // So, if the decrement of the pointer wraps around taking us back 
     // over the stack size, then adjust again?
-    if (C8_SP >= C8_STACK_SIZE)
+    if (machine->SP >= C8_STACK_SIZE)
     {
-        C8_SP -= C8_STACK_SIZE;
+        machine->SP -= C8_STACK_SIZE;
     }
 
-    C8_PC = C8_STACK[C8_SP];
+    machine->PC = machine->STACK[machine->SP];
 }
 
 // Jump to location nnn.
 // The interpreter sets the program counter to nnn.
-void C8_JP_ADDR(C8_Instruction *instruction)
+void C8_JP_ADDR(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_PC = instruction->addr;
+    machine->PC = instruction->addr;
     instruction->skip = 1;
 }
 
 // Call subroutine at nnn.
 // The interpreter increments the stack pointer, then puts the current
 // PC on top of the stack. The PC is then set to nnn.
-void C8_CALL_ADDR(C8_Instruction *instruction)
+void C8_CALL_ADDR(C8_Machine *machine, C8_Instruction *instruction)
 {
     // We're incrementing this value by 1 - but the data type behind
     // it can go past the stack size of 16 significantly. This causes
@@ -636,71 +7050,71 @@ void C8_CALL_ADDR(C8_Instruction *instruction)
     // because game code shouldn't allow the stack to go beyond 16 
     // levels of depth, right? But, I want to handle it (perhaps making
     // a different bug!)
-    C8_STACK[C8_SP] = C8_PC;
+    machine->STACK[machine->SP] = machine->PC;
 
-    C8_SP += 1;
-    if (C8_SP >= C8_STACK_SIZE)
+    machine->SP += 1;
+    if (machine->SP >= C8_STACK_SIZE)
     {
-        C8_SP -= C8_STACK_SIZE;
+        machine->SP -= C8_STACK_SIZE;
     }
     
-    C8_PC = instruction->addr;
+    machine->PC = instruction->addr;
     instruction->skip = 1;
 }
 
 // Skip next instruction if Vx = kk.
 // The interpreter compares register Vx to kk, and if they are equal,
 // increments the program counter by 2.
-void C8_SE_VX_BYTE(C8_Instruction *instruction)
+void C8_SE_VX_BYTE(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (C8_V[instruction->x] == instruction->kk)
+    if (machine->V[instruction->x] == instruction->kk)
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Skip next instruction if Vx != kk.
 // The interpreter compares register Vx to kk, and if they are not
 // equal, increments the program counter by 2.
-void C8_SNE_VX_BYTE(C8_Instruction *instruction)
+void C8_SNE_VX_BYTE(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (C8_V[instruction->x] != instruction->kk)
+    if (machine->V[instruction->x] != instruction->kk)
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Skip next instruction if Vx = Vy.
 // The interpreter compares register Vx to register Vy, and if they
 // are equal, increments the program counter by 2
-void C8_SE_VX_VY(C8_Instruction *instruction)
+void C8_SE_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (C8_V[instruction->x] == C8_V[instruction->y])
+    if (machine->V[instruction->x] == machine->V[instruction->y])
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Set Vx = kk.
 // The interpreter puts the value kk into register Vx.
-void C8_LD_VX_BYTE(C8_Instruction *instruction)
+void C8_LD_VX_BYTE(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_V[instruction->x] = instruction->kk;
+    machine->V[instruction->x] = instruction->kk;
 }
 
 // Set Vx = Vx + kk.
 // Adds the value of kk to the value of register Vx, then stores the
 // result in Vx.
-void C8_ADD_VX_BYTE(C8_Instruction *instruction)
+void C8_ADD_VX_BYTE(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_V[instruction->x] = C8_V[instruction->x] + instruction->kk;
+    machine->V[instruction->x] = machine->V[instruction->x] + instruction->kk;
 }
 
 // Set Vx = Vy.
 // Stores the value of register Vy in register Vx.
-void C8_LD_VX_VY(C8_Instruction *instruction)
+void C8_LD_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_V[instruction->x] = C8_V[instruction->y];
+    machine->V[instruction->x] = machine->V[instruction->y];
 }
 
 // Set Vx = Vx OR Vy.
@@ -708,133 +7122,252 @@ void C8_LD_VX_VY(C8_Instruction *instruction)
 // result in Vx. A bitwise OR compares the corresponding bits from two
 // values, and if either bit is 1, then the same bit in the result is
 // also 1. Otherwise, it is 0.
-void C8_OR_VX_VY(C8_Instruction *instruction)
+// (The COSMAC VIP did these three in machine code that left VF at zero.)
+static inline void or_vx_vy(C8_Machine *machine, C8_Instruction *instruction, bool resetVF)
 {
-    C8_V[instruction->x] = C8_V[instruction->x] | C8_V[instruction->y];
+    machine->V[instruction->x] = machine->V[instruction->x] | machine->V[instruction->y];
+
+    if (resetVF)
+    {
+        machine->V[C8_VF] = 0;
+    }
 }
 
+C8_QUIRK_HANDLERS(OR_VX_VY, OR_VX_VY_RESET_VF, or_vx_vy)
+
 // Set Vx = Vx AND Vy.
 // Performs a bitwise AND on the values of Vx and Vy, then stores the
 // result in Vx. A bitwise AND compers the corresponding bits from two
 // values, and if both bits are 1, then the same bit in the result is 
 // also 1. Otherwise, it is 0.
-void C8_AND_VX_VY(C8_Instruction *instruction)
+static inline void and_vx_vy(C8_Machine *machine, C8_Instruction *instruction, bool resetVF)
 {
-    C8_V[instruction->x] = C8_V[instruction->x] & C8_V[instruction->y];
+    machine->V[instruction->x] = machine->V[instruction->x] & machine->V[instruction->y];
+
+    if (resetVF)
+    {
+        machine->V[C8_VF] = 0;
+    }
 }
 
+C8_QUIRK_HANDLERS(AND_VX_VY, AND_VX_VY_RESET_VF, and_vx_vy)
+
 // Set Vx = Vx XOR Vy.
 // Performs a bitwise exclusiv OR on the values of Vx and Vy, then stores
 // the result in Vx. An exclusive OR compares the corresponding bits from
 // two values, and if the bits are not both the same, then the corresponding
 // bit in the result is set to 1. Otherwise, it is 0.
-void C8_XOR_VX_VY(C8_Instruction *instruction)
+static inline void xor_vx_vy(C8_Machine *machine, C8_Instruction *instruction, bool resetVF)
 {
-    C8_V[instruction->x] = C8_V[instruction->x] ^ C8_V[instruction->y];
+    machine->V[instruction->x] = machine->V[instruction->x] ^ machine->V[instruction->y];
+
+    if (resetVF)
+    {
+        machine->V[C8_VF] = 0;
+    }
 }
 
+C8_QUIRK_HANDLERS(XOR_VX_VY, XOR_VX_VY_RESET_VF, xor_vx_vy)
+
 // Set Vx = Vx + Vy, set VF = carry.
 // The values of Vx and Vy are added together. If the result is greater
 // than 8 bits (i.e., > 255) VF is set to 1, otherwise 0. Only the lowest
 // 8 bits of the result are kept, and stored in Vx.
-void C8_ADD_VX_VY(C8_Instruction *instruction)
+void C8_ADD_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_V[instruction->x] += C8_V[instruction->y];
+    machine->V[instruction->x] += machine->V[instruction->y];
 
     // If the new value of vx is less than one of the sides of the addition
     // then our unsigned char has wrapped around and we can set the carry.
-    C8_V[C8_VF] = C8_V[instruction->x] < C8_V[instruction->y];
+    machine->V[C8_VF] = machine->V[instruction->x] < machine->V[instruction->y];
 }
 
 // Set Vx = Vx - Vy, set VF = NOT borrow.
 // If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted 
 // from Vx, and the result stored in Vx.
-void C8_SUB_VX_VY(C8_Instruction *instruction)
+void C8_SUB_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
     unsigned char borrow = 0;
-    if (C8_V[instruction->x] >= C8_V[instruction->y])
+    if (machine->V[instruction->x] >= machine->V[instruction->y])
     {
         borrow = 1;
     }
 
-    unsigned char vx = C8_V[instruction->x] - C8_V[instruction->y];
+    unsigned char vx = machine->V[instruction->x] - machine->V[instruction->y];
     
-    C8_V[instruction->x] = vx;
-    C8_V[C8_VF] = borrow;
+    machine->V[instruction->x] = vx;
+    machine->V[C8_VF] = borrow;
 }
 
 // Set Vx = Vx SHR 1.
 // If the least-significant bit of Vx is 1, then VF is set to 1, otherwise
 // 0. Then Vx is divided by 2.
-void C8_SHR_VX_VY(C8_Instruction *instruction)
+// (On the COSMAC VIP, and in XO-CHIP, it's Vx = Vy SHR 1.)
+static inline void shr_vx_vy(C8_Machine *machine, C8_Instruction *instruction, bool shiftVy)
 {
-    // TODO I think this will work but I wonder if there is a bitwise 
-    // operation that will work better.
-    unsigned char vf = C8_V[instruction->x] % 2;
-    C8_V[instruction->x] = C8_V[instruction->x] / 2;
-    C8_V[C8_VF] = vf;
+    unsigned char value = machine->V[shiftVy ? instruction->y : instruction->x];
+    machine->V[instruction->x] = value >> 1;
+    machine->V[C8_VF] = value & 1;
 }
 
+C8_QUIRK_HANDLERS(SHR_VX_VY, SHR_VX_VY_SHIFT_VY, shr_vx_vy)
+
 // Set Vx = Vy - Vx, set VF = NOT borrow.
 // If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted
 // from Vy, and the results are stored in Vx.
-void C8_SUBN_VX_VY(C8_Instruction *instruction)
+void C8_SUBN_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
     unsigned char borrow = 0;
-    if (C8_V[instruction->y] >= C8_V[instruction->x])
+    if (machine->V[instruction->y] >= machine->V[instruction->x])
     {
         borrow = 1;
     }
 
-    unsigned char vx = C8_V[instruction->y] - C8_V[instruction->x];
+    unsigned char vx = machine->V[instruction->y] - machine->V[instruction->x];
     
-    C8_V[instruction->x] = vx;
-    C8_V[C8_VF] = borrow;
+    machine->V[instruction->x] = vx;
+    machine->V[C8_VF] = borrow;
 }
 
 // Set Vx = Vx SHL 1.
 // If the most-significant bit of Vx is 1, then VF is set to 1 otherwise 0.
 // Then Vx is multiplied by 2.
-void C8_SHL_VX_VY(C8_Instruction *instruction)
-{    
-    unsigned char vf = C8_V[instruction->x] > 128;
-    C8_V[instruction->x] = C8_V[instruction->x] * 2;
-    C8_V[C8_VF] = vf;
+// (Vy SHL 1 on the same platforms as SHR.)
+static inline void shl_vx_vy(C8_Machine *machine, C8_Instruction *instruction, bool shiftVy)
+{
+    unsigned char value = machine->V[shiftVy ? instruction->y : instruction->x];
+    machine->V[instruction->x] = value << 1;
+    machine->V[C8_VF] = value >> 7;
 }
 
+C8_QUIRK_HANDLERS(SHL_VX_VY, SHL_VX_VY_SHIFT_VY, shl_vx_vy)
+
 // Skip next instruction if Vx != Vy.
 // The values of Vx and Vy are compared, and if they are not equal, the
 // program counter is increased by 2.
-void C8_SNE_VX_VY(C8_Instruction *instruction)
+void C8_SNE_VX_VY(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (C8_V[instruction->x] != C8_V[instruction->y])
+    if (machine->V[instruction->x] != machine->V[instruction->y])
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Set I = nnn.
 // The value of register I is set to nnn.
-void C8_LD_I_ADDR(C8_Instruction *instruction)
+void C8_LD_I_ADDR(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_I = instruction->addr;
+    machine->I = instruction->addr;
 }
 
 // Jump to location nnn + V0.
 // The program counter is set to nnn plus the value of V0.
-void C8_JP_V0_ADDR(C8_Instruction *instruction)
+// (SUPER-CHIP got this wrong and added Vx, the top digit of nnn, instead,
+// so its ROMs expect it. Bxnn.)
+static inline void jp_v0_addr(C8_Machine *machine, C8_Instruction *instruction, bool jumpVx)
 {
-    C8_PC = instruction->addr + C8_V[C8_V0];
+    machine->PC = instruction->addr + machine->V[jumpVx ? instruction->x : C8_V0];
+    instruction->skip = 1;
 }
 
+C8_QUIRK_HANDLERS(JP_V0_ADDR, JP_VX_ADDR, jp_v0_addr)
+
 // Set Vx = random byte and kk.
 // The interpreter generates a random number from 0 to 255, which
 // is then ANDed with the value kk. The results are stored in Vx.
 // See instruction C8_AND_VX_VY for more information on AND.
-void C8_RND_VX_BYTE(C8_Instruction *instruction)
+void C8_RND_VX_BYTE(C8_Machine *machine, C8_Instruction *instruction)
+{
+    uint32_t random = machine->Random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    machine->Random = random;
+
+    // The top bits of xorshift are the better ones.
+    unsigned char n = random >> 24;
+    machine->V[instruction->x] = n & instruction->kk;
+}
+
+// Shift one 128-bit row of the 128x64 display (most significant word first)
+// right or left by n pixels, 0-127, with zeros shifted in. The 128x64 sprites
+// below are moved into place with these, and SUPER-CHIP's scrolls use them too.
+static inline void shift_row_right(uint64_t row[2], int n)
+{
+    if (n >= 64)
+    {
+        row[1] = row[0] >> (n - 64);
+        row[0] = 0;
+    }
+    else if (n > 0)
+    {
+        row[1] = (row[1] >> n) | (row[0] << (64 - n));
+        row[0] = row[0] >> n;
+    }
+}
+
+static inline void shift_row_left(uint64_t row[2], int n)
 {
-    unsigned char n = GetRandomValue(0, 255);
-    C8_V[instruction->x] = n & instruction->kk;
+    if (n >= 64)
+    {
+        row[0] = row[1] << (n - 64);
+        row[1] = 0;
+    }
+    else if (n > 0)
+    {
+        row[0] = (row[0] << n) | (row[1] >> (64 - n));
+        row[1] = row[1] << n;
+    }
+}
+
+// Dxyn in the 128x64 mode. The same as below, only with two words a row, and
+// Dxy0 draws a 16x16 sprite (two bytes a row, 32 in all) rather than nothing.
+static inline void drw_hires(C8_Machine *machine, C8_Instruction *instruction, bool clip)
+{
+    int xpos = machine->V[instruction->x] % C8_HIRES_WIDTH;
+    int ypos = machine->V[instruction->y] % C8_HIRES_HEIGHT;
+    int width = instruction->n == 0 ? 2 : 1;
+    int height = instruction->n == 0 ? 16 : instruction->n;
+    uint64_t collision = 0;
+
+    for (int y = 0; y < height; y++)
+    {
+        if (clip && ypos + y >= C8_HIRES_HEIGHT)
+        {
+            break;
+        }
+
+        uint64_t bits = read_ram(machine, machine->I + (y * width));
+        if (width == 2)
+        {
+            bits = (bits << 8) | read_ram(machine, machine->I + (y * 2) + 1);
+        }
+
+        // Lined up with the left edge again, then moved into place. Wrapping
+        // is whatever fell off the right shifted back in from the left.
+        uint64_t sprite[2] = { bits << (64 - (width * 8)), 0 };
+        uint64_t wrapped[2] = { sprite[0], 0 };
+        shift_row_right(sprite, xpos);
+        if (!clip && xpos > 0)
+        {
+            shift_row_left(wrapped, C8_HIRES_WIDTH - xpos);
+            sprite[0] |= wrapped[0];
+            sprite[1] |= wrapped[1];
+        }
+
+        uint64_t *row = machine->HiresBuffer[(ypos + y) % C8_HIRES_HEIGHT];
+        collision |= (row[0] & sprite[0]) | (row[1] & sprite[1]);
+        row[0] ^= sprite[0];
+        row[1] ^= sprite[1];
+
+        if ((sprite[0] | sprite[1]) != 0)
+        {
+            machine->DirtyRows |= 1u << (((ypos + y) % C8_HIRES_HEIGHT) >> 1);
+        }
+    }
+
+    machine->V[C8_VF] = collision != 0;
+    machine->DisplayChanged |= machine->DirtyRows != 0;
 }
 
 // Display n-byte sprite starting at memory location I at (Vx, Vy), set 
@@ -847,183 +7380,363 @@ void C8_RND_VX_BYTE(C8_Instruction *instruction)
 // display, it wraps around to the opposite side of the screen. See instruction
 // C8_XOR_VX_VY for more information on XOR, and secion 2.4, Display, for
 // more information on the Chip-8 screen and sprites.
-void C8_DRW_VX_VY_NIBBLE(C8_Instruction *instruction)
+// (Everything but XO-CHIP clips sprites at the edges instead, only where they
+// start from wraps.)
+static inline void drw_vx_vy_nibble(C8_Machine *machine, C8_Instruction *instruction, bool clip)
 {    
-    // Reset the collision flag.
-    C8_V[C8_VF] = 0;
+    if (machine->HighRes)
+    {
+        drw_hires(machine, instruction, clip);
+        return;
+    }
+
+    // The starting position wraps, so e.g. x = 70 is the same as x = 6.
+    unsigned char xpos = machine->V[instruction->x] % C8_WIDTH;
+    unsigned char ypos = machine->V[instruction->y] % C8_HEIGHT;
+    uint64_t collision = 0;
 
     // The "height" of the pixel (aka number of bytes is the value of nibble)
     for (unsigned char y = 0; y < instruction->n; y++)
     {        
-        unsigned char ypos = C8_V[instruction->y] + y;
-
-        // Vertical wrapping.
-        if (ypos >= C8_HEIGHT)
+        if (clip && ypos + y >= C8_HEIGHT)
         {
-            ypos -= C8_HEIGHT;
+            break;
         }
 
         // Just read the byte of sprite data from memory directly instead.
-        unsigned char byte = C8_RAM[C8_I + y];
-
-        // The "width" of the pixel is the number of bits in a byte.
-        for (unsigned char x = 0; x < 8; x++)
+        unsigned char byte = read_ram(machine, machine->I + y);
+
+        // Line the byte up with the left edge of the row, then rotate it right
+        // into position - anything that falls off the right hand side comes 
+        // back round on the left (horizontal wrapping) for free. Or shift it,
+        // and whatever falls off is gone.
+        uint64_t sprite = (uint64_t)byte << (C8_WIDTH - 8);
+        if (clip)
         {
-            unsigned char xpos = C8_V[instruction->x] + x;
-            
-            // Horizontal wrapping.
-            if (xpos >= C8_WIDTH)
-            {
-                xpos -= C8_WIDTH;
-            }
+            sprite = sprite >> xpos;
+        }
+        else
+        {
+            sprite = (sprite >> xpos) | (sprite << ((C8_WIDTH - xpos) & (C8_WIDTH - 1)));
+        }
 
-            // Is the bit at 7-x set?
-            if ((byte >> (7 - x)) & 1)
-            {
-                // Collision detection!
-                if (C8_Buffer[ypos][xpos] == 1)
-                {
-                    // Don't overwrite it like last time! :)
-                    C8_V[C8_VF] = 1;
-                }
+        // Vertical wrapping.
+        unsigned char row = (ypos + y) % C8_HEIGHT;
 
-                // Now xor the bit into the buffer (i.e. clear if there
-                // is already a bit there).
-                C8_Buffer[ypos][xpos] ^= 1;
-            }
+        // Collision detection! Any bit that is set in both is about to be 
+        // erased. Then xor the whole sprite row into the buffer at once.
+        collision |= machine->Buffer[row] & sprite;
+        machine->Buffer[row] ^= sprite;
+
+        if (sprite != 0)
+        {
+            machine->DirtyRows |= 1u << row;
         }
     }
+
+    machine->V[C8_VF] = collision != 0;
+    machine->DisplayChanged |= machine->DirtyRows != 0;
 }
 
+C8_QUIRK_HANDLERS(DRW_VX_VY_NIBBLE, DRW_VX_VY_NIBBLE_CLIP, drw_vx_vy_nibble)
+
 // Skip next instruction if key with the value of Vx is pressed.
 // Checks the keyboard, and if the key corresponding to the value of Vx is 
 // currently in the down position, PC is increased by 2.
-void C8_SKP_VX(C8_Instruction *instruction)
+// (Only the low nibble of Vx counts, like on the VIP.)
+void C8_SKP_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (C8_Keyboard[C8_V[instruction->x]])
+    if ((machine->Keys >> (machine->V[instruction->x] & 0xF)) & 1)
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Skip next instruction if key with the value of Vx is not pressed.
 // Checks the keyboard, and if the key corresponding to the value of Vx
 // is currently in the up position, PC is increased by 2.
-void C8_SKNP_VX(C8_Instruction *instruction)
+void C8_SKNP_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    if (!C8_Keyboard[C8_V[instruction->x]])
+    if (((machine->Keys >> (machine->V[instruction->x] & 0xF)) & 1) == 0)
     {
-        increment_program_counter(instruction);
+        increment_program_counter(machine, instruction);
     }
 }
 
 // Set Vx = delay timer value.
 // The value of DT is placed into Vx.
-void C8_LD_VX_DT(C8_Instruction *instruction)
+void C8_LD_VX_DT(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_V[instruction->x] = C8_DT;
+    machine->V[instruction->x] = machine->DT;
 }
 
 // Wait for a key press, store the value of the key in Vx.
 // All execution stops until a key is pressed, then the value of that
 // key is stored in Vx.
-void C8_LD_VX_K(C8_Instruction *instruction)
+// Keys that were already down when it started don't count until they've been
+// let go and pressed again. If more than one went down at once, the lowest wins.
+void C8_LD_VX_K(C8_Machine *machine, C8_Instruction *instruction)
 {
-    instruction->skip = 1;
+    if (!machine->WaitingForKey)
+    {
+        machine->WaitingForKey = true;
+        machine->KeyPresses = 0;
+    }
+
+    if (machine->KeyPresses == 0)
+    {
+        instruction->skip = 1;
+        return;
+    }
+
+    int key = 0;
+    while (((machine->KeyPresses >> key) & 1) == 0)
+    {
+        key++;
+    }
+
+    machine->V[instruction->x] = key;
+    machine->WaitingForKey = false;
+    machine->KeyPresses = 0;
 }
 
 // Set delay timer = Vx.
 // DT is set equal to the value of Vx.
-void C8_LD_DT_VX(C8_Instruction *instruction)
+void C8_LD_DT_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_DT = C8_V[instruction->x];
+    machine->DT = machine->V[instruction->x];
 }
 
 // Set sound timer = Vx.
 // ST is set equal to the value of Vx.
-void C8_LD_ST_VX(C8_Instruction *instruction)
+void C8_LD_ST_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_ST = C8_V[instruction->x];
+    machine->ST = machine->V[instruction->x];
 }
 
 // Set I = I + Vx.
 // The values of I and Vx are added, and the results are stored in I.
-void C8_ADD_I_VX(C8_Instruction *instruction)
+void C8_ADD_I_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_I = C8_I + C8_V[instruction->x];
+    machine->I = machine->I + machine->V[instruction->x];
 }
 
 // Set I = location of sprite for digit Vx.
 // The value of I is set to the location for the hexedecimal sprite
 // corresponding to the value of Vx. See section 2.4, Display, for more 
 // information on the Chip-8 hexedecimal font.
-void C8_LD_F_VX(C8_Instruction *instruction)
+void C8_LD_F_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    C8_I = C8_V[instruction->x];
+    machine->I = machine->V[instruction->x];
 }
 
 // Store BCD represnetation of Vx in memory locations I, I+1, and I+2.
 // The interpreter takes the decimal value of Vx, and places the hundreds
 // digit in memory at location in I, the tens digit at location I+1, and
 // the ones digit at location I+2.
-void C8_LD_B_VX(C8_Instruction *instruction)
+void C8_LD_B_VX(C8_Machine *machine, C8_Instruction *instruction)
 {
-    unsigned char vx    = C8_V[instruction->x];
-    C8_RAM[C8_I]        = vx / 100;
-    C8_RAM[C8_I + 1]    = (vx / 10) % 10;
-    C8_RAM[C8_I + 2]    = vx % 10;
+    unsigned char vx    = machine->V[instruction->x];
+    write_ram(machine, machine->I, vx / 100);
+    write_ram(machine, machine->I + 1, (vx / 10) % 10);
+    write_ram(machine, machine->I + 2, vx % 10);
+
+    invalidate_decode_cache(machine, machine->I, 3);
 }
 
 // Store registers V0 through Vx in memory starting at location I.
 // The interpreter copiues the values of registers V0 through Vx into
 // memory, starting at the address in I.
-void C8_LD_I_VX(C8_Instruction *instruction)
+// (The COSMAC VIP incremented I as it went, so it ends up at I + x + 1, and
+// XO-CHIP does the same.)
+static inline void ld_i_vx(C8_Machine *machine, C8_Instruction *instruction, bool moveI)
 {
     for (int i = C8_V0; i <= instruction->x; i++)
     {
-        C8_RAM[C8_I + i] = C8_V[i];
+        write_ram(machine, machine->I + i, machine->V[i]);
+    }
+
+    invalidate_decode_cache(machine, machine->I, instruction->x + 1);
+
+    if (moveI)
+    {
+        machine->I += instruction->x + 1;
     }
 }
 
+C8_QUIRK_HANDLERS(LD_I_VX, LD_I_VX_MOVE_I, ld_i_vx)
+
 // Read registers V0 through Vx from memory starting at location I.
 // The interpreter reads values from memory starting at location I
 // into registers V0 through Vx.
-void C8_LD_VX_I(C8_Instruction *instruction)
+// (And the same again for I.)
+static inline void ld_vx_i(C8_Machine *machine, C8_Instruction *instruction, bool moveI)
 {
     int i;
     for (i = C8_V0; i <= instruction->x; i++)
     {
-        C8_V[i] = C8_RAM[C8_I + i];
+        machine->V[i] = read_ram(machine, machine->I + i);
+    }
+
+    if (moveI)
+    {
+        machine->I += instruction->x + 1;
+    }
+}
+
+C8_QUIRK_HANDLERS(LD_VX_I, LD_VX_I_MOVE_I, ld_vx_i)
+
+// The SUPER-CHIP instructions, only in the tables for the profiles that have
+// them (see C8_QUIRKS_LIST). The scrolls are in pixels of whichever mode the
+// display is in, as on SUPER-CHIP 1.1's successors rather than 1.1 itself
+// (which scrolled the 64x32 mode by half as much).
+
+// Scroll the display down n lines.
+void C8_SCD_NIBBLE(C8_Machine *machine, C8_Instruction *instruction)
+{
+    int n = instruction->n;
+
+    if (machine->HighRes)
+    {
+        memmove(machine->HiresBuffer[n], machine->HiresBuffer[0], (C8_HIRES_HEIGHT - n) * sizeof(machine->HiresBuffer[0]));
+        memset(machine->HiresBuffer[0], 0, n * sizeof(machine->HiresBuffer[0]));
+    }
+    else
+    {
+        memmove(&machine->Buffer[n], &machine->Buffer[0], (C8_HEIGHT - n) * sizeof(machine->Buffer[0]));
+        memset(&machine->Buffer[0], 0, n * sizeof(machine->Buffer[0]));
+    }
+
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+}
+
+// Scroll the display right 4 pixels.
+void C8_SCR(C8_Machine *machine, C8_Instruction *instruction)
+{
+    if (machine->HighRes)
+    {
+        for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+        {
+            shift_row_right(machine->HiresBuffer[i], 4);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < C8_HEIGHT; i++)
+        {
+            machine->Buffer[i] >>= 4;
+        }
+    }
+
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+}
+
+// Scroll the display left 4 pixels.
+void C8_SCL(C8_Machine *machine, C8_Instruction *instruction)
+{
+    if (machine->HighRes)
+    {
+        for (int i = 0; i < C8_HIRES_HEIGHT; i++)
+        {
+            shift_row_left(machine->HiresBuffer[i], 4);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < C8_HEIGHT; i++)
+        {
+            machine->Buffer[i] <<= 4;
+        }
     }
+
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+}
+
+// Exit the interpreter.
+// There's nothing to exit to, so it just stops where it is (like Fx0A, with
+// no key to wait for).
+void C8_EXIT(C8_Machine *machine, C8_Instruction *instruction)
+{
+    instruction->skip = 1;
+}
+
+// Switch the display to 64x32 (LOW) or 128x64 (HIGH), both of which clear it.
+void C8_LOW(C8_Machine *machine, C8_Instruction *instruction)
+{
+    machine->HighRes = false;
+    memset(machine->Buffer, 0, sizeof(machine->Buffer));
+    memset(machine->HiresBuffer, 0, sizeof(machine->HiresBuffer));
+    machine->DirtyRows = 0xFFFFFFFF;
+    machine->DisplayChanged = true;
+}
+
+void C8_HIGH(C8_Machine *machine, C8_Instruction *instruction)
+{
+    C8_LOW(machine, instruction);
+    machine->HighRes = true;
 }
 
-void render_keypad(int posX, int posY)
+// Set I = location of the big (8x10) sprite for digit Vx.
+void C8_LD_HF_VX(C8_Machine *machine, C8_Instruction *instruction)
+{
+    machine->I = C8_BIG_FONT_ADDR + ((machine->V[instruction->x] & 0xF) * C8_BIG_FONT_SIZE);
+}
+
+// Store V0 through Vx in the flag registers, and read them back again.
+void C8_LD_R_VX(C8_Machine *machine, C8_Instruction *instruction)
+{
+    memcpy(machine->Flags, machine->V, instruction->x + 1);
+}
+
+void C8_LD_VX_R(C8_Machine *machine, C8_Instruction *instruction)
+{
+    memcpy(machine->V, machine->Flags, instruction->x + 1);
+}
+
+// Redraws the keypad texture with the given keys (one bit each) held down.
+void draw_keypad(unsigned short keys)
 {
     // There is NOTHING clever about this. We're not measuring fonts.
     // We're not looping through keys. We're just hard-coded writing a 
     // keypad graphic + text to the screen... This shows the user when
-    // they're pressing keys and also shows them what keys to use.
+    // they're pressing keys and also shows them what keys to use
+    // (whichever ones --keymap says).
     const int rowHeight = 25;
+    const int posX = 0;
+    const int posY = 0;
+
+    bool pressed[16];
+    for (int i = 0; i < 16; i++)
+    {
+        pressed[i] = (keys >> i) & 1;
+    }
+
+    BeginTextureMode(C8_KeypadTexture);
+
+    ClearBackground(RAYWHITE);
 
     // Row 1
     { 
         int colX = posX;
         int rowY = posY;
 
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_ONE) ? DARKGREEN : DARKGRAY);
-        DrawText("1", colX + 7, rowY + 1, 20, IsKeyDown(KEY_ONE) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x1] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x1], colX + 7, rowY + 1, 20, pressed[0x1] ? WHITE : GREEN);
 
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_TWO) ? DARKGREEN : DARKGRAY);
-        DrawText("2", colX + 5, rowY + 1, 20, IsKeyDown(KEY_TWO) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x2] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x2], colX + 5, rowY + 1, 20, pressed[0x2] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_THREE) ? DARKGREEN : DARKGRAY);
-        DrawText("3", colX + 5, rowY + 1, 20, IsKeyDown(KEY_THREE) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x3] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x3], colX + 5, rowY + 1, 20, pressed[0x3] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_FOUR) ? DARKGREEN : DARKGRAY);
-        DrawText("4", colX + 5, rowY + 1, 20, IsKeyDown(KEY_FOUR) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xC] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xC], colX + 5, rowY + 1, 20, pressed[0xC] ? WHITE : GREEN);
     }
 
     // Row 2
@@ -1031,20 +7744,20 @@ void render_keypad(int posX, int posY)
         int colX = posX;
         int rowY = posY + rowHeight;      
 
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_Q) ? DARKGREEN : DARKGRAY);
-        DrawText("Q", colX + 4, rowY + 1, 20, IsKeyDown(KEY_Q) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x4] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x4], colX + 4, rowY + 1, 20, pressed[0x4] ? WHITE : GREEN);
 
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_W) ? DARKGREEN : DARKGRAY);
-        DrawText("W", colX + 3, rowY + 1, 20, IsKeyDown(KEY_W) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x5] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x5], colX + 3, rowY + 1, 20, pressed[0x5] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_E) ? DARKGREEN : DARKGRAY);
-        DrawText("E", colX + 4, rowY + 1, 20, IsKeyDown(KEY_E) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x6] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x6], colX + 4, rowY + 1, 20, pressed[0x6] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_R) ? DARKGREEN : DARKGRAY);
-        DrawText("R", colX + 4, rowY + 1, 20, IsKeyDown(KEY_R) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xD] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xD], colX + 4, rowY + 1, 20, pressed[0xD] ? WHITE : GREEN);
     }
 
     // Row 3
@@ -1052,20 +7765,20 @@ void render_keypad(int posX, int posY)
         int colX = posX;
         int rowY = posY + (rowHeight * 2);     
 
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_A) ? DARKGREEN : DARKGRAY);
-        DrawText("A", colX + 4, rowY + 1, 20, IsKeyDown(KEY_A) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x7] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x7], colX + 4, rowY + 1, 20, pressed[0x7] ? WHITE : GREEN);
 
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_S) ? DARKGREEN : DARKGRAY);
-        DrawText("S", colX + 4, rowY + 1, 20, IsKeyDown(KEY_S) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x8] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x8], colX + 4, rowY + 1, 20, pressed[0x8] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_D) ? DARKGREEN : DARKGRAY);
-        DrawText("D", colX + 4, rowY + 1, 20, IsKeyDown(KEY_D) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x9] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x9], colX + 4, rowY + 1, 20, pressed[0x9] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_F) ? DARKGREEN : DARKGRAY);
-        DrawText("F", colX + 4, rowY + 1, 20, IsKeyDown(KEY_F) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xE] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xE], colX + 4, rowY + 1, 20, pressed[0xE] ? WHITE : GREEN);
     }
 
     // Row 4
@@ -1073,60 +7786,62 @@ void render_keypad(int posX, int posY)
         int colX = posX;
         int rowY = posY + (rowHeight * 3);  
 
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_Z) ? DARKGREEN : DARKGRAY);
-        DrawText("Z", colX + 4, rowY + 1, 20, IsKeyDown(KEY_Z) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xA] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xA], colX + 4, rowY + 1, 20, pressed[0xA] ? WHITE : GREEN);
 
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_X) ? DARKGREEN : DARKGRAY);
-        DrawText("X", colX + 4, rowY + 1, 20, IsKeyDown(KEY_X) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0x0] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0x0], colX + 4, rowY + 1, 20, pressed[0x0] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_C) ? DARKGREEN : DARKGRAY);
-        DrawText("C", colX + 4, rowY + 1, 20, IsKeyDown(KEY_C) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xB] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xB], colX + 4, rowY + 1, 20, pressed[0xB] ? WHITE : GREEN);
         
         colX += 25;
-        DrawRectangle(colX, rowY, 20, 20, IsKeyDown(KEY_V) ? DARKGREEN : DARKGRAY);
-        DrawText("V", colX + 3, rowY + 1, 20, IsKeyDown(KEY_V) ? WHITE : GREEN);
+        DrawRectangle(colX, rowY, 20, 20, pressed[0xF] ? DARKGREEN : DARKGRAY);
+        DrawText(C8_KeyLabels[0xF], colX + 3, rowY + 1, 20, pressed[0xF] ? WHITE : GREEN);
     }
+
+    EndTextureMode();
 }
 
 //----------------------------------------------------------------------------------
 // Follows Testing-Only Functions
 //----------------------------------------------------------------------------------
 
-void test_draw_font(C8_Instruction *instruction, char font, unsigned char xpos, unsigned char ypos)
+void test_draw_font(C8_Machine *machine, C8_Instruction *instruction, char font, unsigned char xpos, unsigned char ypos)
 {
-    C8_I = font;
+    machine->I = font;
     instruction->n = 5;
     instruction->x = 0;
     instruction->y = 1;
-    C8_V[0] = xpos;
-    C8_V[1] = ypos;
-    C8_DRW_VX_VY_NIBBLE(instruction);
+    machine->V[0] = xpos;
+    machine->V[1] = ypos;
+    C8_DRW_VX_VY_NIBBLE(machine, instruction);
 }
 
 // Uses the C8_DRW_VX_VY_NIBBLE() function to draw the hexfont sprites to screen buffer.
-void test_font()
+void test_font(C8_Machine *machine)
 {    
     C8_Instruction test_instruction = {0};
 
-    test_draw_font(&test_instruction, C8_FONT_0_ADDR, 1, 1);
-    test_draw_font(&test_instruction, C8_FONT_1_ADDR, 6, 1);
-    test_draw_font(&test_instruction, C8_FONT_2_ADDR, 11, 1);
-    test_draw_font(&test_instruction, C8_FONT_3_ADDR, 16, 1);
+    test_draw_font(machine, &test_instruction, C8_FONT_0_ADDR, 1, 1);
+    test_draw_font(machine, &test_instruction, C8_FONT_1_ADDR, 6, 1);
+    test_draw_font(machine, &test_instruction, C8_FONT_2_ADDR, 11, 1);
+    test_draw_font(machine, &test_instruction, C8_FONT_3_ADDR, 16, 1);
 
-    test_draw_font(&test_instruction, C8_FONT_4_ADDR, 1, 7);
-    test_draw_font(&test_instruction, C8_FONT_5_ADDR, 6, 7);
-    test_draw_font(&test_instruction, C8_FONT_6_ADDR, 11, 7);
-    test_draw_font(&test_instruction, C8_FONT_7_ADDR, 16, 7);
+    test_draw_font(machine, &test_instruction, C8_FONT_4_ADDR, 1, 7);
+    test_draw_font(machine, &test_instruction, C8_FONT_5_ADDR, 6, 7);
+    test_draw_font(machine, &test_instruction, C8_FONT_6_ADDR, 11, 7);
+    test_draw_font(machine, &test_instruction, C8_FONT_7_ADDR, 16, 7);
  
-    test_draw_font(&test_instruction, C8_FONT_8_ADDR, 1, 13);
-    test_draw_font(&test_instruction, C8_FONT_9_ADDR, 6, 13);
-    test_draw_font(&test_instruction, C8_FONT_A_ADDR, 11, 13);
-    test_draw_font(&test_instruction, C8_FONT_B_ADDR, 16, 13);
+    test_draw_font(machine, &test_instruction, C8_FONT_8_ADDR, 1, 13);
+    test_draw_font(machine, &test_instruction, C8_FONT_9_ADDR, 6, 13);
+    test_draw_font(machine, &test_instruction, C8_FONT_A_ADDR, 11, 13);
+    test_draw_font(machine, &test_instruction, C8_FONT_B_ADDR, 16, 13);
  
-    test_draw_font(&test_instruction, C8_FONT_C_ADDR, 1, 19);
-    test_draw_font(&test_instruction, C8_FONT_D_ADDR, 6, 19);
-    test_draw_font(&test_instruction, C8_FONT_E_ADDR, 11, 19);
-    test_draw_font(&test_instruction, C8_FONT_F_ADDR, 16, 19);
+    test_draw_font(machine, &test_instruction, C8_FONT_C_ADDR, 1, 19);
+    test_draw_font(machine, &test_instruction, C8_FONT_D_ADDR, 6, 19);
+    test_draw_font(machine, &test_instruction, C8_FONT_E_ADDR, 11, 19);
+    test_draw_font(machine, &test_instruction, C8_FONT_F_ADDR, 16, 19);
 }
\ No newline at end of file